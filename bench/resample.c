@@ -0,0 +1,86 @@
+// Direct Sound resampler throughput, per variant.
+//   make bench && ./bench/resample [seconds of audio]
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include "resample.h"
+
+#define OUT_RATE        48000
+#define FRAME_RATE      59.7275
+#define CHUNK           1024
+
+static const double in_rates[] = { 10512, 13379, 18157, 21024, 31536, 32768, 65536 };
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Runs `seconds` of a chirp at `in_rate` through `fn` in per-frame batches
+// like the APU does, returns seconds spent resampling. The first `keep`
+// outputs land in `out`.
+static double run(resample_fn fn, double in_rate, double seconds, float *out, uint32_t keep) {
+    static struct resampler r;
+    static int8_t batch[8192];
+    static float chunk[CHUNK];
+    double in_pos = 0, out_pos = 0, spent = 0;
+    uint32_t written = 0;
+
+    resampler_init(&r);
+    r.run = fn;
+    resampler_set_rates(&r, in_rate, OUT_RATE);
+
+    for (unsigned frame = 0; frame < seconds * FRAME_RATE; frame++) {
+        uint32_t n = (uint32_t)((frame + 1) * in_rate / FRAME_RATE - in_pos);
+        for (uint32_t i = 0; i < n; i++, in_pos++) {
+            double t = in_pos / in_rate;
+            batch[i] = (int8_t)(100 * sin(2 * M_PI * (200 + 2000 * t) * t));
+        }
+        uint32_t m = (uint32_t)((frame + 1) * OUT_RATE / FRAME_RATE - out_pos);
+        out_pos += m;
+
+        double start = now();
+        resampler_push(&r, batch, n);
+        while (m) {
+            uint32_t c = m < CHUNK ? m : CHUNK;
+            resampler_read(&r, chunk, c);
+            for (uint32_t i = 0; i < c && written < keep; i++)
+                out[written++] = chunk[i];
+            m -= c;
+        }
+        spent += now() - start;
+    }
+    return spent;
+}
+
+int main(int argc, char **argv) {
+    static const char *const variants[] = { "scalar", "sse", "avx2" };
+    double seconds = argc > 1 ? atof(argv[1]) : 60;
+    uint32_t keep = OUT_RATE;
+    float *reference = malloc(keep * sizeof(float));
+    float *out = malloc(keep * sizeof(float));
+
+    printf("%-8s %9s %12s %10s %10s\n", "variant", "in Hz", "ns/sample", "realtime", "max diff");
+    for (unsigned r = 0; r < sizeof(in_rates) / sizeof(in_rates[0]); r++) {
+        run(resample_variant("scalar"), in_rates[r], 1, reference, keep);
+
+        for (unsigned v = 0; v < sizeof(variants) / sizeof(variants[0]); v++) {
+            resample_fn fn = resample_variant(variants[v]);
+            if (!fn)
+                continue;
+
+            double spent = run(fn, in_rates[r], seconds, out, keep);
+            float diff = 0;
+            for (uint32_t i = 0; i < keep; i++)
+                diff = fmaxf(diff, fabsf(out[i] - reference[i]));
+
+            printf("%-8s %9.0f %12.2f %9.0fx %10.2g\n", variants[v], in_rates[r],
+                   spent * 1e9 / (seconds * OUT_RATE), seconds / spent, diff);
+        }
+    }
+    free(reference);
+    free(out);
+    return 0;
+}
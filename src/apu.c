@@ -0,0 +1,239 @@
+#include "apu.h"
+#include "audio.h"
+#include "capture.h"
+#include <string.h>
+
+struct apu apu = {0};
+
+// PSG register behind each byte of 0x60-0x9F, 0 where there is none.
+static const uint8_t psg_reg[REG_FIFO_A - REG_SOUND1CNT_L] = {
+    [0x60 - 0x60] = NR10, [0x62 - 0x60] = NR11, [0x63 - 0x60] = NR12,
+    [0x64 - 0x60] = NR13, [0x65 - 0x60] = NR14,
+    [0x68 - 0x60] = NR21, [0x69 - 0x60] = NR22,
+    [0x6C - 0x60] = NR23, [0x6D - 0x60] = NR24,
+    [0x70 - 0x60] = NR30, [0x72 - 0x60] = NR31, [0x73 - 0x60] = NR32,
+    [0x74 - 0x60] = NR33, [0x75 - 0x60] = NR34,
+    [0x78 - 0x60] = NR41, [0x79 - 0x60] = NR42,
+    [0x7C - 0x60] = NR43, [0x7D - 0x60] = NR44,
+    [0x80 - 0x60] = NR50, [0x81 - 0x60] = NR51,
+    [0x84 - 0x60] = NR52,
+    [0x90 - 0x60] = WAVE_RAM + 0x0, WAVE_RAM + 0x1, WAVE_RAM + 0x2, WAVE_RAM + 0x3,
+                    WAVE_RAM + 0x4, WAVE_RAM + 0x5, WAVE_RAM + 0x6, WAVE_RAM + 0x7,
+                    WAVE_RAM + 0x8, WAVE_RAM + 0x9, WAVE_RAM + 0xA, WAVE_RAM + 0xB,
+                    WAVE_RAM + 0xC, WAVE_RAM + 0xD, WAVE_RAM + 0xE, WAVE_RAM + 0xF,
+};
+
+// SOUNDCNT_H bits 0-1: 25%, 50%, 100%, prohibited. Full PSG output stays
+// below a third of the int16 range, as does each Direct Sound channel.
+static const int32_t psg_scale[4] = { 5, 10, 20, 20 };
+static const uint8_t prescaler_shift[4] = { 0, 6, 8, 10 };
+
+#define MIX_CHUNK       1024
+#define DIRECT_GAIN     40.0f   // per sample step at 50%
+
+static uint16_t io16(const struct apu *apu, uint32_t offset) {
+    return apu->io[offset] | apu->io[offset + 1] << 8;
+}
+
+void apu_init(struct apu *apu, uint8_t *io) {
+    memset(apu, 0, sizeof(*apu));
+    apu->io = io;
+    apu->out_rate = apu->next_rate = AUDIO_RATE;
+    psg_init(&apu->psg, GBA_CLOCK / PSG_DMG_CLOCK, AUDIO_RATE, true);
+    psg_set_scale(&apu->psg, psg_scale[0], 0);
+    resampler_init(&apu->fifo[0].resampler);
+    resampler_init(&apu->fifo[1].resampler);
+}
+
+void apu_free(struct apu *apu) {
+    psg_free(&apu->psg);
+}
+
+// Cycles between overflows of timer `t`, 0 while it is stopped. There is no
+// timer core yet, the reload and control registers are read as written.
+static uint64_t timer_period(const struct apu *apu, unsigned t) {
+    uint16_t control = io16(apu, REG_TM0CNT_H + t * 4);
+    uint64_t ticks = 0x10000 - io16(apu, REG_TM0CNT_L + t * 4);
+
+    if (!(control & 0x80))
+        return 0;
+    if (t == 1 && (control & 4))
+        return timer_period(apu, 0) * ticks;
+    return ticks << prescaler_shift[control & 3];
+}
+
+static unsigned fifo_timer(const struct apu *apu, unsigned f) {
+    return (io16(apu, REG_SOUNDCNT_H) >> (10 + f * 4)) & 1;
+}
+
+static void fifo_push(struct apu_fifo *fifo, int8_t value) {
+    if (fifo->count < APU_FIFO_SIZE) {
+        fifo->data[(fifo->head + fifo->count) % APU_FIFO_SIZE] = value;
+        fifo->count++;
+    }
+    fifo->request = fifo->count <= APU_FIFO_SIZE / 2;
+}
+
+static void fifo_pop(struct apu_fifo *fifo, uint64_t n, bool record) {
+    // past what the FIFO and the batch hold, more pops change nothing
+    if (n > APU_FIFO_SIZE + APU_FIFO_BATCH)
+        n = APU_FIFO_SIZE + APU_FIFO_BATCH;
+
+    for (; n; n--) {
+        if (fifo->count) {
+            fifo->sample = fifo->data[fifo->head];
+            fifo->head = (fifo->head + 1) % APU_FIFO_SIZE;
+            fifo->count--;
+        }
+        if (record && fifo->batch_count < APU_FIFO_BATCH)
+            fifo->batch[fifo->batch_count++] = fifo->sample;
+    }
+    fifo->request = fifo->count <= APU_FIFO_SIZE / 2;
+}
+
+// Overflows of both timers up to `cycle`, each one pops a sample from the
+// FIFOs that follow that timer.
+static void run_fifos(struct apu *apu, uint32_t cycle) {
+    uint32_t elapsed = cycle - apu->fifo_cycle;
+    apu->fifo_cycle = cycle;
+    if (!(apu->io[REG_SOUNDCNT_X] & 0x80))
+        return;
+
+    for (unsigned t = 0; t < 2; t++) {
+        uint64_t period = timer_period(apu, t);
+        if (!period)
+            continue;
+
+        apu->timer_clock[t] += elapsed;
+        uint64_t overflows = apu->timer_clock[t] / period;
+        apu->timer_clock[t] %= period;
+
+        for (unsigned f = 0; overflows && f < 2; f++) {
+            if (fifo_timer(apu, f) == t)
+                fifo_pop(&apu->fifo[f], overflows, !apu->silent);
+        }
+    }
+}
+
+// Adds FIFO `f`'s resampled output to `frames` with its volume and panning.
+static void mix_fifo(int16_t *frames, const float *direct, uint32_t count, uint16_t control, unsigned f) {
+    float g = control & (4 << f) ? 2 * DIRECT_GAIN : DIRECT_GAIN;
+    float gain[2] = {
+        control & (0x200 << f * 4) ? g : 0,
+        control & (0x100 << f * 4) ? g : 0,
+    };
+
+    for (uint32_t i = 0; i < count; i++) {
+        for (unsigned s = 0; s < 2; s++) {
+            float v = frames[i * 2 + s] + direct[i] * gain[s];
+            v = v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : v;
+            frames[i * 2 + s] = (int16_t)v;
+        }
+    }
+}
+
+static void capture_stems(struct apu *apu, float direct[2][MIX_CHUNK], uint32_t count, uint16_t control) {
+    int16_t frames[MIX_CHUNK * AUDIO_CHANNELS];
+
+    for (unsigned c = 0; c < 4; c++) {
+        psg_read_stem(&apu->psg, c, frames, count);
+        capture_write(&capture, CAPTURE_SQUARE1 + c, frames, count);
+    }
+    for (unsigned f = 0; f < 2; f++) {
+        memset(frames, 0, count * AUDIO_CHANNELS * sizeof(int16_t));
+        mix_fifo(frames, direct[f], count, control, f);
+        capture_write(&capture, CAPTURE_FIFO_A + f, frames, count);
+    }
+}
+
+static void mix_frame(struct apu *apu) {
+    int16_t frames[MIX_CHUNK * AUDIO_CHANNELS];
+    float direct[2][MIX_CHUNK];
+
+    // the whole frame's Direct Sound samples go through in one batch
+    for (unsigned f = 0; f < 2; f++) {
+        struct apu_fifo *fifo = &apu->fifo[f];
+        uint64_t period = timer_period(apu, fifo_timer(apu, f));
+        if (period)
+            resampler_set_rates(&fifo->resampler, (double)GBA_CLOCK / period, apu->out_rate);
+        resampler_push(&fifo->resampler, fifo->batch, fifo->batch_count);
+        fifo->batch_count = 0;
+    }
+
+    uint16_t control = io16(apu, REG_SOUNDCNT_H);
+    uint32_t count;
+    while ((count = psg_read_samples(&apu->psg, frames, MIX_CHUNK))) {
+        resampler_read(&apu->fifo[0].resampler, direct[0], count);
+        resampler_read(&apu->fifo[1].resampler, direct[1], count);
+        if (capture.stems && apu->psg.stems)
+            capture_stems(apu, direct, count, control);
+
+        mix_fifo(frames, direct[0], count, control, 0);
+        mix_fifo(frames, direct[1], count, control, 1);
+        audio_output(&audio, frames, count);
+        if (capture.active)
+            capture_write(&capture, CAPTURE_MIX, frames, count);
+    }
+}
+
+static void end_frame(struct apu *apu) {
+    run_fifos(apu, apu->cycle);
+    psg_end_frame(&apu->psg, apu->cycle);
+    apu->cycle = 0;
+    apu->fifo_cycle = 0;
+
+    if (!apu->silent)
+        mix_frame(apu);
+
+    if (apu->next_rate != apu->out_rate) {
+        apu->out_rate = apu->next_rate;
+        psg_set_sample_rate(&apu->psg, apu->out_rate);
+    }
+
+    // length counters expire on their own, SOUNDCNT_X shows it
+    apu->io[REG_SOUNDCNT_X] = psg_read(&apu->psg, NR52, 0) & 0x8F;
+}
+
+void apu_tick(struct apu *apu, uint32_t cycles) {
+    apu->cycle += cycles;
+    // keeps the DMA requests current
+    run_fifos(apu, apu->cycle);
+    if (apu->cycle >= APU_FRAME_CYCLES)
+        end_frame(apu);
+}
+
+void apu_set_silent(struct apu *apu, bool silent) {
+    psg_set_silent(&apu->psg, silent, apu->cycle);
+    apu->silent = silent;
+    apu->fifo[0].batch_count = 0;
+    apu->fifo[1].batch_count = 0;
+}
+
+void apu_set_output_rate(struct apu *apu, double rate) {
+    apu->next_rate = rate;
+}
+
+void apu_io_written(struct apu *apu, uint32_t offset, uint32_t size) {
+    if (offset + size <= REG_SOUND1CNT_L || offset >= REG_SOUND_END)
+        return;
+
+    // samples due before the store still come from the old state
+    run_fifos(apu, apu->cycle);
+
+    for (uint32_t o = offset; o < offset + size; o++) {
+        if (o >= REG_FIFO_A && o < REG_SOUND_END)
+            fifo_push(&apu->fifo[(o - REG_FIFO_A) / 4], (int8_t)apu->io[o]);
+        else if (o == REG_SOUNDCNT_H)
+            psg_set_scale(&apu->psg, psg_scale[apu->io[o] & 3], apu->cycle);
+        else if (o == REG_SOUNDCNT_H + 1) {
+            // FIFO resets, write-only
+            for (unsigned f = 0; f < 2; f++) {
+                if (apu->io[o] & (0x08 << f * 4))
+                    apu->fifo[f].count = 0;
+            }
+            apu->io[o] &= 0x77;
+        } else if (o >= REG_SOUND1CNT_L && psg_reg[o - REG_SOUND1CNT_L])
+            psg_write(&apu->psg, psg_reg[o - REG_SOUND1CNT_L], apu->io[o], apu->cycle);
+    }
+    apu->io[REG_SOUNDCNT_X] = psg_read(&apu->psg, NR52, apu->cycle) & 0x8F;
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "psg.h"
+#include "resample.h"
+
+// GBA sound. The PSG is clocked from the bus side: register stores reach it
+// at the cycle apu_tick() last advanced to. Direct Sound A/B pop their FIFOs
+// on timer 0/1 overflows into per-frame batches. Once per video frame the
+// batches are resampled to the output rate, mixed with the PSG's samples and
+// handed to the audio ring.
+
+#define GBA_CLOCK           16777216
+#define APU_FRAME_CYCLES    280896      // LINE_CYCLES * LINE_COUNT
+#define APU_FRAME_RATE      ((double)GBA_CLOCK / APU_FRAME_CYCLES)
+#define APU_FIFO_SIZE       32
+#define APU_FIFO_BATCH      4096        // Direct Sound samples per frame
+
+enum {
+	REG_SOUND1CNT_L = 0x60,
+	REG_SOUNDCNT_L  = 0x80,
+	REG_SOUNDCNT_H  = 0x82,
+	REG_SOUNDCNT_X  = 0x84,
+	REG_SOUNDBIAS   = 0x88,
+	REG_WAVE_RAM    = 0x90,
+	REG_FIFO_A      = 0xA0,
+	REG_FIFO_B      = 0xA4,
+	REG_SOUND_END   = 0xA8,
+	REG_TM0CNT_L    = 0x100,
+	REG_TM0CNT_H    = 0x102,
+};
+
+struct apu_fifo {
+	int8_t data[APU_FIFO_SIZE];
+	uint8_t head;
+	uint8_t count;
+	int8_t sample;          // last popped, held while the FIFO is empty
+	bool request;           // half empty, for the DMA controller to refill
+
+	int8_t batch[APU_FIFO_BATCH];
+	uint32_t batch_count;
+	struct resampler resampler;
+};
+
+struct apu {
+	struct psg psg;
+	struct apu_fifo fifo[2];
+	uint64_t timer_clock[2];    // cycles towards the next overflow
+	uint8_t *io;
+	uint32_t cycle;             // since the start of the audio frame
+	uint32_t fifo_cycle;        // the FIFOs have run up to here
+	double out_rate;            // of the current frame's samples
+	double next_rate;           // from the next frame on
+	bool silent;
+};
+
+extern struct apu apu;
+
+void apu_init(struct apu *apu, uint8_t *io);
+void apu_free(struct apu *apu);
+
+void apu_tick(struct apu *apu, uint32_t cycles);
+
+// Cycles until the current audio frame ends.
+static inline uint32_t apu_cycles_to_event(const struct apu *apu) {
+	return apu->cycle < APU_FRAME_CYCLES ? APU_FRAME_CYCLES - apu->cycle : 1;
+}
+
+// Sample rate to generate at, for rate control. Takes effect at the next
+// audio frame so no frame mixes two rates.
+void apu_set_output_rate(struct apu *apu, double rate);
+
+// Audio-disabled mode, for runs nobody listens to: registers, length
+// counters, sweeps and FIFO DMA requests behave as usual, but no samples are
+// synthesized, resampled or mixed.
+void apu_set_silent(struct apu *apu, bool silent);
+
+// Called by the bus after a store of `size` bytes into IO at `offset`.
+void apu_io_written(struct apu *apu, uint32_t offset, uint32_t size);
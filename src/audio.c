@@ -0,0 +1,148 @@
+#include "audio.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <SDL3/SDL_init.h>
+#include <SDL3/SDL_audio.h>
+#include <SDL3/SDL_log.h>
+
+struct audio audio = {0};
+
+bool audio_ring_init(struct audio_ring *ring, uint32_t capacity) {
+    assert(capacity && (capacity & (capacity - 1)) == 0);
+
+    memset(ring, 0, sizeof(*ring));
+    ring->frames = calloc(capacity, AUDIO_CHANNELS * sizeof(int16_t));
+    ring->capacity = capacity;
+    return ring->frames != NULL;
+}
+
+void audio_ring_free(struct audio_ring *ring) {
+    free(ring->frames);
+    ring->frames = NULL;
+}
+
+// Copies `count` frames between the ring at `index` and `linear`, in at most
+// two pieces around the wrap.
+static void ring_copy(struct audio_ring *ring, uint32_t index, int16_t *linear, uint32_t count, bool to_ring) {
+    uint32_t start = index & (ring->capacity - 1);
+    uint32_t first = count < ring->capacity - start ? count : ring->capacity - start;
+    size_t frame = AUDIO_CHANNELS * sizeof(int16_t);
+
+    if (to_ring) {
+        memcpy(ring->frames + start * AUDIO_CHANNELS, linear, first * frame);
+        memcpy(ring->frames, linear + first * AUDIO_CHANNELS, (count - first) * frame);
+    } else {
+        memcpy(linear, ring->frames + start * AUDIO_CHANNELS, first * frame);
+        memcpy(linear + first * AUDIO_CHANNELS, ring->frames, (count - first) * frame);
+    }
+}
+
+uint32_t audio_ring_write(struct audio_ring *ring, const int16_t *frames, uint32_t count) {
+    uint32_t head = ring->head;
+    uint32_t space = ring->capacity - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+
+    if (count > space) {
+        ring->overruns++;
+        ring->overrun_frames += count - space;
+        count = space;
+    }
+
+    ring_copy(ring, head, (int16_t *)frames, count, true);
+    __atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE);
+    return count;
+}
+
+uint32_t audio_ring_read(struct audio_ring *ring, int16_t *frames, uint32_t count) {
+    uint32_t tail = ring->tail;
+    uint32_t available = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+    uint32_t got = count < available ? count : available;
+
+    ring_copy(ring, tail, frames, got, false);
+    __atomic_store_n(&ring->tail, tail + got, __ATOMIC_RELEASE);
+
+    if (got < count) {
+        ring->underruns++;
+        ring->underrun_frames += count - got;
+        memset(frames + got * AUDIO_CHANNELS, 0, (count - got) * AUDIO_CHANNELS * sizeof(int16_t));
+    }
+    return got;
+}
+
+uint32_t audio_ring_fill(const struct audio_ring *ring) {
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+bool audio_refresh_locked(double frame_rate, double refresh_rate) {
+    return refresh_rate > 0 && fabs(refresh_rate / frame_rate - 1) < AUDIO_MAX_LOCK_SKEW;
+}
+
+double audio_sync_rate(const struct audio *audio, double frame_rate, double refresh_rate) {
+    double rate = AUDIO_RATE;
+
+    if (audio_refresh_locked(frame_rate, refresh_rate))
+        rate *= frame_rate / refresh_rate;
+    if (!audio->open)
+        return rate;
+
+    double error = ((double)AUDIO_TARGET_FILL - audio_ring_fill(&audio->ring)) / AUDIO_TARGET_FILL;
+    error = error > 1 ? 1 : error < -1 ? -1 : error;
+    return rate * (1 + AUDIO_MAX_SKEW * error);
+}
+
+// SDL asks for `additional` more bytes whenever the device runs low.
+static void SDLCALL feed_stream(void *userdata, SDL_AudioStream *stream, int additional, int total) {
+    struct audio *audio = userdata;
+    int16_t chunk[512 * AUDIO_CHANNELS];
+    uint32_t frame = AUDIO_CHANNELS * sizeof(int16_t);
+    (void)total;
+
+    while (additional > 0) {
+        uint32_t count = (additional + frame - 1) / frame;
+        if (count > 512)
+            count = 512;
+
+        audio_ring_read(&audio->ring, chunk, count);
+        SDL_PutAudioStreamData(stream, chunk, count * frame);
+        additional -= count * frame;
+    }
+}
+
+bool audio_open(struct audio *audio) {
+    const SDL_AudioSpec spec = { SDL_AUDIO_S16, AUDIO_CHANNELS, AUDIO_RATE };
+
+    assert(!audio->open);
+    if (!audio_ring_init(&audio->ring, AUDIO_RING_FRAMES))
+        return false;
+
+    if (!SDL_InitSubSystem(SDL_INIT_AUDIO)) {
+        SDL_Log("SDL audio init failed: %s", SDL_GetError());
+        audio_ring_free(&audio->ring);
+        return false;
+    }
+
+    audio->stream = SDL_OpenAudioDeviceStream(SDL_AUDIO_DEVICE_DEFAULT_PLAYBACK, &spec, feed_stream, audio);
+    if (!audio->stream) {
+        SDL_Log("no audio device: %s", SDL_GetError());
+        SDL_QuitSubSystem(SDL_INIT_AUDIO);
+        audio_ring_free(&audio->ring);
+        return false;
+    }
+
+    audio->open = true;
+    SDL_ResumeAudioStreamDevice(audio->stream);
+    return true;
+}
+
+void audio_close(struct audio *audio) {
+    if (!audio->open)
+        return;
+
+    // stops the callback before the ring goes away
+    SDL_DestroyAudioStream(audio->stream);
+    SDL_QuitSubSystem(SDL_INIT_AUDIO);
+    audio_ring_free(&audio->ring);
+    audio->stream = NULL;
+    audio->open = false;
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// Audio output. The APU, on the emulation thread, writes interleaved stereo
+// frames into a single producer / single consumer ring; the SDL audio stream
+// callback, on SDL's audio thread, drains it. Neither side ever blocks or
+// takes a lock: a full ring drops the newest frames, an empty one plays
+// silence, and both are counted.
+
+#define AUDIO_RATE          48000
+#define AUDIO_CHANNELS      2
+#define AUDIO_RING_FRAMES   8192    // ~170ms at 48kHz, a power of two
+
+// Dynamic rate control: the output rate is nudged by at most AUDIO_MAX_SKEW
+// to hold the ring around AUDIO_TARGET_FILL, and video locks to the display
+// when its refresh is within AUDIO_MAX_LOCK_SKEW of the emulated frame rate.
+#define AUDIO_TARGET_FILL   2048    // ~43ms
+#define AUDIO_MAX_SKEW      0.005
+#define AUDIO_MAX_LOCK_SKEW 0.01
+
+struct audio_ring {
+	int16_t *frames;        // AUDIO_CHANNELS samples per frame
+	uint32_t capacity;      // in frames, a power of two
+
+	// producer side: writes that didn't fit, and the frames they dropped
+	uint32_t head __attribute__((aligned(64)));
+	uint64_t overruns;
+	uint64_t overrun_frames;
+
+	// consumer side: reads that found too few frames, and the silence played
+	uint32_t tail __attribute__((aligned(64)));
+	uint64_t underruns;
+	uint64_t underrun_frames;
+};
+
+bool audio_ring_init(struct audio_ring *ring, uint32_t capacity);
+void audio_ring_free(struct audio_ring *ring);
+
+// Both return how many frames were actually moved.
+uint32_t audio_ring_write(struct audio_ring *ring, const int16_t *frames, uint32_t count);
+uint32_t audio_ring_read(struct audio_ring *ring, int16_t *frames, uint32_t count);
+
+// Frames waiting to be played; exact for the consumer, a lower bound for
+// the producer and vice versa.
+uint32_t audio_ring_fill(const struct audio_ring *ring);
+
+struct audio {
+	struct SDL_AudioStream *stream;
+	struct audio_ring ring;
+	bool open;
+};
+
+extern struct audio audio;
+
+// Opens the default playback device at AUDIO_RATE. Fails without an audio
+// device, audio_output() then drops everything.
+bool audio_open(struct audio *audio);
+void audio_close(struct audio *audio);
+
+// Whether presenting at `refresh_rate` (0 if not vsynced) paces one emulated
+// frame per refresh closely enough to lock to it.
+bool audio_refresh_locked(double frame_rate, double refresh_rate);
+
+// Rate the APU should generate at, given the emulated frame rate and the
+// refresh rate the frontend presents at (0 if a timer paces it). With
+// one emulated frame per refresh the nominal rate is scaled so a refresh's
+// worth of samples plays in exactly one refresh, then corrected by the ring
+// fill so neither drift nor jitter ever drains or overflows it.
+double audio_sync_rate(const struct audio *audio, double frame_rate, double refresh_rate);
+
+// Called by the APU with mixed frames.
+static inline void audio_output(struct audio *audio, const int16_t *frames, uint32_t count) {
+	if (audio->open)
+		audio_ring_write(&audio->ring, frames, count);
+}
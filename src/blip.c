@@ -0,0 +1,108 @@
+#include "blip.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+// Slight high-pass in the integrator, keeps DC from the unipolar channel
+// outputs out of the stream.
+#define BASS_SHIFT      9
+
+static int16_t kernel[BLIP_PHASES][BLIP_TAPS];
+static bool kernel_ready;
+
+// Band-limited impulse, a Blackman windowed sinc cut a little below Nyquist,
+// sampled at each of the phases. Every phase is normalized to sum exactly
+// to one unit so a step always integrates to its full height.
+static void build_kernel(void) {
+    const double cutoff = 0.9;
+
+    for (int p = 0; p < BLIP_PHASES; p++) {
+        double taps[BLIP_TAPS], sum = 0;
+
+        for (int t = 0; t < BLIP_TAPS; t++) {
+            double x = t - (BLIP_TAPS / 2 - 1) - (double)p / BLIP_PHASES;
+            double w = x / (BLIP_TAPS / 2);
+            double window = fabs(w) >= 1 ? 0 : 0.42 + 0.5 * cos(M_PI * w) + 0.08 * cos(2 * M_PI * w);
+            double sinc = x == 0 ? 1 : sin(M_PI * cutoff * x) / (M_PI * cutoff * x);
+            taps[t] = sinc * window;
+            sum += taps[t];
+        }
+
+        int32_t total = 0;
+        for (int t = 0; t < BLIP_TAPS; t++) {
+            kernel[p][t] = lround(taps[t] / sum * (1 << BLIP_UNIT_SHIFT));
+            total += kernel[p][t];
+        }
+        // rounding error goes to the center tap
+        kernel[p][BLIP_TAPS / 2 - 1] += (1 << BLIP_UNIT_SHIFT) - total;
+    }
+    kernel_ready = true;
+}
+
+bool blip_init(struct blip *b, uint32_t size) {
+    if (!kernel_ready)
+        build_kernel();
+
+    memset(b, 0, sizeof(*b));
+    b->buffer = calloc(size + BLIP_TAPS, sizeof(int32_t));
+    b->size = size;
+    return b->buffer != NULL;
+}
+
+void blip_free(struct blip *b) {
+    free(b->buffer);
+    b->buffer = NULL;
+}
+
+void blip_set_rates(struct blip *b, double clock_rate, double sample_rate) {
+    b->factor = (uint64_t)(sample_rate / clock_rate * (1ULL << BLIP_FRAC_BITS) + 0.5);
+}
+
+void blip_clear(struct blip *b) {
+    b->offset = 0;
+    b->integrator = 0;
+    memset(b->buffer, 0, (b->size + BLIP_TAPS) * sizeof(int32_t));
+}
+
+void blip_add_delta(struct blip *b, uint32_t clock, int32_t delta) {
+    uint64_t fixed = clock * b->factor + b->offset;
+    uint32_t index = fixed >> BLIP_FRAC_BITS;
+    unsigned phase = (fixed >> (BLIP_FRAC_BITS - BLIP_PHASE_BITS)) & (BLIP_PHASES - 1);
+
+    assert(index < b->size);
+    int32_t *out = &b->buffer[index];
+    const int16_t *k = kernel[phase];
+    for (int t = 0; t < BLIP_TAPS; t++)
+        out[t] += k[t] * delta;
+}
+
+void blip_end_frame(struct blip *b, uint32_t clocks) {
+    b->offset += clocks * b->factor;
+    assert(blip_samples_avail(b) <= b->size);
+}
+
+uint32_t blip_read_samples(struct blip *b, int16_t *out, uint32_t count, unsigned stride) {
+    uint32_t avail = blip_samples_avail(b);
+    if (count > avail)
+        count = avail;
+
+    int32_t sum = b->integrator;
+    for (uint32_t i = 0; i < count; i++) {
+        int32_t s = sum >> BLIP_UNIT_SHIFT;
+        if (s > INT16_MAX) s = INT16_MAX;
+        if (s < INT16_MIN) s = INT16_MIN;
+        out[i * stride] = s;
+
+        sum += b->buffer[i];
+        sum -= s << (BLIP_UNIT_SHIFT - BASS_SHIFT);
+    }
+    b->integrator = sum;
+
+    // keep the unread samples and the tails still ringing into them
+    uint32_t remain = avail - count + BLIP_TAPS;
+    memmove(b->buffer, b->buffer + count, remain * sizeof(int32_t));
+    memset(b->buffer + remain, 0, count * sizeof(int32_t));
+    b->offset -= (uint64_t)count << BLIP_FRAC_BITS;
+    return count;
+}
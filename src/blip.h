@@ -0,0 +1,45 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// Band-limited step synthesis. Instead of sampling a waveform every clock,
+// sound generators report each change of their output as an amplitude delta
+// at the clock it happens on. Every delta is spread over BLIP_TAPS output
+// samples with a windowed-sinc kernel picked by its sub-sample phase, and
+// the buffer is integrated when samples are read, which turns the impulses
+// back into band-limited steps: no aliasing, and the cost scales with the
+// number of transitions rather than with the clock rate.
+
+#define BLIP_PHASE_BITS     5
+#define BLIP_PHASES         (1 << BLIP_PHASE_BITS)
+#define BLIP_TAPS           16
+#define BLIP_UNIT_SHIFT     15      // kernel phases sum to 1 << 15
+#define BLIP_FRAC_BITS      32
+
+struct blip {
+	uint64_t factor;        // output samples per clock, 32.32 fixed point
+	uint64_t offset;        // position of clock 0 of the current frame
+	uint32_t size;          // samples the buffer can hold
+	int32_t integrator;
+	int32_t *buffer;        // size + BLIP_TAPS deltas
+};
+
+bool blip_init(struct blip *b, uint32_t size);
+void blip_free(struct blip *b);
+void blip_set_rates(struct blip *b, double clock_rate, double sample_rate);
+void blip_clear(struct blip *b);
+
+// Adds an output change of `delta` at `clock`, relative to the frame start.
+void blip_add_delta(struct blip *b, uint32_t clock, int32_t delta);
+
+// Ends the frame `clocks` long; the next frame's clock 0 follows it.
+void blip_end_frame(struct blip *b, uint32_t clocks);
+
+// Samples complete so far.
+static inline uint32_t blip_samples_avail(const struct blip *b) {
+	return b->offset >> BLIP_FRAC_BITS;
+}
+
+// Reads up to `count` samples into `out`, `stride` int16s apart, so two
+// buffers can fill the channels of one interleaved stream.
+uint32_t blip_read_samples(struct blip *b, int16_t *out, uint32_t count, unsigned stride);
@@ -0,0 +1,205 @@
+#include "capture.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <SDL3/SDL_mutex.h>
+#include <SDL3/SDL_thread.h>
+#include <SDL3/SDL_timer.h>
+#include <SDL3/SDL_log.h>
+
+#define WAV_HEADER_SIZE     44
+#define FRAME_BYTES         (AUDIO_CHANNELS * sizeof(int16_t))
+
+struct capture capture = {0};
+
+static const char *const stream_names[CAPTURE_STREAMS] = {
+    NULL, "square1", "square2", "wave", "noise", "fifo_a", "fifo_b",
+};
+
+static bool is_wav(const char *path) {
+    const char *ext = strrchr(path, '.');
+    if (!ext || strlen(ext) != 4)
+        return false;
+    for (int i = 1; i < 4; i++) {
+        if (tolower((unsigned char)ext[i]) != "wav"[i - 1])
+            return false;
+    }
+    return true;
+}
+
+static void put_le(uint8_t *p, uint32_t value, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        p[i] = value >> (i * 8);
+}
+
+static bool write_wav_header(FILE *file, uint32_t rate, uint64_t frames) {
+    uint8_t h[WAV_HEADER_SIZE];
+    uint64_t data = frames * FRAME_BYTES;
+    uint32_t data_size = data > UINT32_MAX - WAV_HEADER_SIZE ? UINT32_MAX - WAV_HEADER_SIZE : (uint32_t)data;
+
+    memcpy(h, "RIFF", 4);
+    put_le(h + 4, data_size + WAV_HEADER_SIZE - 8, 4);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put_le(h + 16, 16, 4);                          // fmt chunk size
+    put_le(h + 20, 1, 2);                           // PCM
+    put_le(h + 22, AUDIO_CHANNELS, 2);
+    put_le(h + 24, rate, 4);
+    put_le(h + 28, rate * FRAME_BYTES, 4);          // byte rate
+    put_le(h + 32, FRAME_BYTES, 2);                 // block align
+    put_le(h + 34, 16, 2);                          // bits per sample
+    memcpy(h + 36, "data", 4);
+    put_le(h + 40, data_size, 4);
+
+    return fseek(file, 0, SEEK_SET) == 0 && fwrite(h, 1, sizeof(h), file) == sizeof(h);
+}
+
+// Moves everything queued on the stream to its file, a batch per write.
+// After a failed write (a full disk) the rest is dropped and counted, so the
+// file stays a clean prefix of the capture and its header matches it.
+static void drain(struct capture_stream *s, int16_t *batch) {
+    uint32_t count;
+
+    while ((count = audio_ring_fill(&s->ring))) {
+        if (count > CAPTURE_BATCH_FRAMES)
+            count = CAPTURE_BATCH_FRAMES;
+        audio_ring_read(&s->ring, batch, count);
+
+        size_t written = s->lost ? 0 : fwrite(batch, FRAME_BYTES, count, s->file);
+        s->frames += written;
+        s->lost += count - written;
+    }
+}
+
+static int writer_thread(void *data) {
+    struct capture *capture = data;
+    int16_t *batch = malloc(CAPTURE_BATCH_FRAMES * FRAME_BYTES);
+
+    while (true) {
+        // whatever was queued before stop was set still gets written
+        bool stop = __atomic_load_n(&capture->stop, __ATOMIC_ACQUIRE);
+
+        for (unsigned i = 0; i < CAPTURE_STREAMS; i++) {
+            if (capture->streams[i].file)
+                drain(&capture->streams[i], batch);
+        }
+        if (stop)
+            break;
+        SDL_WaitSemaphoreTimeout(capture->wakeup, 50);
+    }
+
+    free(batch);
+    return 0;
+}
+
+// path with ".name" inserted before the extension
+static char *stem_path(const char *path, const char *name) {
+    const char *dot = strrchr(path, '.');
+    const char *slash = strrchr(path, '/');
+    size_t base = dot && (!slash || dot > slash) ? (size_t)(dot - path) : strlen(path);
+    size_t size = strlen(path) + strlen(name) + 2;
+    char *out = malloc(size);
+
+    snprintf(out, size, "%.*s.%s%s", (int)base, path, name, path + base);
+    return out;
+}
+
+static bool open_stream(struct capture *capture, struct capture_stream *s, const char *path) {
+    s->file = fopen(path, "wb");
+    if (!s->file) {
+        SDL_Log("can't write %s", path);
+        return false;
+    }
+    // the writer thread batches, stdio buffering would only add a copy
+    setvbuf(s->file, NULL, _IONBF, 0);
+    if (capture->wav && !write_wav_header(s->file, capture->rate, 0)) {
+        SDL_Log("can't write %s", path);
+        return false;
+    }
+    return audio_ring_init(&s->ring, CAPTURE_RING_FRAMES);
+}
+
+static void close_streams(struct capture *capture) {
+    for (unsigned i = 0; i < CAPTURE_STREAMS; i++) {
+        struct capture_stream *s = &capture->streams[i];
+        if (!s->file)
+            continue;
+
+        const char *name = stream_names[i] ? stream_names[i] : "mix";
+        if (s->lost)
+            SDL_Log("capture: %s is truncated, %llu frames couldn't be written", name, (unsigned long long)s->lost);
+        bool ok = !capture->wav || write_wav_header(s->file, capture->rate, s->frames);
+        if (fclose(s->file) != 0 || !ok)
+            SDL_Log("capture: %s couldn't be finished", name);
+        audio_ring_free(&s->ring);
+        s->file = NULL;
+    }
+}
+
+bool capture_open(struct capture *capture, const char *path, bool stems, uint32_t rate) {
+    memset(capture, 0, sizeof(*capture));
+    capture->wav = is_wav(path);
+    capture->rate = rate;
+    capture->stems = stems;
+
+    bool ok = open_stream(capture, &capture->streams[CAPTURE_MIX], path);
+    for (unsigned i = 1; ok && stems && i < CAPTURE_STREAMS; i++) {
+        char *p = stem_path(path, stream_names[i]);
+        ok = open_stream(capture, &capture->streams[i], p);
+        free(p);
+    }
+
+    if (ok) {
+        capture->wakeup = SDL_CreateSemaphore(0);
+        capture->thread = SDL_CreateThread(writer_thread, "capture", capture);
+        ok = capture->thread != NULL;
+    }
+    if (!ok) {
+        if (capture->wakeup)
+            SDL_DestroySemaphore(capture->wakeup);
+        close_streams(capture);
+        memset(capture, 0, sizeof(*capture));
+        return false;
+    }
+
+    capture->active = true;
+    return true;
+}
+
+void capture_close(struct capture *capture) {
+    if (!capture->active)
+        return;
+
+    __atomic_store_n(&capture->stop, true, __ATOMIC_RELEASE);
+    SDL_SignalSemaphore(capture->wakeup);
+    SDL_WaitThread(capture->thread, NULL);
+    SDL_DestroySemaphore(capture->wakeup);
+
+    if (capture->stalls)
+        SDL_Log("capture: waited %llu times for the disk", (unsigned long long)capture->stalls);
+    close_streams(capture);
+    capture->active = false;
+}
+
+void capture_write(struct capture *capture, unsigned stream, const int16_t *frames, uint32_t count) {
+    struct audio_ring *ring = &capture->streams[stream].ring;
+
+    while (count) {
+        uint32_t fill = audio_ring_fill(ring);
+        uint32_t n = ring->capacity - fill;
+        if (!n) {
+            capture->stalls++;
+            SDL_SignalSemaphore(capture->wakeup);
+            SDL_Delay(1);
+            continue;
+        }
+        if (n > count)
+            n = count;
+
+        audio_ring_write(ring, frames, n);
+        // one wakeup per batch, not per frame
+        if (fill < CAPTURE_BATCH_FRAMES && fill + n >= CAPTURE_BATCH_FRAMES)
+            SDL_SignalSemaphore(capture->wakeup);
+        frames += n * AUDIO_CHANNELS;
+        count -= n;
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "audio.h"
+
+// Audio capture, for regression comparisons. The APU copies the mixed output
+// and, optionally, each channel's own output (stems) into large single
+// producer / single consumer rings; a writer thread drains them to WAV or
+// raw PCM files in big batched writes, so file I/O never runs on the
+// emulation thread. Capture is lossless: the producer only waits if the disk
+// falls a whole ring behind, and counts it.
+
+#define CAPTURE_RING_FRAMES     (1 << 20)   // ~22s at 48kHz per stream
+#define CAPTURE_BATCH_FRAMES    (1 << 14)   // per write
+
+enum {
+	CAPTURE_MIX,
+	CAPTURE_SQUARE1,
+	CAPTURE_SQUARE2,
+	CAPTURE_WAVE,
+	CAPTURE_NOISE,
+	CAPTURE_FIFO_A,
+	CAPTURE_FIFO_B,
+	CAPTURE_STREAMS,
+};
+
+struct capture_stream {
+	FILE *file;
+	struct audio_ring ring;
+	uint64_t frames;        // written to the file
+	uint64_t lost;          // queued after a failed write, never written
+};
+
+struct capture {
+	struct capture_stream streams[CAPTURE_STREAMS];
+	struct SDL_Thread *thread;
+	struct SDL_Semaphore *wakeup;
+	uint32_t rate;          // in WAV headers
+	uint64_t stalls;        // producer waits for a full ring
+	bool active;
+	bool stems;
+	bool wav;
+	bool stop;
+};
+
+extern struct capture capture;
+
+// Format follows the extension: .wav gets a header, anything else is raw
+// interleaved stereo s16le. Stems go next to it as name.square1.wav etc.
+bool capture_open(struct capture *capture, const char *path, bool stems, uint32_t rate);
+void capture_close(struct capture *capture);
+
+void capture_write(struct capture *capture, unsigned stream, const int16_t *frames, uint32_t count);
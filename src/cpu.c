@@ -1,11 +1,84 @@
 #include "cpu.h"
+#include "memory.h"
+#include "predecode.h"
 #include <assert.h>
+#include <string.h>
 
 struct cpu cpu = {0};
 
 define_field_from_type(uint32_t, u32)
 define_field_from_type(uint64_t, u64)
 
+// SP/LR/SPSR bank of each mode; user and system share bank 0, which has no
+// SPSR.
+static unsigned mode_bank(uint8_t mode) {
+    switch (mode) {
+        case FIQ_MODE:          return 1;
+        case IRQ_MODE:          return 2;
+        case SVC_MODE:          return 3;
+        case ABOERT_MODE:       return 4;
+        case UNDEFINED_MODE:    return 5;
+        default:                return 0;
+    }
+}
+
+void cpu_write_cpsr(uint32_t value) {
+    union PSR psr = { .value = value };
+    unsigned from = mode_bank(cpu.regs.cpsr.mode), to = mode_bank(psr.mode);
+
+    if (from != to) {
+        cpu.banked_regs[from].sp = cpu.regs.gprs[REG_SP];
+        cpu.banked_regs[from].lr = cpu.regs.gprs[REG_LR];
+        cpu.regs.gprs[REG_SP] = cpu.banked_regs[to].sp;
+        cpu.regs.gprs[REG_LR] = cpu.banked_regs[to].lr;
+    }
+    cpu.regs.cpsr = psr;
+    cpu.regs.spsr = to ? &cpu.banked_regs[to].spsr : NULL;
+}
+
+void cpu_reset(uint32_t entry) {
+    memset(&cpu.regs, 0, sizeof(cpu.regs));
+    memset(cpu.banked_regs, 0, sizeof(cpu.banked_regs));
+    cpu.stop_reason = NULL;
+
+    // what the BIOS leaves behind when it jumps to the cartridge
+    cpu.banked_regs[mode_bank(IRQ_MODE)].sp = 0x03007FA0;
+    cpu.banked_regs[mode_bank(SVC_MODE)].sp = 0x03007FE0;
+    cpu.regs.cpsr.value = SYSTEM_MODE;
+    cpu.regs.gprs[REG_SP] = 0x03007F00;
+    cpu.regs.gprs[REG_PC] = entry;
+}
+
+static void cpu_stop(uint32_t pc, const char *reason) {
+    cpu.stop_reason = reason;
+    cpu.stop_pc = pc;
+    cpu.pipeline_flushed = true;
+}
+
+// Takes an exception from the instruction being executed: LR gets the
+// address of the next one. The vectors are in the BIOS, and there's no BIOS
+// image to run, so the core stops there instead of running through zeros.
+static void enter_exception(cpu_mode_t mode, uint32_t vector, const char *reason) {
+    uint32_t old = cpu.regs.cpsr.value;
+    uint32_t next = cpu.regs.gprs[REG_PC] - 4;
+    union PSR psr = { .value = old };
+
+    psr.mode = mode;
+    psr.t = false;
+    psr.i = true;
+    cpu_write_cpsr(psr.value);
+    cpu.regs.spsr->value = old;
+    cpu.regs.gprs[REG_LR] = next;
+    cpu.regs.gprs[REG_PC] = vector;
+    cpu.pipeline_flushed = true;
+    cpu_stop(next - 4, reason);
+}
+
+static void write_pc(uint32_t value) {
+    cpu.regs.gprs[REG_PC] = value & ~3u;
+    cpu.pipeline_flushed = true;
+}
+
 bool check_condition(condition_t cond) {
         switch (cond) {
         case COND_EQ:
@@ -59,20 +132,6 @@ bool check_condition(condition_t cond) {
     }
 }
 
-#define LOGICAL_SHIFT_HANDLER(operand)     \
-switch (shift_amount)               \
-{                                   \
-    case 0:                         \
-        *carry_out = cpu.regs.cpsr.c;   \
-        return rm;                  \
-    case 1 ... 32:                  \
-        *carry_out = (rm operand (shift_amount - 1)) & 1; \
-        return rm operand shift_amount;  \
-    default:                        \
-        *carry_out = false;         \
-        return 0;                   \
-}    
-
 uint32_t get_operand(uint32_t insn, bool *carry_out) { 
     bool shift_from_reg = field_from_u32(insn, 4, 1);
     uint8_t rs_amt = field_from_u32(insn, 8, 4);
@@ -80,7 +139,9 @@ uint32_t get_operand(uint32_t insn, bool *carry_out) {
 
 
     if (field_from_u32(insn, 25, 1)) {
-        return field_from_u32(insn, 0, 8) << (rs_amt * 2);
+        uint32_t imm = ror32(field_from_u32(insn, 0, 8), rs_amt * 2);
+        *carry_out = rs_amt ? imm >> 31 : cpu.regs.cpsr.c;
+        return imm;
     }
 
     if (shift_from_reg) { // is reg shift
@@ -90,16 +151,46 @@ uint32_t get_operand(uint32_t insn, bool *carry_out) {
     }
     else { 
         shift_amount = field_from_u32(insn, 7, 5);
+        // LSR #0 and ASR #0 encode a shift by 32
+        if (!shift_amount && (field_from_u32(insn, 5, 2) == LSR_SHIFT || field_from_u32(insn, 5, 2) == ASR_SHIFT))
+            shift_amount = 32;
     }
 
     uint32_t rm = cpu.regs.gprs[field_from_u32(insn, 0, 4)];
     switch (field_from_u32(insn, 5, 2)) {
 
-        case LSL_SHIFT: 
-            LOGICAL_SHIFT_HANDLER(<<)
+        // shifts by 32 or more are spelled out, C only defines them below 32
+        case LSL_SHIFT:
+            switch(shift_amount) {
+                case 0:
+                    *carry_out = cpu.regs.cpsr.c;
+                    return rm;
+                case 1 ... 31:
+                    *carry_out = (rm >> (32 - shift_amount)) & 1;
+                    return rm << shift_amount;
+                case 32:
+                    *carry_out = rm & 1;
+                    return 0;
+                default:
+                    *carry_out = false;
+                    return 0;
+            }
 
         case LSR_SHIFT:
-            LOGICAL_SHIFT_HANDLER(>>)
+            switch(shift_amount) {
+                case 0:
+                    *carry_out = cpu.regs.cpsr.c;
+                    return rm;
+                case 1 ... 31:
+                    *carry_out = (rm >> (shift_amount - 1)) & 1;
+                    return rm >> shift_amount;
+                case 32:
+                    *carry_out = rm >> 31;
+                    return 0;
+                default:
+                    *carry_out = false;
+                    return 0;
+            }
 
         case ASR_SHIFT:
             switch(shift_amount) {
@@ -110,12 +201,15 @@ uint32_t get_operand(uint32_t insn, bool *carry_out) {
                     *carry_out = (rm >> (shift_amount - 1)) & 1;
                     return ((int32_t) rm) >> shift_amount;
                 default:
-                    *carry_out = rm & 0x80000000;
-                    return ((int32_t) rm) >> shift_amount;      
+                    // 32 and up fill with the sign
+                    *carry_out = rm >> 31;
+                    return rm >> 31 ? 0xFFFFFFFF : 0;
             }
             
         case ROR_SHIFT:
-            rm = rm & 0x1F;
+            // register amounts past 32 rotate by the low 5 bits
+            if (shift_amount > 32)
+                shift_amount = ((shift_amount - 1) & 0x1F) + 1;
             switch(shift_amount) {
                 case 0: 
                     if (shift_from_reg) {
@@ -141,32 +235,38 @@ uint32_t get_operand(uint32_t insn, bool *carry_out) {
 
 void arm_mrs(uint32_t insn) {
     uint8_t rd = field_from_u32(insn, 12, 4);
-    union PSR *src_psr = field_from_u32(insn, 22, 1) ? cpu.regs.spsr : &cpu.regs.cpsr;
+    bool is_cpsr = !field_from_u32(insn, 22, 1);
 
     assert(rd != REG_PC && "MRS PC is illegal");
-    assert(src_psr && "usermode MRS from SPSR is illegal");
+    assert((is_cpsr || cpu.regs.spsr) && "usermode MRS from SPSR is illegal");
 
-    cpu.regs.gprs[rd] = src_psr->value;
+    cpu.regs.gprs[rd] = is_cpsr ? cpu.regs.cpsr.value : cpu.regs.spsr->value;
 }
 
 void arm_msr(uint32_t insn) {
-    bool imm_op = field_from_u32(insn, 25, 1);
     bool carry_out = false;
     union PSR source_op = { .value = get_operand(insn, &carry_out) };
-    union PSR *dst_psr = field_from_u32(insn, 22, 1) ? cpu.regs.spsr : &cpu.regs.cpsr;
+    bool is_cpsr = !field_from_u32(insn, 22, 1);
 
-    assert(dst_psr && "usermode MSR from SPSR is illegal");
+    assert((is_cpsr || cpu.regs.spsr) && "usermode MSR from SPSR is illegal");
 
-    dst_psr->value = (dst_psr->value & 0x0FFFFFFF) | (source_op.value & 0xF0000000); 
+    union PSR psr = is_cpsr ? cpu.regs.cpsr : *cpu.regs.spsr;
 
-    if (field_from_u32(insn, 17, 1)) {
-        // full PSR
-        assert(!imm_op && "full MSR only from register");
+    // flags field
+    if (field_from_u32(insn, 19, 1))
+        psr.value = (psr.value & 0x0FFFFFFF) | (source_op.value & 0xF0000000);
 
-        dst_psr->mode = source_op.mode;
-        dst_psr->f = source_op.f;
-        dst_psr->i = source_op.i;
+    // control field; user mode can't change it
+    if (field_from_u32(insn, 16, 1) && (!is_cpsr || cpu.regs.cpsr.mode != USER_MODE)) {
+        psr.mode = source_op.mode;
+        psr.f = source_op.f;
+        psr.i = source_op.i;
     }
+
+    if (is_cpsr)
+        cpu_write_cpsr(psr.value);
+    else
+        *cpu.regs.spsr = psr;
 }
 
 void arm_mul(uint32_t insn) {
@@ -182,11 +282,11 @@ void arm_mul(uint32_t insn) {
     assert(rd != REG_PC);
     assert(rd != rm);
 
-    if (field_from_u32(insn, 21, 1)) {
+    if (!field_from_u32(insn, 21, 1)) {
         // MUL
         result = cpu.regs.gprs[rm] * cpu.regs.gprs[rs];
     } else {
-        // MULA
+        // MLA
         result = cpu.regs.gprs[rm] * cpu.regs.gprs[rs] + cpu.regs.gprs[rn];
     }
 
@@ -211,12 +311,16 @@ void arm_mull(uint32_t insn) {
     assert(rdl != REG_PC);
     assert(rdh != REG_PC);
 
-    if (field_from_u32(insn, 21, 1)) {
-        // MULL
-        result = cpu.regs.gprs[rm] * cpu.regs.gprs[rs];
+    if (field_from_u32(insn, 22, 1)) {
+        // SMULL
+        result = (uint64_t)((int64_t)(int32_t)cpu.regs.gprs[rm] * (int32_t)cpu.regs.gprs[rs]);
     } else {
-        // MULLA
-        result = cpu.regs.gprs[rm] * cpu.regs.gprs[rs] + (((uint64_t) cpu.regs.gprs[rdh] << 32) | cpu.regs.gprs[rdl]);
+        // UMULL
+        result = (uint64_t)cpu.regs.gprs[rm] * cpu.regs.gprs[rs];
+    }
+    if (field_from_u32(insn, 21, 1)) {
+        // MLAL
+        result += ((uint64_t) cpu.regs.gprs[rdh] << 32) | cpu.regs.gprs[rdl];
     }
 
     // set flags
@@ -229,65 +333,63 @@ void arm_mull(uint32_t insn) {
     cpu.regs.gprs[rdh] = field_from_u64(result, 32, 32);
 }
 
+// a + b + carry_in; SUB is a + ~b + 1, SBC a + ~b + C
+static uint32_t add_with_flags(uint32_t a, uint32_t b, bool carry_in, bool *carry, bool *overflow) {
+    uint64_t result = (uint64_t)a + b + carry_in;
+    *carry = result >> 32;
+    *overflow = (~(a ^ b) & (a ^ (uint32_t)result)) >> 31;
+    return result;
+}
+
 void arm_data_processing(uint32_t insn) {
     uint8_t rd = field_from_u32(insn, 12, 4), 
             rn = field_from_u32(insn, 16, 4);
-
+    uint8_t opcode = field_from_u32(insn, 21, 4);
 
     uint32_t op1 = cpu.regs.gprs[rn],
-             op2 = 0;
-    uint64_t result = 0;
-    bool carry_out = false;
+             op2 = 0,
+             result = 0;
+    bool carry_out = false, overflow = cpu.regs.cpsr.v;
+    bool carry_in = cpu.regs.cpsr.c;
 
     op2 = get_operand(insn, &carry_out);
 
     bool set_flags = field_from_u32(insn, 20, 1);
-    bool arithm_op = false;
-    switch(field_from_u32(insn, 21, 4)) { // data opcode
+    switch(opcode) {
         case OPCODE_AND:
         case OPCODE_TST:
-            assert(set_flags);
             result = op1 & op2;
             break;
 
         case OPCODE_EOR:
         case OPCODE_TEQ:
-            assert(set_flags);
             result = op1 ^ op2;
             break;
         
         case OPCODE_SUB:
         case OPCODE_CMP:
-            assert(set_flags);
-            arithm_op = true;
-            result = op1 - op2;
+            result = add_with_flags(op1, ~op2, true, &carry_out, &overflow);
             break;
         
         case OPCODE_RSB:
-            arithm_op = true;
-            result = op2 - op1;
+            result = add_with_flags(op2, ~op1, true, &carry_out, &overflow);
             break;
         
         case OPCODE_ADD:
         case OPCODE_CMN:
-            assert(set_flags);
-            arithm_op = true;
-            result = op1 + op2;
+            result = add_with_flags(op1, op2, false, &carry_out, &overflow);
             break;
         
         case OPCODE_ADC:
-            arithm_op = true;
-            result = op1 + op2 + cpu.regs.cpsr.c;
+            result = add_with_flags(op1, op2, carry_in, &carry_out, &overflow);
             break;
         
         case OPCODE_SBC:
-            arithm_op = true;
-            result = op1 - op2 + cpu.regs.cpsr.c - 1;
+            result = add_with_flags(op1, ~op2, carry_in, &carry_out, &overflow);
             break;
         
         case OPCODE_RSC:
-            arithm_op = true;
-            result = op2 - op1 + cpu.regs.cpsr.c - 1;
+            result = add_with_flags(op2, ~op1, carry_in, &carry_out, &overflow);
             break;
         
         case OPCODE_ORR:
@@ -307,45 +409,280 @@ void arm_data_processing(uint32_t insn) {
             break;
     }
 
+    bool test_op = opcode >= OPCODE_TST && opcode <= OPCODE_CMN;
+    if (!test_op) {
+        if (rd == REG_PC)
+            write_pc(result);
+        else
+            cpu.regs.gprs[rd] = result;
+    }
+
     if  (set_flags) {  
         if (rd == REG_PC) {
             assert(cpu.regs.spsr && "can't transfer SPSR in usermode");
-            cpu.regs.cpsr.value = cpu.regs.spsr->value; 
+            cpu_write_cpsr(cpu.regs.spsr->value);
         } else {
-            if (arithm_op) {
-                cpu.regs.cpsr.v = !!field_from_u64(result, 32, 32);
-                cpu.regs.cpsr.c = !!field_from_u64(result, 32, 1);
-            } else {
-                cpu.regs.cpsr.c = carry_out;
-            }
-
-            cpu.regs.cpsr.z = !(uint32_t)result;
+            cpu.regs.cpsr.c = carry_out;
+            cpu.regs.cpsr.v = overflow;
+            cpu.regs.cpsr.z = !result;
             cpu.regs.cpsr.n = field_from_u32(result, 31, 1);
         }
     }
-
-    
 }
 
 void arm_bx(uint32_t insn) {
-    uint32_t rn = cpu.regs.gprs[field_from_u32(insn, 0, 4)];
-    cpu.regs.cpsr.t = cpu.regs.gprs[rn] & 0x1;
-    cpu.regs.gprs[REG_PC] = cpu.regs.gprs[rn] & (~0x1);
+    uint32_t target = cpu.regs.gprs[field_from_u32(insn, 0, 4)];
+    cpu.regs.cpsr.t = target & 0x1;
+    cpu.regs.gprs[REG_PC] = target & (~0x1);
+    cpu.pipeline_flushed = true;
 }
 
 void arm_b(uint32_t insn) {
-    int32_t offset = (field_from_u32(insn, 0, 24) << 8) >> 6;
+    int32_t offset = (int32_t)(field_from_u32(insn, 0, 24) << 8) >> 6;
 
     if (field_from_u32(insn, 24, 1)) {
         cpu.regs.gprs[REG_LR] = cpu.regs.gprs[REG_PC] - sizeof(insn);
     }
 
     cpu.regs.gprs[REG_PC] += offset;
+    cpu.pipeline_flushed = true;
+}
+
+// Word loads from unaligned addresses rotate the aligned word.
+static uint32_t load_word(uint32_t addr) {
+    return ror32(mem_read32(addr & ~3u), (addr & 3) * 8);
+}
+
+void arm_single_transfer(uint32_t insn) {
+    uint8_t rd = field_from_u32(insn, 12, 4),
+            rn = field_from_u32(insn, 16, 4);
+    bool pre = field_from_u32(insn, 24, 1),
+         up = field_from_u32(insn, 23, 1),
+         byte = field_from_u32(insn, 22, 1),
+         writeback = field_from_u32(insn, 21, 1),
+         load = field_from_u32(insn, 20, 1);
+    bool carry_out;
+
+    // here the I bit selects the shifted register form
+    uint32_t offset = field_from_u32(insn, 25, 1)
+        ? get_operand(insn & ~(1u << 25), &carry_out)
+        : field_from_u32(insn, 0, 12);
+    uint32_t base = cpu.regs.gprs[rn];
+    uint32_t addr = up ? base + offset : base - offset;
+    uint32_t access = pre ? addr : base;
+
+    if (load) {
+        uint32_t value = byte ? mem_read8(access) : load_word(access);
+        if (!pre || writeback)
+            cpu.regs.gprs[rn] = addr;
+        if (rd == REG_PC)
+            write_pc(value);
+        else
+            cpu.regs.gprs[rd] = value;
+    } else {
+        // a stored PC is the instruction's address + 12
+        uint32_t value = cpu.regs.gprs[rd] + (rd == REG_PC ? 4 : 0);
+        if (byte)
+            mem_write8(access, value);
+        else
+            mem_write32(access & ~3u, value);
+        if (!pre || writeback)
+            cpu.regs.gprs[rn] = addr;
+    }
+}
+
+void arm_halfword_transfer(uint32_t insn) {
+    uint8_t rd = field_from_u32(insn, 12, 4),
+            rn = field_from_u32(insn, 16, 4);
+    bool pre = field_from_u32(insn, 24, 1),
+         up = field_from_u32(insn, 23, 1),
+         writeback = field_from_u32(insn, 21, 1),
+         load = field_from_u32(insn, 20, 1);
+
+    uint32_t offset = field_from_u32(insn, 22, 1)
+        ? field_from_u32(insn, 8, 4) << 4 | field_from_u32(insn, 0, 4)
+        : cpu.regs.gprs[field_from_u32(insn, 0, 4)];
+    uint32_t base = cpu.regs.gprs[rn];
+    uint32_t addr = up ? base + offset : base - offset;
+    uint32_t access = pre ? addr : base;
+
+    if (!load) {
+        mem_write16(access & ~1u, cpu.regs.gprs[rd] + (rd == REG_PC ? 4 : 0));
+        if (!pre || writeback)
+            cpu.regs.gprs[rn] = addr;
+        return;
+    }
+
+    uint32_t value;
+    switch (field_from_u32(insn, 5, 2)) {
+        case 1:     // LDRH, unaligned rotates
+            value = ror32(mem_read16(access & ~1u), (access & 1) * 8);
+            break;
+        case 2:     // LDRSB
+            value = (int8_t)mem_read8(access);
+            break;
+        default:    // LDRSH, unaligned loads the sign extended byte
+            value = access & 1 ? (uint32_t)(int8_t)mem_read8(access) : (uint32_t)(int16_t)mem_read16(access);
+            break;
+    }
+    if (!pre || writeback)
+        cpu.regs.gprs[rn] = addr;
+    if (rd == REG_PC)
+        write_pc(value);
+    else
+        cpu.regs.gprs[rd] = value;
+}
+
+void arm_block_transfer(uint32_t insn) {
+    uint8_t rn = field_from_u32(insn, 16, 4);
+    uint16_t list = field_from_u32(insn, 0, 16);
+    bool pre = field_from_u32(insn, 24, 1),
+         up = field_from_u32(insn, 23, 1),
+         psr = field_from_u32(insn, 22, 1),
+         writeback = field_from_u32(insn, 21, 1),
+         load = field_from_u32(insn, 20, 1);
+
+    // an empty list transfers PC and moves the base by 16 words
+    unsigned count = list ? __builtin_popcount(list) : 16;
+    if (!list)
+        list = 1u << REG_PC;
+
+    // registers always go lowest first, at the lowest address
+    uint32_t base = cpu.regs.gprs[rn];
+    uint32_t final = up ? base + count * 4 : base - count * 4;
+    uint32_t addr = up ? base : final;
+    if (pre == up)
+        addr += 4;
+
+    // S without PC in a load: the user bank, which is what's live in system
+    // mode; banked SP/LR aren't swapped for it
+    bool restore = psr && load && (list >> REG_PC & 1);
+
+    for (unsigned r = 0; r < 16; r++) {
+        if (!(list >> r & 1))
+            continue;
+
+        if (load) {
+            uint32_t value = mem_read32(addr);
+            if (r == REG_PC)
+                write_pc(value);
+            else
+                cpu.regs.gprs[r] = value;
+        } else {
+            // the base stores its old value only when it goes first
+            uint32_t value = cpu.regs.gprs[r];
+            if (r == rn && writeback && (list & ((1u << r) - 1)))
+                value = final;
+            if (r == REG_PC)
+                value += 4;
+            mem_write32(addr, value);
+        }
+        addr += 4;
+    }
+
+    // a loaded base wins over the writeback
+    if (writeback && !(load && (list >> rn & 1)))
+        cpu.regs.gprs[rn] = final;
+
+    if (restore && cpu.regs.spsr)
+        cpu_write_cpsr(cpu.regs.spsr->value);
+}
+
+void arm_swap(uint32_t insn) {
+    uint8_t rm = field_from_u32(insn, 0, 4),
+            rd = field_from_u32(insn, 12, 4),
+            rn = field_from_u32(insn, 16, 4);
+    uint32_t addr = cpu.regs.gprs[rn];
+    uint32_t source = cpu.regs.gprs[rm];
+
+    if (field_from_u32(insn, 22, 1)) {
+        uint8_t value = mem_read8(addr);
+        mem_write8(addr, source);
+        cpu.regs.gprs[rd] = value;
+    } else {
+        uint32_t value = load_word(addr);
+        mem_write32(addr & ~3u, source);
+        cpu.regs.gprs[rd] = value;
+    }
+}
+
+void arm_swi(uint32_t insn) {
+    (void)insn;
+    enter_exception(SVC_MODE, 0x08, "BIOS call (SWI) without a BIOS");
+}
+
+// Coprocessor instructions and the undefined space: there's no coprocessor
+// to answer, so they take the undefined instruction trap.
+void arm_undefined(uint32_t insn) {
+    (void)insn;
+    enter_exception(UNDEFINED_MODE, 0x04, "undefined instruction");
+}
+
+static const arm_handler_t arm_handlers[ARM_HANDLER_COUNT] = {
+    [ARM_UNDECODED]         = arm_undefined,
+    [ARM_MULTIPLY]          = arm_mul,
+    [ARM_MULTIPLY_LONG]     = arm_mull,
+    [ARM_SWAP]              = arm_swap,
+    [ARM_BX]                = arm_bx,
+    [ARM_HALFWORD_REG]      = arm_halfword_transfer,
+    [ARM_HALFWORD_IMM]      = arm_halfword_transfer,
+    [ARM_SINGLE_TRANSFER]   = arm_single_transfer,
+    [ARM_BLOCK_TRANSFER]    = arm_block_transfer,
+    [ARM_BRANCH]            = arm_b,
+    [ARM_COPROC_TRANSFER]   = arm_undefined,
+    [ARM_COPROC_OPERATION]  = arm_undefined,
+    [ARM_COPROC_REGISTER]   = arm_undefined,
+    [ARM_SWI]               = arm_swi,
+    [ARM_MRS]               = arm_mrs,
+    [ARM_MSR]               = arm_msr,
+    [ARM_DATA_PROCESSING]   = arm_data_processing,
+    [ARM_UNDEFINED]         = arm_undefined,
+};
+
+uint8_t arm_decode(uint32_t insn) {
+    for (unsigned i = 0; i < sizeof(opcode_types) / sizeof(opcode_types[0]); i++) {
+        if ((insn & opcode_types[i].mask) == opcode_types[i].value)
+            return ARM_MULTIPLY + i;
+    }
+    return ARM_UNDEFINED;
+}
+
+uint8_t thumb_decode(uint16_t insn) {
+    for (unsigned i = 0; i < sizeof(thumb_opcode_types) / sizeof(thumb_opcode_types[0]); i++) {
+        if ((insn & thumb_opcode_types[i].mask) == thumb_opcode_types[i].value)
+            return THUMB_ADD_SUB + i;
+    }
+    return THUMB_UNDEFINED;
+}
+
+void execute_arm(uint8_t handler_idx, uint32_t insn) {
+    if (check_condition(field_from_u32(insn, 28, 4))) {
+        arm_handlers[handler_idx](insn);
+    }
 }
 
 void decode_arm(uint32_t opcode) {
-    if (check_condition(field_from_u32(opcode, 28, 4))) {
+    execute_arm(arm_decode(opcode), opcode);
+}
 
+void cpu_step(void) {
+    uint32_t pc = cpu.regs.gprs[REG_PC];
+    if (cpu.regs.cpsr.t) {
+        cpu_stop(pc, "Thumb code isn't supported yet");
+        return;
     }
 
-}
\ No newline at end of file
+    uint32_t insn = mem_read32(pc);
+
+    // PC reads as the fetch address + 8 while executing
+    cpu.regs.gprs[REG_PC] = pc + 8;
+    cpu.pipeline_flushed = false;
+
+    if (cpu.rom_predecode && predecode_covers(cpu.rom_predecode, pc))
+        execute_arm(predecode_arm(cpu.rom_predecode, pc, insn), insn);
+    else
+        decode_arm(insn);
+
+    if (!cpu.pipeline_flushed)
+        cpu.regs.gprs[REG_PC] = pc + 4;
+}
@@ -39,11 +39,19 @@ struct banked_registers {
 	union PSR spsr;
 };
 
+struct predecode;
+
 struct cpu {
 	struct registers regs;
-	struct banked_registers banked_regs[5];
+	struct banked_registers banked_regs[6];    // user/system, FIQ, IRQ, SVC, ABT, UND
+	bool pipeline_flushed; // set by handlers that write PC
+	const char *stop_reason; // why the core can't go on, NULL while it runs
+	uint32_t stop_pc;       // of the instruction it stopped at
+	struct predecode *rom_predecode;
 };
 
+extern struct cpu cpu;
+
 enum {
 	REG_SP = 13,
 	REG_LR = 14,
@@ -165,8 +173,8 @@ static const opcode_type_t opcode_types[] = {
 	},
 	{
 		// MSR (value to a PSR)
-		.mask 	= 	0x0dbef000,
-		.value 	= 	0x0128f000
+		.mask 	= 	0x0db0f000,
+		.value 	= 	0x0120f000
 	},
 	{   // Data Processing / PSR Transfer
 		.mask   =   0x0C000000,
@@ -174,6 +182,148 @@ static const opcode_type_t opcode_types[] = {
 	},
 };
 
+// Handler indices, one per entry of opcode_types[] in the same order. Zero is
+// reserved so predecoded tables can use it for "not decoded yet".
+typedef enum {
+	ARM_UNDECODED = 0,
+	ARM_MULTIPLY,
+	ARM_MULTIPLY_LONG,
+	ARM_SWAP,
+	ARM_BX,
+	ARM_HALFWORD_REG,
+	ARM_HALFWORD_IMM,
+	ARM_SINGLE_TRANSFER,
+	ARM_BLOCK_TRANSFER,
+	ARM_BRANCH,
+	ARM_COPROC_TRANSFER,
+	ARM_COPROC_OPERATION,
+	ARM_COPROC_REGISTER,
+	ARM_SWI,
+	ARM_MRS,
+	ARM_MSR,
+	ARM_DATA_PROCESSING,
+	ARM_UNDEFINED,
+	ARM_HANDLER_COUNT
+} arm_handler_idx_t;
+
+static const opcode_type_t thumb_opcode_types[] = {
+	{   // Add / Subtract
+		.mask   =   0xF800,
+		.value  =   0x1800
+	},
+	{   // Move Shifted Register
+		.mask   =   0xE000,
+		.value  =   0x0000
+	},
+	{   // Move / Compare / Add / Subtract Immediate
+		.mask   =   0xE000,
+		.value  =   0x2000
+	},
+	{   // ALU Operations
+		.mask   =   0xFC00,
+		.value  =   0x4000
+	},
+	{   // Hi Register Operations / Branch Exchange
+		.mask   =   0xFC00,
+		.value  =   0x4400
+	},
+	{   // PC-relative Load
+		.mask   =   0xF800,
+		.value  =   0x4800
+	},
+	{   // Load / Store with Register Offset
+		.mask   =   0xF200,
+		.value  =   0x5000
+	},
+	{   // Load / Store Sign-extended Byte / Halfword
+		.mask   =   0xF200,
+		.value  =   0x5200
+	},
+	{   // Load / Store with Immediate Offset
+		.mask   =   0xE000,
+		.value  =   0x6000
+	},
+	{   // Load / Store Halfword
+		.mask   =   0xF000,
+		.value  =   0x8000
+	},
+	{   // SP-relative Load / Store
+		.mask   =   0xF000,
+		.value  =   0x9000
+	},
+	{   // Load Address
+		.mask   =   0xF000,
+		.value  =   0xA000
+	},
+	{   // Add Offset to Stack Pointer
+		.mask   =   0xFF00,
+		.value  =   0xB000
+	},
+	{   // Push / Pop Registers
+		.mask   =   0xF600,
+		.value  =   0xB400
+	},
+	{   // Multiple Load / Store
+		.mask   =   0xF000,
+		.value  =   0xC000
+	},
+	{   // Software Interrupt
+		.mask   =   0xFF00,
+		.value  =   0xDF00
+	},
+	{   // Conditional Branch
+		.mask   =   0xF000,
+		.value  =   0xD000
+	},
+	{   // Unconditional Branch
+		.mask   =   0xF800,
+		.value  =   0xE000
+	},
+	{   // Long Branch with Link
+		.mask   =   0xF000,
+		.value  =   0xF000
+	},
+};
+
+typedef enum {
+	THUMB_UNDECODED = 0,
+	THUMB_ADD_SUB,
+	THUMB_SHIFTED,
+	THUMB_IMMEDIATE,
+	THUMB_ALU,
+	THUMB_HI_REG_BX,
+	THUMB_PC_LOAD,
+	THUMB_TRANSFER_REG,
+	THUMB_TRANSFER_SIGNED,
+	THUMB_TRANSFER_IMM,
+	THUMB_TRANSFER_HALF,
+	THUMB_TRANSFER_SP,
+	THUMB_LOAD_ADDRESS,
+	THUMB_ADD_SP,
+	THUMB_PUSH_POP,
+	THUMB_BLOCK_TRANSFER,
+	THUMB_SWI,
+	THUMB_COND_BRANCH,
+	THUMB_BRANCH,
+	THUMB_LONG_BRANCH,
+	THUMB_UNDEFINED,
+	THUMB_HANDLER_COUNT
+} thumb_handler_idx_t;
+
+typedef void (*arm_handler_t)(uint32_t insn);
+
+uint8_t arm_decode(uint32_t insn);
+uint8_t thumb_decode(uint16_t insn);
+bool check_condition(condition_t cond);
+void execute_arm(uint8_t handler_idx, uint32_t insn);
+void decode_arm(uint32_t opcode);
+void cpu_step(void);
+
+// Direct boot into `entry`, as the BIOS leaves things.
+void cpu_reset(uint32_t entry);
+// Writes CPSR, swapping SP/LR/SPSR banks when the mode changes.
+void cpu_write_cpsr(uint32_t value);
+
 static inline uint32_t rol32(uint32_t n, uint8_t c)
 {
   const unsigned int mask = (8 * sizeof(n) - 1);  
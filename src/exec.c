@@ -0,0 +1,382 @@
+#include "exec.h"
+#include "cpu.h"
+#include "memory.h"
+#include "predecode.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+define_field_from_type(uint32_t, u32)
+
+struct exec_stats exec_stats = {0};
+
+static struct block *block_hash[1 << BLOCK_HASH_BITS];
+static uint16_t heat_table[1 << HEAT_TABLE_BITS];
+static struct block *chunk_blocks[CODE_CHUNK_COUNT];
+static struct block *retired = NULL;
+static const struct exec_backend *backend = NULL;
+
+static inline uint32_t hash_pc(uint32_t pc, unsigned bits) {
+    return (pc >> 2) & ((1u << bits) - 1);
+}
+
+void exec_init(void) {
+    memset(block_hash, 0, sizeof(block_hash));
+    memset(heat_table, 0, sizeof(heat_table));
+    memset(chunk_blocks, 0, sizeof(chunk_blocks));
+    memset(&exec_stats, 0, sizeof(exec_stats));
+}
+
+static void free_block(struct block *b) {
+    if (b->tier == TIER_NATIVE && backend)
+        backend->release(b);
+    free(b);
+}
+
+static void free_retired(void);
+
+void exec_flush(void) {
+    for (unsigned i = 0; i < (1u << BLOCK_HASH_BITS); i++) {
+        struct block *b = block_hash[i];
+        while (b) {
+            struct block *next = b->hash_next;
+            free_block(b);
+            b = next;
+        }
+        block_hash[i] = NULL;
+    }
+
+    free_retired();
+    memset(chunk_blocks, 0, sizeof(chunk_blocks));
+    memset(mem.code_bitmap, 0, sizeof(mem.code_bitmap));
+
+    memset(heat_table, 0, sizeof(heat_table));
+    exec_stats.blocks_live = 0;
+}
+
+static void link_block(struct block *b) {
+    struct block *target = exec_lookup(b->link_target);
+    if (!target)
+        return;
+
+    b->link = target;
+    b->link_next = target->incoming;
+    target->incoming = b;
+    exec_stats.blocks_linked++;
+}
+
+static void unlink_block(struct block *b) {
+    // nothing may chain into b any more
+    for (struct block *p = b->incoming; p; p = p->link_next)
+        p->link = NULL;
+    b->incoming = NULL;
+
+    // and b leaves its successor's incoming list
+    if (b->link) {
+        struct block **link = &b->link->incoming;
+        while (*link != b)
+            link = &(*link)->link_next;
+        *link = b->link_next;
+        b->link = NULL;
+    }
+}
+
+static void free_retired(void) {
+    while (retired) {
+        struct block *next = retired->hash_next;
+        free_block(retired);
+        retired = next;
+    }
+}
+
+void exec_invalidate_code(uint32_t addr) {
+    int chunk = mem_code_chunk(addr);
+    assert(chunk >= 0);
+
+    exec_stats.code_writes++;
+
+    for (struct block *b = chunk_blocks[chunk], *next; b; b = next) {
+        next = b->chunk_next;
+
+        struct block **link = &block_hash[hash_pc(b->pc, BLOCK_HASH_BITS)];
+        while (*link != b)
+            link = &(*link)->hash_next;
+        *link = b->hash_next;
+        unlink_block(b);
+
+        // the block may be the one doing the store, free it later
+        b->dead = true;
+        b->hash_next = retired;
+        retired = b;
+
+        exec_stats.blocks_invalidated++;
+        exec_stats.blocks_live--;
+    }
+
+    chunk_blocks[chunk] = NULL;
+    mem_clear_code(addr);
+}
+
+void exec_shutdown(void) {
+    exec_flush();
+    backend = NULL;
+}
+
+void exec_set_backend(const struct exec_backend *new_backend) {
+    // compiled code belongs to the old backend
+    exec_flush();
+    backend = new_backend;
+}
+
+struct block *exec_lookup(uint32_t pc) {
+    struct block *b = block_hash[hash_pc(pc, BLOCK_HASH_BITS)];
+    while (b && b->pc != pc)
+        b = b->hash_next;
+    return b;
+}
+
+// Instructions that may write PC or change state the block was decoded
+// under end the block.
+static bool ends_block(uint8_t handler, uint32_t insn) {
+    uint8_t rd = field_from_u32(insn, 12, 4);
+    bool load = field_from_u32(insn, 20, 1);
+
+    switch (handler) {
+        case ARM_MULTIPLY:
+        case ARM_MULTIPLY_LONG:
+        case ARM_SWAP:
+        case ARM_MRS:
+            return false;
+
+        case ARM_DATA_PROCESSING:
+            return rd == REG_PC;
+
+        case ARM_SINGLE_TRANSFER:
+        case ARM_HALFWORD_REG:
+        case ARM_HALFWORD_IMM:
+            return load && rd == REG_PC;
+
+        case ARM_BLOCK_TRANSFER:
+            return load && field_from_u32(insn, REG_PC, 1);
+
+        default:
+            return true;
+    }
+}
+
+static struct block *translate(uint32_t pc) {
+    struct block_insn insns[BLOCK_MAX_INSNS];
+    uint16_t count = 0;
+    uint32_t addr = pc;
+    int chunk = mem_code_chunk(pc);
+
+    // only plain memory is worth caching
+    if (!mem_page(mem.read_pages, pc))
+        return NULL;
+
+    while (count < BLOCK_MAX_INSNS) {
+        uint32_t insn = mem_read32(addr);
+        uint8_t handler;
+
+        if (cpu.rom_predecode && predecode_covers(cpu.rom_predecode, addr))
+            handler = predecode_arm(cpu.rom_predecode, addr, insn);
+        else
+            handler = arm_decode(insn);
+
+        insns[count].insn = insn;
+        insns[count].handler = handler;
+        count++;
+        addr += 4;
+
+        if (ends_block(handler, insn) || !(addr & (MEM_PAGE_SIZE - 1)))
+            break;
+
+        // RAM blocks stay inside one code chunk so a store only ever has to
+        // look at a single chunk list
+        if (chunk >= 0 && !(addr & ((1u << CODE_CHUNK_SHIFT) - 1)))
+            break;
+    }
+
+    struct block *b = calloc(1, sizeof(*b) + count * sizeof(struct block_insn));
+    b->pc = pc;
+    b->end_pc = addr;
+    b->tier = TIER_CACHED;
+    b->count = count;
+    memcpy(b->insns, insns, count * sizeof(struct block_insn));
+
+    // B/BL with the AL condition always leaves to the same place
+    uint32_t last = insns[count - 1].insn;
+    if (insns[count - 1].handler == ARM_BRANCH && field_from_u32(last, 28, 4) == COND_AL) {
+        b->linkable = true;
+        b->link_target = addr + 4 + ((int32_t)(last << 8) >> 6);
+    }
+
+    struct block **bucket = &block_hash[hash_pc(pc, BLOCK_HASH_BITS)];
+    b->hash_next = *bucket;
+    *bucket = b;
+
+    if (chunk >= 0) {
+        b->chunk_next = chunk_blocks[chunk];
+        chunk_blocks[chunk] = b;
+        mem_mark_code(pc);
+    }
+
+    exec_stats.blocks_translated++;
+    exec_stats.blocks_live++;
+    return b;
+}
+
+static void promote(struct block *b) {
+    if (backend && backend->compile(b)) {
+        assert(b->native);
+        b->tier = TIER_NATIVE;
+        exec_stats.blocks_compiled++;
+    } else {
+        exec_stats.native_rejected++;
+    }
+}
+
+static uint32_t run_cached(struct block *b) {
+    uint32_t pc = b->pc;
+
+    for (uint16_t i = 0; i < b->count; i++) {
+        cpu.regs.gprs[REG_PC] = pc + 8;
+        cpu.pipeline_flushed = false;
+
+        execute_arm(b->insns[i].handler, b->insns[i].insn);
+
+        if (cpu.pipeline_flushed) {
+            exec_stats.cached_insns += i + 1;
+            return i + 1;
+        }
+        pc += 4;
+
+        // the block overwrote itself, the rest of it is stale
+        if (b->dead) {
+            cpu.regs.gprs[REG_PC] = pc;
+            exec_stats.cached_insns += i + 1;
+            return i + 1;
+        }
+    }
+
+    cpu.regs.gprs[REG_PC] = pc;
+    exec_stats.cached_insns += b->count;
+    return b->count;
+}
+
+static uint32_t run_block(struct block *b) {
+    // a block gets exactly one shot at the native tier
+    if (++b->hits == TIER_NATIVE_THRESHOLD)
+        promote(b);
+
+    if (b->tier == TIER_NATIVE) {
+        exec_stats.native_runs++;
+        return b->native(b);
+    }
+    return run_cached(b);
+}
+
+// Linked blocks hand over to their successor without going back through the
+// lookup, as long as the block ran all the way to its final branch.
+static uint64_t run_chain(struct block *b, uint64_t budget) {
+    uint64_t done = 0;
+
+    while (true) {
+        uint32_t n = run_block(b);
+        done += n;
+
+        if (!b->linkable || b->dead || n != b->count || done >= budget)
+            return done;
+        if (!b->link)
+            link_block(b);
+        if (!b->link)
+            return done;
+
+        b = b->link;
+        exec_stats.links_followed++;
+    }
+}
+
+static uint64_t interpret(uint64_t budget) {
+    uint64_t n = 0;
+
+    do {
+        cpu_step();
+        n++;
+    } while (!cpu.pipeline_flushed && n < budget);
+
+    exec_stats.interpreted_insns += n;
+    return n;
+}
+
+uint64_t exec_run(uint64_t insn_budget) {
+    uint64_t done = 0;
+
+    while (done < insn_budget && !cpu.stop_reason) {
+        uint32_t pc = cpu.regs.gprs[REG_PC];
+        struct block *b = NULL;
+
+        if (!cpu.regs.cpsr.t) {
+            b = exec_lookup(pc);
+
+            if (!b) {
+                uint16_t *heat = &heat_table[hash_pc(pc, HEAT_TABLE_BITS)];
+                if (++*heat >= TIER_CACHED_THRESHOLD) {
+                    *heat = 0;
+                    b = translate(pc);
+                }
+            }
+        }
+
+        if (b)
+            done += run_chain(b, insn_budget - done);
+        else
+            done += interpret(insn_budget - done);
+
+        if (retired)
+            free_retired();
+    }
+    return done;
+}
+
+static int compare_hits(const void *a, const void *b) {
+    const struct block *x = *(const struct block **)a, *y = *(const struct block **)b;
+    return (x->hits < y->hits) - (x->hits > y->hits);
+}
+
+void exec_dump_stats(FILE *out, unsigned top) {
+    static const char *tier_names[] = { "interp", "cached", "native" };
+
+    fprintf(out, "backend:            %s\n", backend ? backend->name : "none");
+    fprintf(out, "interpreted insns:  %llu\n", (unsigned long long)exec_stats.interpreted_insns);
+    fprintf(out, "cached insns:       %llu\n", (unsigned long long)exec_stats.cached_insns);
+    fprintf(out, "native runs:        %llu\n", (unsigned long long)exec_stats.native_runs);
+    fprintf(out, "blocks translated:  %llu\n", (unsigned long long)exec_stats.blocks_translated);
+    fprintf(out, "blocks compiled:    %llu\n", (unsigned long long)exec_stats.blocks_compiled);
+    fprintf(out, "native rejected:    %llu\n", (unsigned long long)exec_stats.native_rejected);
+    fprintf(out, "blocks live:        %llu\n", (unsigned long long)exec_stats.blocks_live);
+    fprintf(out, "blocks invalidated: %llu\n", (unsigned long long)exec_stats.blocks_invalidated);
+    fprintf(out, "code writes:        %llu\n", (unsigned long long)exec_stats.code_writes);
+    fprintf(out, "blocks linked:      %llu\n", (unsigned long long)exec_stats.blocks_linked);
+    fprintf(out, "links followed:     %llu\n", (unsigned long long)exec_stats.links_followed);
+
+    if (!top || !exec_stats.blocks_live)
+        return;
+
+    struct block **blocks = malloc(exec_stats.blocks_live * sizeof(*blocks));
+    size_t n = 0;
+
+    for (unsigned i = 0; i < (1u << BLOCK_HASH_BITS); i++) {
+        for (struct block *b = block_hash[i]; b; b = b->hash_next)
+            blocks[n++] = b;
+    }
+    qsort(blocks, n, sizeof(*blocks), compare_hits);
+
+    fprintf(out, "hottest blocks:\n");
+    for (size_t i = 0; i < n && i < top; i++) {
+        fprintf(out, "  %08x-%08x %6s %llu\n", blocks[i]->pc, blocks[i]->end_pc,
+                tier_names[blocks[i]->tier], (unsigned long long)blocks[i]->hits);
+    }
+
+    free(blocks);
+}
@@ -0,0 +1,93 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// Tiered execution engine. Code starts out in the plain interpreter
+// (cpu_step / decode_arm); a block entry that gets executed often enough is
+// translated into a cached block of predecoded instructions, and blocks that
+// stay hot are handed to a native backend when one is registered.
+
+#define BLOCK_MAX_INSNS         64
+#define BLOCK_HASH_BITS         12
+#define HEAT_TABLE_BITS         12
+
+#define TIER_CACHED_THRESHOLD   16      // entries before a block is cached
+#define TIER_NATIVE_THRESHOLD   4096    // block runs before native compilation
+
+typedef enum {
+	TIER_INTERPRETER = 0,
+	TIER_CACHED,
+	TIER_NATIVE,
+} exec_tier_t;
+
+struct block_insn {
+	uint32_t insn;
+	uint8_t handler;
+};
+
+struct block {
+	uint32_t pc;
+	uint32_t end_pc;        // address after the last instruction
+	uint64_t hits;          // times the block was entered
+	uint8_t tier;
+	bool dead;              // invalidated, freed once it stops running
+	bool linkable;          // ends in an unconditional B to link_target
+	uint16_t count;
+	uint32_t link_target;
+
+	uint32_t (*native)(struct block *b);   // returns instructions executed
+	void *native_data;
+
+	struct block *hash_next;
+	struct block *chunk_next;   // blocks in the same RAM code chunk
+
+	// direct chaining: `link` is the successor found at link_target, every
+	// block linking to this one is on `incoming` through its link_next
+	struct block *link;
+	struct block *incoming;
+	struct block *link_next;
+	struct block_insn insns[];
+};
+
+// A native backend compiles hot blocks. compile() returns false to leave the
+// block in the cached tier; release() frees whatever compile() attached.
+struct exec_backend {
+	const char *name;
+	bool (*compile)(struct block *b);
+	void (*release)(struct block *b);
+};
+
+struct exec_stats {
+	uint64_t interpreted_insns;
+	uint64_t cached_insns;
+	uint64_t native_runs;
+	uint64_t blocks_translated;
+	uint64_t blocks_compiled;
+	uint64_t native_rejected;   // hot blocks without a backend to take them
+	uint64_t blocks_live;
+	uint64_t blocks_invalidated;
+	uint64_t code_writes;       // stores that hit a chunk holding code
+	uint64_t blocks_linked;
+	uint64_t links_followed;
+};
+
+extern struct exec_stats exec_stats;
+
+void exec_init(void);
+void exec_shutdown(void);
+void exec_set_backend(const struct exec_backend *backend);
+void exec_flush(void);
+
+// Runs for at least `insn_budget` instructions, stopping at a block boundary,
+// or fewer if the core stops (cpu.stop_reason). Returns how many ran.
+uint64_t exec_run(uint64_t insn_budget);
+
+struct block *exec_lookup(uint32_t pc);
+
+// Drops every block in the 256-byte RAM chunk containing `addr`. Called from
+// the store fast path when the chunk's code bit is set.
+void exec_invalidate_code(uint32_t addr);
+
+// Prints the totals and the `top` hottest blocks with their tier.
+void exec_dump_stats(FILE *out, unsigned top);
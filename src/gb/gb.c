@@ -0,0 +1,238 @@
+#include "gb.h"
+#include <string.h>
+#include "../audio.h"
+#include "../capture.h"
+
+#define AUDIO_CHUNK     1024
+
+const uint8_t gb_timer_shift[4] = { 10, 4, 6, 8 };
+
+// IO state right after the boot ROM hands over
+static const struct { uint8_t reg, value; } io_boot[] = {
+    { GB_P1, 0xCF }, { GB_SB, 0x00 }, { GB_SC, 0x7E }, { GB_TIMA, 0x00 },
+    { GB_TMA, 0x00 }, { GB_TAC, 0xF8 }, { GB_IF, 0xE1 }, { GB_LCDC, 0x91 },
+    { GB_STAT, 0x80 }, { GB_SCY, 0x00 }, { GB_SCX, 0x00 }, { GB_LYC, 0x00 },
+    { GB_BGP, 0xFC }, { GB_WY, 0x00 }, { GB_WX, 0x00 },
+};
+
+static uint32_t audio_clock(struct gb *gb) {
+    return gb->cycles - gb->audio_frame;
+}
+
+static void schedule(struct gb *gb) {
+    uint64_t audio_end = gb->audio_frame + GB_FRAME_CYCLES;
+    gb->next_event = gb->ppu.next_event < audio_end ? gb->ppu.next_event : audio_end;
+}
+
+static void end_audio_frame(struct gb *gb) {
+    psg_end_frame(&gb->psg, audio_clock(gb));
+    gb->audio_frame = gb->cycles;
+
+    if (!gb->silent) {
+        int16_t frames[AUDIO_CHUNK * 2];
+        uint32_t n;
+        while ((n = psg_read_samples(&gb->psg, frames, AUDIO_CHUNK))) {
+            audio_output(&audio, frames, n);
+            if (capture.active)
+                capture_write(&capture, CAPTURE_MIX, frames, n);
+        }
+    }
+
+    if (gb->next_rate != gb->out_rate) {
+        gb->out_rate = gb->next_rate;
+        psg_set_sample_rate(&gb->psg, gb->out_rate);
+    }
+}
+
+void gb_events(struct gb *gb) {
+    if (gb->cycles >= gb->ppu.next_event)
+        gb_ppu_event(gb);
+    if (gb->cycles - gb->audio_frame >= GB_FRAME_CYCLES)
+        end_audio_frame(gb);
+    schedule(gb);
+}
+
+void gb_timer_ticks(struct gb *gb, uint32_t ticks) {
+    uint32_t tima = gb->io[GB_TIMA] + ticks;
+    while (tima > 0xFF) {
+        tima = tima - 0x100 + gb->io[GB_TMA];
+        gb->io[GB_IF] |= GB_IRQ_TIMER;
+    }
+    gb->io[GB_TIMA] = tima;
+}
+
+static uint8_t read_joypad(struct gb *gb) {
+    uint8_t select = gb->io[GB_P1];
+    uint8_t low = 0x0F;
+    if (!(select & 0x10))
+        low &= ~(gb->buttons >> 4);
+    if (!(select & 0x20))
+        low &= ~gb->buttons;
+    return 0xC0 | (select & 0x30) | (low & 0x0F);
+}
+
+static uint8_t read_io(struct gb *gb, uint8_t reg) {
+    switch (reg) {
+    case GB_P1:
+        return read_joypad(gb);
+    case GB_DIV:
+        return gb->div >> 8;
+    default:
+        if (reg >= NR10 && reg < PSG_REGS)
+            return psg_read(&gb->psg, reg, audio_clock(gb));
+        return gb->io[reg];
+    }
+}
+
+static void write_io(struct gb *gb, uint8_t reg, uint8_t value) {
+    uint8_t old = gb->io[reg];
+
+    switch (reg) {
+    case GB_P1:
+        gb->io[reg] = (old & 0xCF) | (value & 0x30);
+        break;
+    case GB_SC:
+        // no link partner: an internally clocked transfer shifts in 0xFF
+        if ((value & 0x81) == 0x81) {
+            gb->io[GB_SB] = 0xFF;
+            gb->io[GB_IF] |= GB_IRQ_SERIAL;
+            value &= 0x7F;
+        }
+        gb->io[reg] = value | 0x7E;
+        break;
+    case GB_DIV: {
+        // the reset is a falling edge on the bit TIMA counts
+        unsigned shift = gb_timer_shift[gb->io[GB_TAC] & 3];
+        if ((gb->io[GB_TAC] & 4) && (gb->div >> (shift - 1) & 1))
+            gb_timer_ticks(gb, 1);
+        gb->div = 0;
+        break;
+    }
+    case GB_TAC:
+        gb->io[reg] = value | 0xF8;
+        break;
+    case GB_IF:
+        gb->io[reg] = value | 0xE0;
+        break;
+    case GB_LCDC:
+        gb_ppu_io_write(gb, reg, value);
+        schedule(gb);
+        break;
+    case GB_STAT:
+    case GB_SCX:
+    case GB_LYC:
+    case GB_BGP:
+        gb_ppu_io_write(gb, reg, value);
+        break;
+    case GB_LY:
+        break;
+    case GB_DMA:
+        // OAM DMA is done at once; the CPU normally waits it out in HRAM
+        gb->io[reg] = value;
+        for (unsigned i = 0; i < sizeof(gb->oam); i++)
+            gb->oam[i] = gb_read8(gb, (value << 8) | i);
+        break;
+    default:
+        if (reg >= NR10 && reg < PSG_REGS)
+            psg_write(&gb->psg, reg, value, audio_clock(gb));
+        else
+            gb->io[reg] = value;
+        break;
+    }
+}
+
+uint8_t gb_read_slow(struct gb *gb, uint16_t addr) {
+    if (addr < 0xF000)
+        return gb_cart_read(gb, addr);
+    if (addr < 0xFE00)
+        return gb->wram[addr - 0xE000];
+    if (addr < 0xFEA0)
+        return gb->oam[addr - 0xFE00];
+    if (addr < 0xFF00)
+        return 0x00;
+    if (addr < 0xFF80)
+        return read_io(gb, addr & 0x7F);
+    if (addr < 0xFFFF)
+        return gb->hram[addr - 0xFF80];
+    return gb->ie;
+}
+
+void gb_write_slow(struct gb *gb, uint16_t addr, uint8_t value) {
+    if (addr < 0x8000)
+        gb_cart_control(gb, addr, value);
+    else if (addr < 0xF000)
+        gb_cart_write(gb, addr, value);
+    else if (addr < 0xFE00)
+        gb->wram[addr - 0xE000] = value;
+    else if (addr < 0xFEA0)
+        gb->oam[addr - 0xFE00] = value;
+    else if (addr < 0xFF00)
+        return;
+    else if (addr < 0xFF80)
+        write_io(gb, addr & 0x7F, value);
+    else if (addr < 0xFFFF)
+        gb->hram[addr - 0xFF80] = value;
+    else
+        gb->ie = value;
+}
+
+static void map_memory(struct gb *gb, const struct gb_cart_type *type, const uint8_t *save, size_t save_size) {
+    for (unsigned i = 0; i < 2; i++) {
+        gb->read_page[0x8 + i] = gb->write_page[0x8 + i] = gb->vram + i * 0x1000;
+        gb->read_page[0xC + i] = gb->write_page[0xC + i] = gb->wram + i * 0x1000;
+    }
+    // echo RAM; its 0xF000 part shares the page with OAM and IO
+    gb->read_page[0xE] = gb->write_page[0xE] = gb->wram;
+    gb_cart_init(gb, type, save, save_size);
+}
+
+void gb_init(struct gb *gb, const uint8_t *rom, size_t rom_size, const struct gb_cart_type *type, const uint8_t *save, size_t save_size) {
+    gb_cpu_init_tables();
+
+    memset(gb, 0, sizeof(*gb));
+    gb->rom = rom;
+    gb->rom_size = rom_size;
+    map_memory(gb, type, save, save_size);
+
+    gb_cpu_reset(&gb->cpu);
+    // unused registers read back 0xFF
+    memset(gb->io, 0xFF, sizeof(gb->io));
+    for (unsigned i = 0; i < sizeof(io_boot) / sizeof(io_boot[0]); i++)
+        gb->io[io_boot[i].reg] = io_boot[i].value;
+    gb->div = 0xABCC;
+
+    gb->out_rate = gb->next_rate = AUDIO_RATE;
+    psg_init(&gb->psg, 1, AUDIO_RATE, false);
+    psg_write(&gb->psg, NR52, 0x80, 0);
+    psg_write(&gb->psg, NR50, 0x77, 0);
+    psg_write(&gb->psg, NR51, 0xF3, 0);
+
+    gb_ppu_init(gb);
+    schedule(gb);
+}
+
+void gb_free(struct gb *gb) {
+    gb_cart_free(gb);
+    psg_free(&gb->psg);
+}
+
+void gb_run_frame(struct gb *gb) {
+    // a whole frame of LCD-off cycles stands in for a missing VBlank
+    gb->frame_done = false;
+    gb_cpu_run(gb, gb->cycles + GB_FRAME_CYCLES * ((gb->io[GB_LCDC] & 0x80) ? 2 : 1));
+}
+
+void gb_set_buttons(struct gb *gb, uint8_t buttons) {
+    if (buttons & ~gb->buttons)
+        gb->io[GB_IF] |= GB_IRQ_JOYPAD;
+    gb->buttons = buttons;
+}
+
+void gb_set_silent(struct gb *gb, bool silent) {
+    psg_set_silent(&gb->psg, silent, audio_clock(gb));
+    gb->silent = silent;
+}
+
+void gb_set_output_rate(struct gb *gb, double rate) {
+    gb->next_rate = rate;
+}
@@ -0,0 +1,147 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "gb_cpu.h"
+#include "gb_ppu.h"
+#include "gb_cart.h"
+#include "../psg.h"
+
+// The original Game Boy (DMG). The bus is a table of 4KB pages: a page with
+// a pointer is plain memory, a NULL page goes through gb_read_slow() /
+// gb_write_slow() (cartridge control, disabled RAM or the MBC3 clock, the
+// 0xFxxx IO page).
+// Timing is per instruction: the timer is stepped after each one and the
+// PPU only runs when its next mode change is due.
+
+#define GB_CLOCK            4194304
+#define GB_FRAME_CYCLES     70224       // 154 lines of 456 cycles
+#define GB_FRAME_RATE       ((double)GB_CLOCK / GB_FRAME_CYCLES)
+
+// interrupt flags, IE and IF
+enum {
+	GB_IRQ_VBLANK   = 0x01,
+	GB_IRQ_STAT     = 0x02,
+	GB_IRQ_TIMER    = 0x04,
+	GB_IRQ_SERIAL   = 0x08,
+	GB_IRQ_JOYPAD   = 0x10,
+};
+
+// IO registers, the low byte of their 0xFFxx address
+enum {
+	GB_P1   = 0x00,
+	GB_SB   = 0x01,
+	GB_SC   = 0x02,
+	GB_DIV  = 0x04,
+	GB_TIMA = 0x05,
+	GB_TMA  = 0x06,
+	GB_TAC  = 0x07,
+	GB_IF   = 0x0F,
+	GB_LCDC = 0x40,
+	GB_STAT = 0x41,
+	GB_SCY  = 0x42,
+	GB_SCX  = 0x43,
+	GB_LY   = 0x44,
+	GB_LYC  = 0x45,
+	GB_DMA  = 0x46,
+	GB_BGP  = 0x47,
+	GB_OBP0 = 0x48,
+	GB_OBP1 = 0x49,
+	GB_WY   = 0x4A,
+	GB_WX   = 0x4B,
+};
+
+// gb_set_buttons() bits
+enum {
+	GB_BUTTON_A      = 0x01,
+	GB_BUTTON_B      = 0x02,
+	GB_BUTTON_SELECT = 0x04,
+	GB_BUTTON_START  = 0x08,
+	GB_BUTTON_RIGHT  = 0x10,
+	GB_BUTTON_LEFT   = 0x20,
+	GB_BUTTON_UP     = 0x40,
+	GB_BUTTON_DOWN   = 0x80,
+};
+
+struct gb {
+	struct gb_cpu cpu;
+	struct gb_ppu ppu;
+	struct psg psg;
+	struct gb_cart cart;
+
+	const uint8_t *read_page[16];
+	uint8_t *write_page[16];
+
+	const uint8_t *rom;
+	size_t rom_size;
+
+	uint8_t vram[0x2000];
+	uint8_t wram[0x2000];
+	uint8_t oam[0xA0];
+	uint8_t io[0x80];
+	uint8_t hram[0x7F];
+	uint8_t ie;
+
+	uint64_t cycles;        // since power on
+	uint64_t next_event;    // earliest PPU or audio deadline
+	uint64_t audio_frame;   // start of the current audio frame
+	uint16_t div;           // internal divider, DIV is its high byte
+	uint8_t buttons;        // held, GB_BUTTON_*
+	bool frame_done;        // set by the PPU at VBlank
+	bool silent;
+	double out_rate;        // of the current audio frame's samples
+	double next_rate;       // from the next audio frame on
+};
+
+// `save` is the battery backed image to resume from, NULL for a fresh cart.
+void gb_init(struct gb *gb, const uint8_t *rom, size_t rom_size, const struct gb_cart_type *type, const uint8_t *save, size_t save_size);
+void gb_free(struct gb *gb);
+
+// Runs up to the next VBlank, or one frame's worth of cycles with the LCD
+// off.
+void gb_run_frame(struct gb *gb);
+
+void gb_set_buttons(struct gb *gb, uint8_t buttons);
+void gb_set_silent(struct gb *gb, bool silent);
+
+// Sample rate to generate at, for rate control. Takes effect at the next
+// audio frame.
+void gb_set_output_rate(struct gb *gb, double rate);
+
+uint8_t gb_read_slow(struct gb *gb, uint16_t addr);
+void gb_write_slow(struct gb *gb, uint16_t addr, uint8_t value);
+
+// PPU mode changes and audio frame ends, once cycles reach next_event.
+void gb_events(struct gb *gb);
+void gb_timer_ticks(struct gb *gb, uint32_t ticks);
+
+// T-cycles per TIMA increment, as a shift, by TAC bits 0-1
+extern const uint8_t gb_timer_shift[4];
+
+static inline uint8_t gb_read8(struct gb *gb, uint16_t addr) {
+	const uint8_t *page = gb->read_page[addr >> 12];
+	if (__builtin_expect(page != NULL, 1))
+		return page[addr & 0xFFF];
+	return gb_read_slow(gb, addr);
+}
+
+static inline void gb_write8(struct gb *gb, uint16_t addr, uint8_t value) {
+	uint8_t *page = gb->write_page[addr >> 12];
+	if (__builtin_expect(page != NULL, 1))
+		page[addr & 0xFFF] = value;
+	else
+		gb_write_slow(gb, addr, value);
+}
+
+static inline void gb_advance(struct gb *gb, uint32_t cycles) {
+	uint32_t old = gb->div;
+	gb->div = old + cycles;
+	if (gb->io[GB_TAC] & 4) {
+		unsigned shift = gb_timer_shift[gb->io[GB_TAC] & 3];
+		uint32_t ticks = ((old + cycles) >> shift) - (old >> shift);
+		if (ticks)
+			gb_timer_ticks(gb, ticks);
+	}
+	if (gb->cycles >= gb->next_event)
+		gb_events(gb);
+}
@@ -0,0 +1,259 @@
+#include "gb.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ROM_BANK        0x4000
+#define RAM_BANK        0x2000
+#define PAGE            0x1000
+#define DAY             86400
+#define RTC_DAYS        512
+
+static void map_rom(struct gb *gb, unsigned window, unsigned bank) {
+    const uint8_t *base = gb->rom + (size_t)(bank % gb->cart.rom_banks) * ROM_BANK;
+    for (unsigned i = 0; i < ROM_BANK / PAGE; i++)
+        gb->read_page[window * 4 + i] = base + i * PAGE;
+}
+
+static void map_ram(struct gb *gb, uint8_t *base) {
+    for (unsigned i = 0; i < RAM_BANK / PAGE; i++) {
+        gb->read_page[0xA + i] = base ? base + i * PAGE : NULL;
+        gb->write_page[0xA + i] = base ? base + i * PAGE : NULL;
+    }
+}
+
+static void update_mbc1(struct gb *gb) {
+    struct gb_cart *cart = &gb->cart;
+    unsigned low = cart->rom_bank & 0x1F;
+
+    // the zero check only sees the low 5 bits: banks 0x20, 0x40, 0x60 are
+    // unreachable in the upper window
+    map_rom(gb, 0, cart->mode ? cart->bank_hi << 5 : 0);
+    map_rom(gb, 1, cart->bank_hi << 5 | (low ? low : 1));
+
+    unsigned ram_bank = cart->mode ? cart->bank_hi : 0;
+    bool ram = cart->ram_enabled && cart->ram_banks;
+    map_ram(gb, ram ? cart->ram + (ram_bank % cart->ram_banks) * RAM_BANK : NULL);
+}
+
+static void update_mbc3(struct gb *gb) {
+    struct gb_cart *cart = &gb->cart;
+
+    map_rom(gb, 0, 0);
+    map_rom(gb, 1, cart->rom_bank ? cart->rom_bank : 1);
+
+    // clock registers go through gb_cart_read/write
+    bool ram = cart->ram_enabled && cart->ram_banks && cart->bank_hi < 4;
+    map_ram(gb, ram ? cart->ram + (cart->bank_hi % cart->ram_banks) * RAM_BANK : NULL);
+}
+
+static void update_banks(struct gb *gb) {
+    switch (gb->cart.mapper) {
+    case GB_MAPPER_MBC1:
+        update_mbc1(gb);
+        break;
+    case GB_MAPPER_MBC3:
+        update_mbc3(gb);
+        break;
+    default:
+        map_rom(gb, 0, 0);
+        map_rom(gb, 1, 1);
+        map_ram(gb, gb->cart.ram_banks ? gb->cart.ram : NULL);
+        break;
+    }
+}
+
+static uint64_t rtc_counter(struct gb_rtc *rtc) {
+    if (rtc->halted)
+        return rtc->stopped;
+    int64_t now = time(NULL);
+    return now > rtc->base ? (uint64_t)(now - rtc->base) : 0;
+}
+
+static void rtc_set_counter(struct gb_rtc *rtc, uint64_t counter) {
+    if (rtc->halted)
+        rtc->stopped = counter;
+    else
+        rtc->base = (int64_t)time(NULL) - (int64_t)counter;
+}
+
+// The day counter is 9 bits; past it the carry flag sets and the count wraps.
+static uint64_t rtc_wrap(struct gb_rtc *rtc) {
+    uint64_t counter = rtc_counter(rtc);
+    if (counter >= (uint64_t)RTC_DAYS * DAY) {
+        rtc->carry = true;
+        counter %= (uint64_t)RTC_DAYS * DAY;
+        rtc_set_counter(rtc, counter);
+    }
+    return counter;
+}
+
+// The registers as they read right now.
+static void rtc_regs(struct gb_rtc *rtc, uint8_t *regs) {
+    uint64_t counter = rtc_wrap(rtc);
+    unsigned days = counter / DAY;
+
+    regs[GB_RTC_S] = counter % 60;
+    regs[GB_RTC_M] = counter / 60 % 60;
+    regs[GB_RTC_H] = counter / 3600 % 24;
+    regs[GB_RTC_DL] = days;
+    regs[GB_RTC_DH] = (days >> 8) | (rtc->halted ? 0x40 : 0) | (rtc->carry ? 0x80 : 0);
+}
+
+static void rtc_latch(struct gb_rtc *rtc) {
+    rtc_regs(rtc, rtc->latched);
+}
+
+// Writes replace one field of the live counter.
+static void rtc_write(struct gb_rtc *rtc, unsigned reg, uint8_t value) {
+    uint64_t counter = rtc_wrap(rtc);
+    uint64_t s = counter % 60, m = counter / 60 % 60, h = counter / 3600 % 24, days = counter / DAY;
+
+    switch (reg) {
+    case GB_RTC_S:  s = value % 60; break;
+    case GB_RTC_M:  m = value % 60; break;
+    case GB_RTC_H:  h = value % 24; break;
+    case GB_RTC_DL: days = (days & 0x100) | value; break;
+    case GB_RTC_DH:
+        days = (days & 0xFF) | (value & 1) << 8;
+        rtc->carry = value & 0x80;
+        if ((value & 0x40) && !rtc->halted) {
+            rtc->stopped = counter;
+            rtc->halted = true;
+        } else if (!(value & 0x40) && rtc->halted) {
+            rtc->halted = false;
+        }
+        break;
+    }
+    rtc_set_counter(rtc, days * DAY + h * 3600 + m * 60 + s);
+    rtc->latched[reg] = value;
+}
+
+static uint64_t get_le(const uint8_t *p, unsigned size) {
+    uint64_t value = 0;
+    for (unsigned i = size; i--; )
+        value = value << 8 | p[i];
+    return value;
+}
+
+static void put_le(uint8_t *p, unsigned size, uint64_t value) {
+    for (unsigned i = 0; i < size; i++, value >>= 8)
+        p[i] = value;
+}
+
+static void rtc_save(struct gb_rtc *rtc, uint8_t *footer) {
+    uint8_t live[GB_RTC_REGS];
+    rtc_regs(rtc, live);
+    for (unsigned i = 0; i < GB_RTC_REGS; i++) {
+        put_le(footer + i * 4, 4, live[i]);
+        put_le(footer + (GB_RTC_REGS + i) * 4, 4, rtc->latched[i]);
+    }
+    put_le(footer + GB_RTC_REGS * 8, 8, (uint64_t)time(NULL));
+}
+
+// A running clock keeps counting over the time the save sat on disk.
+static void rtc_load(struct gb_rtc *rtc, const uint8_t *footer, size_t size) {
+    uint8_t live[GB_RTC_REGS];
+    for (unsigned i = 0; i < GB_RTC_REGS; i++) {
+        live[i] = footer[i * 4];
+        rtc->latched[i] = footer[(GB_RTC_REGS + i) * 4];
+    }
+    int64_t saved = (int64_t)get_le(footer + GB_RTC_REGS * 8, size >= GB_RTC_SAVE_SIZE ? 8 : 4);
+
+    uint64_t days = live[GB_RTC_DL] | (live[GB_RTC_DH] & 1) << 8;
+    uint64_t counter = days * DAY + live[GB_RTC_H] % 24 * 3600 + live[GB_RTC_M] % 60 * 60 + live[GB_RTC_S] % 60;
+    rtc->halted = live[GB_RTC_DH] & 0x40;
+    rtc->carry = live[GB_RTC_DH] & 0x80;
+    rtc->stopped = counter;
+    rtc->base = saved - (int64_t)counter;
+}
+
+void gb_cart_control(struct gb *gb, uint16_t addr, uint8_t value) {
+    struct gb_cart *cart = &gb->cart;
+
+    switch (addr >> 13) {
+    case 0:
+        cart->ram_enabled = (value & 0x0F) == 0x0A;
+        break;
+    case 1:
+        cart->rom_bank = cart->mapper == GB_MAPPER_MBC1 ? value & 0x1F : value & 0x7F;
+        break;
+    case 2:
+        cart->bank_hi = cart->mapper == GB_MAPPER_MBC1 ? value & 0x03 : value & 0x0F;
+        break;
+    case 3:
+        if (cart->mapper == GB_MAPPER_MBC1)
+            cart->mode = value & 1;
+        else if (cart->has_rtc && cart->rtc.latch == 0 && value == 1)
+            rtc_latch(&cart->rtc);
+        cart->rtc.latch = value;
+        break;
+    }
+    if (cart->mapper != GB_MAPPER_NONE)
+        update_banks(gb);
+}
+
+uint8_t gb_cart_read(struct gb *gb, uint16_t addr) {
+    struct gb_cart *cart = &gb->cart;
+    (void)addr;
+
+    if (cart->ram_enabled && cart->has_rtc && cart->bank_hi >= 8 && cart->bank_hi - 8 < GB_RTC_REGS)
+        return cart->rtc.latched[cart->bank_hi - 8];
+    return 0xFF;
+}
+
+void gb_cart_write(struct gb *gb, uint16_t addr, uint8_t value) {
+    struct gb_cart *cart = &gb->cart;
+    (void)addr;
+
+    if (cart->ram_enabled && cart->has_rtc && cart->bank_hi >= 8 && cart->bank_hi - 8 < GB_RTC_REGS)
+        rtc_write(&cart->rtc, cart->bank_hi - 8, value);
+}
+
+size_t gb_cart_save_size(const struct gb_cart_type *type) {
+    if (!type->battery)
+        return 0;
+    return type->ram_size + (type->rtc ? GB_RTC_SAVE_SIZE : 0);
+}
+
+void gb_cart_init(struct gb *gb, const struct gb_cart_type *type, const uint8_t *save, size_t save_size) {
+    struct gb_cart *cart = &gb->cart;
+
+    cart->mapper = type->mapper;
+    cart->battery = type->battery;
+    cart->has_rtc = type->rtc;
+    cart->rom_banks = gb->rom_size / ROM_BANK;
+    assert(cart->rom_banks >= 2);
+
+    cart->ram_size = type->ram_size;
+    if (cart->ram_size) {
+        // a 2KB chip still gets a whole bank so the pages stay in bounds
+        cart->ram_banks = (cart->ram_size + RAM_BANK - 1) / RAM_BANK;
+        cart->ram = calloc(cart->ram_banks, RAM_BANK);
+    }
+    cart->rtc.base = time(NULL);
+    if (save) {
+        assert(save_size >= cart->ram_size);
+        if (cart->ram_size)
+            memcpy(cart->ram, save, cart->ram_size);
+        if (cart->has_rtc && save_size >= cart->ram_size + GB_RTC_SAVE_SIZE - 4)
+            rtc_load(&cart->rtc, save + cart->ram_size, save_size - cart->ram_size);
+    }
+    cart->rom_bank = 1;
+    update_banks(gb);
+}
+
+void gb_cart_save(struct gb *gb, uint8_t *save) {
+    struct gb_cart *cart = &gb->cart;
+
+    if (cart->ram_size)
+        memcpy(save, cart->ram, cart->ram_size);
+    if (cart->has_rtc)
+        rtc_save(&cart->rtc, save + cart->ram_size);
+}
+
+void gb_cart_free(struct gb *gb) {
+    free(gb->cart.ram);
+    gb->cart.ram = NULL;
+}
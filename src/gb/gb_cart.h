@@ -0,0 +1,88 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Cartridge mappers. Banking never copies: a bank switch repoints the bus
+// pages for the 0x4000-0x7FFF ROM window and the 0xA000-0xBFFF RAM window.
+// Only control writes, and RAM accesses while it's disabled or the MBC3
+// clock is selected, take the slow path.
+
+enum {
+	GB_MAPPER_NONE,
+	GB_MAPPER_MBC1,
+	GB_MAPPER_MBC3,
+};
+
+// What the cartridge header says, decoded once by the loader.
+struct gb_cart_type {
+	uint8_t mapper;
+	bool battery;
+	bool rtc;
+	uint32_t ram_size;
+};
+
+// MBC3 clock registers, as selected through 0x4000-0x5FFF
+enum {
+	GB_RTC_S,
+	GB_RTC_M,
+	GB_RTC_H,
+	GB_RTC_DL,
+	GB_RTC_DH,
+	GB_RTC_REGS,
+};
+
+// The clock isn't ticked: it's a host timestamp for counter zero, the
+// registers only get computed from it when the game latches or writes them.
+struct gb_rtc {
+	int64_t base;           // host time, in seconds, at which the counter was 0
+	uint64_t stopped;       // counter value while halted (DH bit 6)
+	bool halted;
+	bool carry;             // day counter overflowed, sticky until written
+	uint8_t latched[GB_RTC_REGS];
+	uint8_t latch;          // last value written to 0x6000-0x7FFF
+};
+
+struct gb_cart {
+	uint8_t mapper;
+	bool battery;
+	bool has_rtc;
+
+	uint8_t *ram;
+	size_t ram_size;
+	uint16_t rom_banks;     // of 16KB
+	uint8_t ram_banks;      // of 8KB
+
+	bool ram_enabled;
+	uint8_t rom_bank;       // MBC1: low 5 bits, MBC3: 7 bits
+	uint8_t bank_hi;        // MBC1: 2-bit upper register, MBC3: RAM bank or clock register
+	bool mode;              // MBC1 banking mode
+
+	struct gb_rtc rtc;
+};
+
+// Clock carts save the common footer after the RAM image: the live and the
+// latched registers as 32-bit words, then the host time they were taken at.
+// Older saves end with a 32-bit time, 4 bytes short.
+#define GB_RTC_SAVE_SIZE        48
+
+struct gb;
+
+// Bytes of the battery backed save, RAM then the clock footer; 0 without a
+// battery.
+size_t gb_cart_save_size(const struct gb_cart_type *type);
+
+// Sets the mapper up and maps its first banks. RAM and the clock resume from
+// `save` if there is one: the full image, or for clock carts also RAM alone.
+void gb_cart_init(struct gb *gb, const struct gb_cart_type *type, const uint8_t *save, size_t save_size);
+void gb_cart_free(struct gb *gb);
+
+// Fills gb_cart_save_size() bytes.
+void gb_cart_save(struct gb *gb, uint8_t *save);
+
+// Stores to 0x0000-0x7FFF
+void gb_cart_control(struct gb *gb, uint16_t addr, uint8_t value);
+
+// 0xA000-0xBFFF while no RAM page is mapped
+uint8_t gb_cart_read(struct gb *gb, uint16_t addr);
+void gb_cart_write(struct gb *gb, uint16_t addr, uint8_t value);
@@ -0,0 +1,526 @@
+#include "gb.h"
+
+// Dispatch is a flat table of 256 handlers for the base opcodes and another
+// for the CB-prefixed ones. Each handler is execute() or execute_cb() with
+// its opcode as a constant, so the compiler folds the operand decoding and
+// every entry ends up as straight-line code for that one instruction.
+
+#define INLINE static inline __attribute__((always_inline))
+
+typedef void (*op_fn)(struct gb *gb);
+
+static const op_fn ops[256], cb_ops[256];
+
+// H and C from the carries out of bits 3 and 7, which are bits 4 and 8 of
+// a ^ b ^ result: index ((a ^ b ^ r) >> 4) & 0x11.
+static const uint8_t carry_flags[0x12] = {
+    [0x01] = GB_FLAG_H,
+    [0x10] = GB_FLAG_C,
+    [0x11] = GB_FLAG_H | GB_FLAG_C,
+};
+
+#define CARRIES(x)  carry_flags[((x) >> 4) & 0x11]
+#define ZERO(r)     ((uint8_t)(r) ? 0 : GB_FLAG_Z)
+
+// A and F after DAA, by N, H, C (F bits 4-6) and A: (a << 8) | f
+static uint16_t daa_table[8 * 256];
+
+// base cycles, conditional branches add theirs when taken
+static const uint8_t op_cycles[256] = {
+     4, 12,  8,  8,  4,  4,  8,  4, 20,  8,  8,  8,  4,  4,  8,  4,
+     4, 12,  8,  8,  4,  4,  8,  4, 12,  8,  8,  8,  4,  4,  8,  4,
+     8, 12,  8,  8,  4,  4,  8,  4,  8,  8,  8,  8,  4,  4,  8,  4,
+     8, 12,  8,  8, 12, 12, 12,  4,  8,  8,  8,  8,  4,  4,  8,  4,
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+     8,  8,  8,  8,  8,  8,  4,  8,  4,  4,  4,  4,  4,  4,  8,  4,
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+     8, 12, 12, 16, 12, 16,  8, 16,  8, 16, 12,  4, 12, 24,  8, 16,
+     8, 12, 12,  4, 12, 16,  8, 16,  8, 16, 12,  4, 12,  4,  8, 16,
+    12, 12,  8,  4,  4, 16,  8, 16, 16,  4, 16,  4,  4,  4,  8, 16,
+    12, 12,  8,  4,  4, 16,  8, 16, 12,  8, 16,  4,  4,  4,  8, 16,
+};
+
+INLINE uint8_t fetch8(struct gb *gb) {
+    return gb_read8(gb, gb->cpu.pc++);
+}
+
+INLINE uint16_t fetch16(struct gb *gb) {
+    uint8_t lo = fetch8(gb);
+    return lo | fetch8(gb) << 8;
+}
+
+INLINE void push16(struct gb *gb, uint16_t value) {
+    gb_write8(gb, --gb->cpu.sp, value >> 8);
+    gb_write8(gb, --gb->cpu.sp, value);
+}
+
+INLINE uint16_t pop16(struct gb *gb) {
+    uint8_t lo = gb_read8(gb, gb->cpu.sp++);
+    return lo | gb_read8(gb, gb->cpu.sp++) << 8;
+}
+
+// r[]: B C D E H L (HL) A
+INLINE uint8_t read_r(struct gb *gb, unsigned r) {
+    struct gb_cpu *c = &gb->cpu;
+    switch (r) {
+    case 0: return c->b;
+    case 1: return c->c;
+    case 2: return c->d;
+    case 3: return c->e;
+    case 4: return c->h;
+    case 5: return c->l;
+    case 6: return gb_read8(gb, c->hl);
+    default: return c->a;
+    }
+}
+
+INLINE void write_r(struct gb *gb, unsigned r, uint8_t value) {
+    struct gb_cpu *c = &gb->cpu;
+    switch (r) {
+    case 0: c->b = value; break;
+    case 1: c->c = value; break;
+    case 2: c->d = value; break;
+    case 3: c->e = value; break;
+    case 4: c->h = value; break;
+    case 5: c->l = value; break;
+    case 6: gb_write8(gb, c->hl, value); break;
+    default: c->a = value; break;
+    }
+}
+
+// rp[]: BC DE HL SP
+INLINE uint16_t *rp(struct gb_cpu *c, unsigned p) {
+    switch (p) {
+    case 0: return &c->bc;
+    case 1: return &c->de;
+    case 2: return &c->hl;
+    default: return &c->sp;
+    }
+}
+
+// cc[]: NZ Z NC C
+INLINE bool condition(struct gb_cpu *c, unsigned cc) {
+    switch (cc) {
+    case 0: return !(c->f & GB_FLAG_Z);
+    case 1: return c->f & GB_FLAG_Z;
+    case 2: return !(c->f & GB_FLAG_C);
+    default: return c->f & GB_FLAG_C;
+    }
+}
+
+// ADD ADC SUB SBC AND XOR OR CP
+INLINE void alu(struct gb_cpu *c, unsigned op, uint8_t v) {
+    unsigned a = c->a, carry = (c->f >> 4) & 1, r;
+
+    switch (op) {
+    case 0: r = a + v; c->f = ZERO(r) | CARRIES(a ^ v ^ r); c->a = r; break;
+    case 1: r = a + v + carry; c->f = ZERO(r) | CARRIES(a ^ v ^ r); c->a = r; break;
+    case 2: r = a - v; c->f = GB_FLAG_N | ZERO(r) | CARRIES(a ^ v ^ r); c->a = r; break;
+    case 3: r = a - v - carry; c->f = GB_FLAG_N | ZERO(r) | CARRIES(a ^ v ^ r); c->a = r; break;
+    case 4: c->a = a & v; c->f = ZERO(c->a) | GB_FLAG_H; break;
+    case 5: c->a = a ^ v; c->f = ZERO(c->a); break;
+    case 6: c->a = a | v; c->f = ZERO(c->a); break;
+    default: r = a - v; c->f = GB_FLAG_N | ZERO(r) | CARRIES(a ^ v ^ r); break;
+    }
+}
+
+// RLC RRC RL RR SLA SRA SWAP SRL, flags but Z as for the CB forms
+INLINE uint8_t rotate(struct gb_cpu *c, unsigned op, uint8_t v) {
+    unsigned carry = (c->f >> 4) & 1, out, r;
+
+    switch (op) {
+    case 0: out = v >> 7; r = v << 1 | out; break;
+    case 1: out = v & 1; r = v >> 1 | out << 7; break;
+    case 2: out = v >> 7; r = v << 1 | carry; break;
+    case 3: out = v & 1; r = v >> 1 | carry << 7; break;
+    case 4: out = v >> 7; r = v << 1; break;
+    case 5: out = v & 1; r = v >> 1 | (v & 0x80); break;
+    case 6: out = 0; r = v << 4 | v >> 4; break;
+    default: out = v & 1; r = v >> 1; break;
+    }
+    c->f = ZERO(r) | (out ? GB_FLAG_C : 0);
+    return r;
+}
+
+INLINE uint16_t add_sp(struct gb *gb) {
+    struct gb_cpu *c = &gb->cpu;
+    int8_t e = fetch8(gb);
+    unsigned low = c->sp & 0xFF, u = (uint8_t)e;
+    c->f = CARRIES(low ^ u ^ (low + u));
+    return c->sp + e;
+}
+
+INLINE void jump_relative(struct gb *gb, bool taken) {
+    int8_t e = fetch8(gb);
+    if (taken) {
+        gb->cpu.pc += e;
+        gb->cycles += 4;
+    }
+}
+
+INLINE void jump(struct gb *gb, bool taken) {
+    uint16_t target = fetch16(gb);
+    if (taken) {
+        gb->cpu.pc = target;
+        gb->cycles += 4;
+    }
+}
+
+INLINE void call(struct gb *gb, bool taken) {
+    uint16_t target = fetch16(gb);
+    if (taken) {
+        push16(gb, gb->cpu.pc);
+        gb->cpu.pc = target;
+        gb->cycles += 12;
+    }
+}
+
+static void halt(struct gb *gb) {
+    struct gb_cpu *c = &gb->cpu;
+
+    if (c->ime || !(gb->ie & gb->io[GB_IF] & 0x1F)) {
+        c->halted = true;
+        return;
+    }
+    // HALT bug: with an interrupt already pending and IME clear the CPU
+    // doesn't halt and reads the next opcode byte twice
+    uint8_t op = gb_read8(gb, c->pc);
+    gb->cycles += op_cycles[op];
+    ops[op](gb);
+}
+
+static void undefined(struct gb *gb) {
+    // the real CPU locks up until power off
+    gb->cpu.locked = true;
+    gb->cpu.halted = true;
+    gb->cpu.ime = false;
+}
+
+INLINE void execute_cb(struct gb *gb, uint8_t op) {
+    struct gb_cpu *c = &gb->cpu;
+    unsigned x = op >> 6, y = (op >> 3) & 7, z = op & 7;
+    uint8_t v = read_r(gb, z);
+
+    switch (x) {
+    case 0:
+        write_r(gb, z, rotate(c, y, v));
+        break;
+    case 1:
+        c->f = (c->f & GB_FLAG_C) | GB_FLAG_H | ((v >> y) & 1 ? 0 : GB_FLAG_Z);
+        break;
+    case 2:
+        write_r(gb, z, v & ~(1 << y));
+        break;
+    default:
+        write_r(gb, z, v | 1 << y);
+        break;
+    }
+}
+
+// x = op >> 6, y = bits 3-5, z = bits 0-2, p = y >> 1, q = y & 1
+INLINE void execute(struct gb *gb, uint8_t op) {
+    struct gb_cpu *c = &gb->cpu;
+    unsigned x = op >> 6, y = (op >> 3) & 7, z = op & 7, p = y >> 1, q = y & 1;
+
+    switch (x) {
+    case 0:
+        switch (z) {
+        case 0:
+            if (y == 0) {
+                // NOP
+            } else if (y == 1) {
+                uint16_t addr = fetch16(gb);
+                gb_write8(gb, addr, c->sp);
+                gb_write8(gb, addr + 1, c->sp >> 8);
+            } else if (y == 2) {
+                // STOP: no speed switch on the DMG, skip its operand
+                c->pc++;
+            } else if (y == 3) {
+                jump_relative(gb, true);
+                gb->cycles -= 4;
+            } else {
+                jump_relative(gb, condition(c, y - 4));
+            }
+            break;
+        case 1:
+            if (q == 0) {
+                *rp(c, p) = fetch16(gb);
+            } else {
+                uint32_t hl = c->hl, v = *rp(c, p), r = hl + v;
+                c->f = (c->f & GB_FLAG_Z) | CARRIES((hl ^ v ^ r) >> 8);
+                c->hl = r;
+            }
+            break;
+        case 2: {
+            uint16_t addr = p == 0 ? c->bc : p == 1 ? c->de : c->hl;
+            if (p == 2)
+                c->hl++;
+            else if (p == 3)
+                c->hl--;
+            if (q == 0)
+                gb_write8(gb, addr, c->a);
+            else
+                c->a = gb_read8(gb, addr);
+            break;
+        }
+        case 3:
+            *rp(c, p) += q ? -1 : 1;
+            break;
+        case 4: {
+            uint8_t r = read_r(gb, y) + 1;
+            c->f = (c->f & GB_FLAG_C) | ZERO(r) | ((r & 0x0F) == 0 ? GB_FLAG_H : 0);
+            write_r(gb, y, r);
+            break;
+        }
+        case 5: {
+            uint8_t r = read_r(gb, y) - 1;
+            c->f = (c->f & GB_FLAG_C) | GB_FLAG_N | ZERO(r) | ((r & 0x0F) == 0x0F ? GB_FLAG_H : 0);
+            write_r(gb, y, r);
+            break;
+        }
+        case 6:
+            write_r(gb, y, fetch8(gb));
+            break;
+        default:
+            switch (y) {
+            case 0: case 1: case 2: case 3:
+                // RLCA RRCA RLA RRA clear Z
+                c->a = rotate(c, y, c->a);
+                c->f &= GB_FLAG_C;
+                break;
+            case 4: {
+                uint16_t r = daa_table[((c->f >> 4) & 7) << 8 | c->a];
+                c->a = r >> 8;
+                c->f = r;
+                break;
+            }
+            case 5: c->a = ~c->a; c->f |= GB_FLAG_N | GB_FLAG_H; break;
+            case 6: c->f = (c->f & GB_FLAG_Z) | GB_FLAG_C; break;
+            default: c->f = (c->f & (GB_FLAG_Z | GB_FLAG_C)) ^ GB_FLAG_C; break;
+            }
+            break;
+        }
+        break;
+    case 1:
+        if (op == 0x76)
+            halt(gb);
+        else
+            write_r(gb, y, read_r(gb, z));
+        break;
+    case 2:
+        alu(c, y, read_r(gb, z));
+        break;
+    default:
+        switch (z) {
+        case 0:
+            if (y < 4) {
+                if (condition(c, y)) {
+                    c->pc = pop16(gb);
+                    gb->cycles += 12;
+                }
+            } else if (y == 4) {
+                gb_write8(gb, 0xFF00 | fetch8(gb), c->a);
+            } else if (y == 5) {
+                c->sp = add_sp(gb);
+            } else if (y == 6) {
+                c->a = gb_read8(gb, 0xFF00 | fetch8(gb));
+            } else {
+                c->hl = add_sp(gb);
+            }
+            break;
+        case 1:
+            if (q == 0) {
+                uint16_t v = pop16(gb);
+                if (p == 3)
+                    c->af = v & 0xFFF0;
+                else
+                    *rp(c, p) = v;
+            } else if (p == 0) {
+                c->pc = pop16(gb);
+            } else if (p == 1) {
+                c->pc = pop16(gb);
+                c->ime = true;
+            } else if (p == 2) {
+                c->pc = c->hl;
+            } else {
+                c->sp = c->hl;
+            }
+            break;
+        case 2:
+            if (y < 4)
+                jump(gb, condition(c, y));
+            else if (y == 4)
+                gb_write8(gb, 0xFF00 | c->c, c->a);
+            else if (y == 5)
+                gb_write8(gb, fetch16(gb), c->a);
+            else if (y == 6)
+                c->a = gb_read8(gb, 0xFF00 | c->c);
+            else
+                c->a = gb_read8(gb, fetch16(gb));
+            break;
+        case 3:
+            if (y == 0) {
+                c->pc = fetch16(gb);
+            } else if (y == 1) {
+                uint8_t cb = fetch8(gb);
+                gb->cycles += (cb & 7) != 6 ? 4 : (cb >> 6) == 1 ? 8 : 12;
+                cb_ops[cb](gb);
+            } else if (y == 6) {
+                c->ime = false;
+                c->ime_delay = 0;
+            } else if (y == 7) {
+                c->ime_delay = 2;
+            } else {
+                undefined(gb);
+            }
+            break;
+        case 4:
+            if (y < 4)
+                call(gb, condition(c, y));
+            else
+                undefined(gb);
+            break;
+        case 5:
+            if (q == 0)
+                push16(gb, p == 3 ? c->af : *rp(c, p));
+            else if (p == 0)
+                call(gb, true), gb->cycles -= 12;
+            else
+                undefined(gb);
+            break;
+        case 6:
+            alu(c, y, fetch8(gb));
+            break;
+        default:
+            push16(gb, c->pc);
+            c->pc = y * 8;
+            break;
+        }
+        break;
+    }
+}
+
+#define OPS16(h) \
+    OP(h##0) OP(h##1) OP(h##2) OP(h##3) OP(h##4) OP(h##5) OP(h##6) OP(h##7) \
+    OP(h##8) OP(h##9) OP(h##A) OP(h##B) OP(h##C) OP(h##D) OP(h##E) OP(h##F)
+#define OPS256 \
+    OPS16(0) OPS16(1) OPS16(2) OPS16(3) OPS16(4) OPS16(5) OPS16(6) OPS16(7) \
+    OPS16(8) OPS16(9) OPS16(A) OPS16(B) OPS16(C) OPS16(D) OPS16(E) OPS16(F)
+
+#define OP(n) \
+    static void op_##n(struct gb *gb) { execute(gb, 0x##n); } \
+    static void cb_##n(struct gb *gb) { execute_cb(gb, 0x##n); }
+OPS256
+#undef OP
+
+#define OP(n) op_##n,
+static const op_fn ops[256] = { OPS256 };
+#undef OP
+
+#define OP(n) cb_##n,
+static const op_fn cb_ops[256] = { OPS256 };
+#undef OP
+
+static void build_daa_table(void) {
+    for (unsigned nhc = 0; nhc < 8; nhc++) {
+        for (unsigned a = 0; a < 256; a++) {
+            bool n = nhc & 4, h = nhc & 2, carry = nhc & 1;
+            uint8_t r = a;
+            if (!n) {
+                if (carry || a > 0x99) {
+                    r += 0x60;
+                    carry = true;
+                }
+                if (h || (a & 0x0F) > 0x09)
+                    r += 0x06;
+            } else {
+                if (carry)
+                    r -= 0x60;
+                if (h)
+                    r -= 0x06;
+            }
+            uint8_t f = ZERO(r) | (n ? GB_FLAG_N : 0) | (carry ? GB_FLAG_C : 0);
+            daa_table[nhc << 8 | a] = r << 8 | f;
+        }
+    }
+}
+
+void gb_cpu_init_tables(void) {
+    static bool built;
+    if (built)
+        return;
+    build_daa_table();
+    built = true;
+}
+
+void gb_cpu_reset(struct gb_cpu *cpu) {
+    // DMG state after the boot ROM
+    *cpu = (struct gb_cpu){0};
+    cpu->af = 0x01B0;
+    cpu->bc = 0x0013;
+    cpu->de = 0x00D8;
+    cpu->hl = 0x014D;
+    cpu->sp = 0xFFFE;
+    cpu->pc = 0x0100;
+}
+
+static void interrupt(struct gb *gb, uint8_t pending) {
+    struct gb_cpu *c = &gb->cpu;
+    unsigned n = __builtin_ctz(pending);
+
+    c->ime = false;
+    gb->io[GB_IF] &= ~(1 << n);
+    push16(gb, c->pc);
+    c->pc = 0x40 + n * 8;
+    gb->cycles += 20;
+}
+
+// Sleeps until the next thing that could raise an interrupt: a PPU mode
+// change, the audio frame end or a TIMA overflow.
+static void skip_halt(struct gb *gb, uint64_t limit) {
+    uint64_t until = gb->next_event < limit ? gb->next_event : limit;
+
+    if (gb->io[GB_TAC] & 4) {
+        uint32_t period = 1u << gb_timer_shift[gb->io[GB_TAC] & 3];
+        uint64_t overflow = gb->cycles + period - (gb->div & (period - 1)) +
+            (uint64_t)(0xFF - gb->io[GB_TIMA]) * period;
+        if (overflow < until)
+            until = overflow;
+    }
+    uint32_t cycles = until > gb->cycles ? until - gb->cycles : 4;
+    gb->cycles += cycles;
+    gb_advance(gb, cycles);
+}
+
+void gb_cpu_run(struct gb *gb, uint64_t limit) {
+    struct gb_cpu *c = &gb->cpu;
+
+    while (!gb->frame_done && gb->cycles < limit) {
+        uint8_t pending = gb->ie & gb->io[GB_IF] & 0x1F;
+        if (pending && !c->locked) {
+            c->halted = false;
+            if (c->ime) {
+                interrupt(gb, pending);
+                gb_advance(gb, 20);
+                continue;
+            }
+        }
+        if (c->halted) {
+            skip_halt(gb, limit);
+            continue;
+        }
+
+        uint64_t start = gb->cycles;
+        uint8_t op = fetch8(gb);
+        gb->cycles += op_cycles[op];
+        ops[op](gb);
+        if (c->ime_delay && !--c->ime_delay)
+            c->ime = true;
+        gb_advance(gb, gb->cycles - start);
+    }
+}
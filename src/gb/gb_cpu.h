@@ -0,0 +1,37 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// Sharp LR35902. Registers are kept as byte pairs so 8 and 16-bit accesses
+// are both plain loads; this assumes a little-endian host, like the rest of
+// the emulator.
+
+enum {
+	GB_FLAG_Z = 0x80,
+	GB_FLAG_N = 0x40,
+	GB_FLAG_H = 0x20,
+	GB_FLAG_C = 0x10,
+};
+
+struct gb_cpu {
+	union { struct { uint8_t f, a; }; uint16_t af; };
+	union { struct { uint8_t c, b; }; uint16_t bc; };
+	union { struct { uint8_t e, d; }; uint16_t de; };
+	union { struct { uint8_t l, h; }; uint16_t hl; };
+	uint16_t sp;
+	uint16_t pc;
+	bool ime;
+	uint8_t ime_delay;      // EI takes effect after the next instruction
+	bool halted;
+	bool locked;            // hit an undefined opcode, only a reset helps
+};
+
+struct gb;
+
+void gb_cpu_reset(struct gb_cpu *cpu);
+
+// Builds the flag and DAA tables, once.
+void gb_cpu_init_tables(void);
+
+// Runs until the PPU finishes a frame or `limit` cycles are reached.
+void gb_cpu_run(struct gb *gb, uint64_t limit);
@@ -0,0 +1,420 @@
+#include "gb.h"
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define NEVER           UINT64_MAX
+#define MAX_SPRITES     10
+#define LINE_TILES      21          // 160 pixels plus a partial tile
+#define FIFO_START      12          // dots into mode 3 before the first pixel
+
+// obj line buffer: color index, OBP1, behind BG colors 1-3; 0 is transparent
+#define OBJ_COLOR       0x03
+#define OBJ_PALETTE1    0x04
+#define OBJ_BEHIND      0x08
+
+static const uint32_t default_shades[4] = { 0xFFFFFFFF, 0xFFAAAAAA, 0xFF555555, 0xFF000000 };
+
+static bool lcd_on(struct gb *gb) {
+    return gb->io[GB_LCDC] & 0x80;
+}
+
+// Row `y` of a BG/window tile, from the map at 0x9800 or 0x9C00.
+static const uint8_t *tile_row(struct gb *gb, uint8_t lcdc, bool high_map, unsigned col, unsigned y) {
+    uint8_t tile = gb->vram[(high_map ? 0x1C00 : 0x1800) + (y >> 3) * 32 + (col & 31)];
+    unsigned addr = lcdc & 0x10 ? tile * 16 : 0x1000 + (int8_t)tile * 16;
+    return gb->vram + addr + (y & 7) * 2;
+}
+
+static void decode_tile(uint8_t lo, uint8_t hi, uint8_t *out) {
+    for (unsigned b = 0; b < 8; b++)
+        out[b] = ((lo >> (7 - b)) & 1) | ((hi >> (7 - b)) & 1) << 1;
+}
+
+static uint8_t reverse_bits(uint8_t v) {
+    v = (v & 0xF0) >> 4 | (v & 0x0F) << 4;
+    v = (v & 0xCC) >> 2 | (v & 0x33) << 2;
+    return (v & 0xAA) >> 1 | (v & 0x55) << 1;
+}
+
+// 2bpp rows to one color index per byte, two tiles per 16-byte vector.
+static void decode_tiles(const uint8_t *lo, const uint8_t *hi, unsigned tiles, uint8_t *out) {
+    unsigned i = 0;
+#ifdef __SSE2__
+    const __m128i bits = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    const __m128i one = _mm_set1_epi8(1), two = _mm_set1_epi8(2);
+    const uint64_t splat = 0x0101010101010101ull;
+
+    for (; i + 2 <= tiles; i += 2) {
+        __m128i l = _mm_set_epi64x(splat * lo[i + 1], splat * lo[i]);
+        __m128i h = _mm_set_epi64x(splat * hi[i + 1], splat * hi[i]);
+        l = _mm_cmpeq_epi8(_mm_and_si128(l, bits), bits);
+        h = _mm_cmpeq_epi8(_mm_and_si128(h, bits), bits);
+        __m128i px = _mm_or_si128(_mm_and_si128(l, one), _mm_and_si128(h, two));
+        _mm_storeu_si128((__m128i *)(out + i * 8), px);
+    }
+#endif
+    for (; i < tiles; i++)
+        decode_tile(lo[i], hi[i], out + i * 8);
+}
+
+// `count` pixels of a BG or window row starting `fine` pixels into tile
+// `col`, as color indices.
+static void draw_tiles(struct gb *gb, uint8_t lcdc, bool high_map, unsigned col, unsigned fine,
+                       unsigned y, unsigned count, uint8_t *out) {
+    uint8_t lo[LINE_TILES + 1], hi[LINE_TILES + 1];
+    uint8_t px[(LINE_TILES + 1) * 8];
+    unsigned tiles = (fine + count + 7) / 8;
+
+    for (unsigned t = 0; t < tiles; t++) {
+        const uint8_t *row = tile_row(gb, lcdc, high_map, col + t, y);
+        lo[t] = row[0];
+        hi[t] = row[1];
+    }
+    decode_tiles(lo, hi, tiles, px);
+    memcpy(out, px + fine, count);
+}
+
+static bool window_visible(struct gb *gb, uint8_t lcdc) {
+    return (lcdc & 0x21) == 0x21 && gb->io[GB_LY] >= gb->io[GB_WY] && gb->io[GB_WX] <= 166;
+}
+
+// Sprites on this line into `obj`, first opaque pixel wins: lower X, then
+// lower OAM index, like the DMG. Returns the span [first, end) of `obj`
+// they cover, only that much of it is written.
+static unsigned draw_sprites(struct gb *gb, uint8_t lcdc, uint8_t *obj, unsigned *first) {
+    unsigned height = lcdc & 0x04 ? 16 : 8;
+    unsigned ly = gb->io[GB_LY];
+    const uint8_t *found[MAX_SPRITES];
+    unsigned count = 0;
+
+    *first = 0;
+    if (!(lcdc & 0x02))
+        return 0;
+
+    for (unsigned i = 0; i < 40 && count < MAX_SPRITES; i++) {
+        const uint8_t *s = gb->oam + i * 4;
+        unsigned row = ly + 16 - s[0];
+        if (row < height) {
+            // insertion by X keeps OAM order among equal X
+            unsigned j = count++;
+            for (; j > 0 && found[j - 1][1] > s[1]; j--)
+                found[j] = found[j - 1];
+            found[j] = s;
+        }
+    }
+    if (!count)
+        return 0;
+
+    // sorted by X, so the span runs from the first sprite to the furthest
+    unsigned start = found[0][1] < 8 ? 0 : found[0][1] - 8, end = 0;
+    for (unsigned i = 0; i < count; i++) {
+        if (found[i][1] > end)
+            end = found[i][1];
+    }
+    end = end > GB_SCREEN_WIDTH ? GB_SCREEN_WIDTH : end;
+    if (start >= end)
+        return 0;
+    memset(obj + start, 0, end - start);
+    *first = start;
+
+    // all rows decoded in one go, X flips done on the row bytes
+    uint8_t lo[MAX_SPRITES], hi[MAX_SPRITES], px[MAX_SPRITES * 8];
+    for (unsigned i = 0; i < count; i++) {
+        const uint8_t *s = found[i];
+        unsigned row = ly + 16 - s[0];
+        if (s[3] & 0x40)
+            row = height - 1 - row;
+        unsigned tile = height == 16 ? s[2] & 0xFE : s[2];
+        const uint8_t *data = gb->vram + tile * 16 + row * 2;
+        lo[i] = s[3] & 0x20 ? reverse_bits(data[0]) : data[0];
+        hi[i] = s[3] & 0x20 ? reverse_bits(data[1]) : data[1];
+    }
+    decode_tiles(lo, hi, count, px);
+
+    for (unsigned i = 0; i < count; i++) {
+        const uint8_t *s = found[i];
+        uint8_t flags = (s[3] & 0x10 ? OBJ_PALETTE1 : 0) | (s[3] & 0x80 ? OBJ_BEHIND : 0);
+        for (unsigned b = 0; b < 8; b++) {
+            unsigned x = s[1] + b - 8;
+            uint8_t color = px[i * 8 + b];
+            if (x < GB_SCREEN_WIDTH && color && !obj[x])
+                obj[x] = color | flags;
+        }
+    }
+    return end;
+}
+
+static uint32_t pixel(struct gb *gb, uint8_t bg, uint8_t obj, uint8_t bgp) {
+    const uint32_t *shades = gb->ppu.shades;
+
+    if (obj && !((obj & OBJ_BEHIND) && bg)) {
+        uint8_t obp = gb->io[obj & OBJ_PALETTE1 ? GB_OBP1 : GB_OBP0];
+        return shades[(obp >> (obj & OBJ_COLOR) * 2) & 3];
+    }
+    return shades[(bgp >> bg * 2) & 3];
+}
+
+static void render_line(struct gb *gb, uint32_t *out) {
+    struct gb_ppu *ppu = &gb->ppu;
+    uint8_t lcdc = ppu->lcdc;
+    uint8_t bg[GB_SCREEN_WIDTH], obj[GB_SCREEN_WIDTH];
+    unsigned ly = gb->io[GB_LY];
+
+    // the window takes over from WX - 7 to the end of the line
+    bool window = window_visible(gb, lcdc);
+    unsigned wx = gb->io[GB_WX];
+    unsigned split = window ? (wx < 7 ? 0 : wx - 7) : GB_SCREEN_WIDTH;
+
+    if (!(lcdc & 0x01)) {
+        memset(bg, 0, sizeof(bg));
+    } else {
+        unsigned scx = ppu->scx, y = (ly + gb->io[GB_SCY]) & 0xFF;
+        if (split)
+            draw_tiles(gb, lcdc, lcdc & 0x08, scx >> 3, scx & 7, y, split, bg);
+        if (window) {
+            draw_tiles(gb, lcdc, lcdc & 0x40, 0, wx < 7 ? 7 - wx : 0, ppu->window_line,
+                       GB_SCREEN_WIDTH - split, bg + split);
+            ppu->window_line++;
+        }
+    }
+    unsigned first, end = draw_sprites(gb, lcdc, obj, &first);
+
+    // BG colors, then sprite colors by OBJ_PALETTE1 | color
+    uint32_t colors[4], obj_colors[8];
+    uint8_t obp[2] = { gb->io[GB_OBP0], gb->io[GB_OBP1] };
+    for (unsigned i = 0; i < 4; i++) {
+        colors[i] = ppu->shades[(ppu->bgp >> i * 2) & 3];
+        obj_colors[i] = ppu->shades[(obp[0] >> i * 2) & 3];
+        obj_colors[4 + i] = ppu->shades[(obp[1] >> i * 2) & 3];
+    }
+    // two pixels per lookup
+    uint64_t pairs[16];
+    for (unsigned i = 0; i < 16; i++)
+        pairs[i] = colors[i & 3] | (uint64_t)colors[i >> 2] << 32;
+    for (unsigned x = 0; x < GB_SCREEN_WIDTH; x += 2)
+        memcpy(out + x, &pairs[bg[x] | bg[x + 1] << 2], sizeof(pairs[0]));
+
+    for (unsigned x = first; x < end; x++) {
+        uint8_t o = obj[x];
+        if (o && !((o & OBJ_BEHIND) && bg[x]))
+            out[x] = obj_colors[o & (OBJ_PALETTE1 | OBJ_COLOR)];
+    }
+}
+
+// The pixel FIFO: one pixel per dot, with the BG fetcher refilling the
+// FIFO a tile at a time. SCX is read per fetch, BGP and LCDC per pixel,
+// each as of the dot the logged stores say.
+static void render_line_fifo(struct gb *gb, uint32_t *out) {
+    struct gb_ppu *ppu = &gb->ppu;
+    uint8_t lcdc = ppu->lcdc, scx = ppu->scx, bgp = ppu->bgp;
+    uint8_t obj[GB_SCREEN_WIDTH];
+    unsigned ly = gb->io[GB_LY], wx = gb->io[GB_WX];
+    unsigned y = (ly + gb->io[GB_SCY]) & 0xFF;
+
+    uint8_t fifo[16];
+    unsigned head = 0, len = 0, col = 0, w = 0, x = 0;
+    unsigned discard = scx & 7;
+    bool window = false, window_drawn = false;
+
+    // sprites see LCDC as the line started
+    unsigned first;
+    memset(obj, 0, sizeof(obj));
+    draw_sprites(gb, lcdc, obj, &first);
+
+    for (unsigned dot = 0; x < GB_SCREEN_WIDTH; dot++) {
+        for (; w < ppu->write_count && ppu->writes[w].dot <= dot; w++) {
+            const struct gb_ppu_write *wr = &ppu->writes[w];
+            if (wr->reg == GB_SCX)
+                scx = wr->value;
+            else if (wr->reg == GB_BGP)
+                bgp = wr->value;
+            else
+                lcdc = wr->value;
+        }
+
+        if (!window && window_visible(gb, lcdc) && x + 7 >= wx) {
+            window = window_drawn = true;
+            len = col = 0;
+            discard = wx < 7 ? 7 - wx : 0;
+        }
+        if (len <= 8) {
+            const uint8_t *row = window
+                ? tile_row(gb, lcdc, lcdc & 0x40, col, ppu->window_line)
+                : tile_row(gb, lcdc, lcdc & 0x08, (scx >> 3) + col, y);
+            uint8_t px[8];
+            decode_tile(row[0], row[1], px);
+            for (unsigned b = 0; b < 8; b++)
+                fifo[(head + len + b) & 15] = px[b];
+            len += 8;
+            col++;
+        }
+        if (dot < FIFO_START)
+            continue;
+
+        uint8_t bg = fifo[head];
+        head = (head + 1) & 15;
+        len--;
+        if (discard) {
+            discard--;
+            continue;
+        }
+        if (!(lcdc & 0x01))
+            bg = 0;
+        out[x] = pixel(gb, bg, lcdc & 0x02 ? obj[x] : 0, bgp);
+        x++;
+    }
+    if (window_drawn)
+        ppu->window_line++;
+    ppu->fifo_lines++;
+}
+
+// STAT interrupts trigger on the rising edge of the OR of all enabled
+// sources, so a new source while the line is already high is lost.
+static void update_stat(struct gb *gb) {
+    struct gb_ppu *ppu = &gb->ppu;
+    uint8_t stat = gb->io[GB_STAT];
+    bool coincidence = gb->io[GB_LY] == gb->io[GB_LYC];
+
+    stat = (stat & 0xF8) | (coincidence ? 0x04 : 0) | ppu->mode;
+    gb->io[GB_STAT] = stat;
+
+    bool line = lcd_on(gb) && ((coincidence && (stat & 0x40)) ||
+        (ppu->mode == GB_MODE_HBLANK && (stat & 0x08)) ||
+        (ppu->mode == GB_MODE_VBLANK && (stat & 0x10)) ||
+        (ppu->mode == GB_MODE_OAM && (stat & 0x20)));
+    if (line && !ppu->stat_line)
+        gb->io[GB_IF] |= GB_IRQ_STAT;
+    ppu->stat_line = line;
+}
+
+static void enter_mode(struct gb *gb, uint8_t mode, uint32_t cycles) {
+    gb->ppu.mode = mode;
+    gb->ppu.next_event += cycles;
+    update_stat(gb);
+}
+
+static void start_transfer(struct gb *gb) {
+    struct gb_ppu *ppu = &gb->ppu;
+
+    ppu->mode3_start = ppu->next_event;
+    ppu->scx = gb->io[GB_SCX];
+    ppu->bgp = gb->io[GB_BGP];
+    ppu->lcdc = gb->io[GB_LCDC];
+    ppu->write_count = 0;
+    enter_mode(gb, GB_MODE_TRANSFER, GB_MODE3_CYCLES);
+}
+
+static void end_transfer(struct gb *gb) {
+    struct gb_ppu *ppu = &gb->ppu;
+    uint32_t *out = ppu->framebuffer + gb->io[GB_LY] * GB_SCREEN_WIDTH;
+
+    if (ppu->write_count)
+        render_line_fifo(gb, out);
+    else
+        render_line(gb, out);
+    enter_mode(gb, GB_MODE_HBLANK, GB_LINE_CYCLES - GB_MODE2_CYCLES - GB_MODE3_CYCLES);
+}
+
+void gb_ppu_event(struct gb *gb) {
+    struct gb_ppu *ppu = &gb->ppu;
+
+    while (gb->cycles >= ppu->next_event) {
+        switch (ppu->mode) {
+        case GB_MODE_OAM:
+            start_transfer(gb);
+            break;
+        case GB_MODE_TRANSFER:
+            end_transfer(gb);
+            break;
+        case GB_MODE_HBLANK:
+            gb->io[GB_LY]++;
+            if (gb->io[GB_LY] == 144) {
+                gb->io[GB_IF] |= GB_IRQ_VBLANK;
+                ppu->frame++;
+                gb->frame_done = true;
+                enter_mode(gb, GB_MODE_VBLANK, GB_LINE_CYCLES);
+            } else
+                enter_mode(gb, GB_MODE_OAM, GB_MODE2_CYCLES);
+            break;
+        case GB_MODE_VBLANK:
+            if (gb->io[GB_LY] == GB_LINE_COUNT - 1) {
+                gb->io[GB_LY] = 0;
+                ppu->window_line = 0;
+                enter_mode(gb, GB_MODE_OAM, GB_MODE2_CYCLES);
+            } else {
+                gb->io[GB_LY]++;
+                enter_mode(gb, GB_MODE_VBLANK, GB_LINE_CYCLES);
+            }
+            break;
+        }
+    }
+}
+
+void gb_ppu_reset(struct gb *gb) {
+    gb->ppu.next_event = gb->cycles;
+    gb->ppu.stat_line = false;
+    // as if the last VBlank line just ended: the first step is line 0, mode 2
+    gb->ppu.mode = GB_MODE_VBLANK;
+    gb->io[GB_LY] = GB_LINE_COUNT - 1;
+    gb_ppu_event(gb);
+}
+
+void gb_ppu_init(struct gb *gb) {
+    gb_ppu_set_shades(gb, default_shades);
+    gb_ppu_reset(gb);
+}
+
+void gb_ppu_io_write(struct gb *gb, uint8_t reg, uint8_t value) {
+    struct gb_ppu *ppu = &gb->ppu;
+    uint8_t old = gb->io[reg];
+
+    // the store lands at the end of the instruction, which may be past a
+    // mode change the CPU loop hasn't stepped to yet
+    if (gb->cycles >= ppu->next_event)
+        gb_ppu_event(gb);
+
+    if (ppu->mode == GB_MODE_TRANSFER && (reg == GB_SCX || reg == GB_BGP || reg == GB_LCDC) &&
+        ppu->write_count < GB_PPU_MAX_WRITES) {
+        struct gb_ppu_write *w = &ppu->writes[ppu->write_count++];
+        w->dot = gb->cycles - ppu->mode3_start;
+        w->reg = reg;
+        w->value = value;
+    }
+
+    switch (reg) {
+    case GB_STAT:
+        gb->io[reg] = 0x80 | (value & 0x78) | (old & 0x07);
+        update_stat(gb);
+        break;
+    case GB_LYC:
+        gb->io[reg] = value;
+        update_stat(gb);
+        break;
+    case GB_LCDC:
+        gb->io[reg] = value;
+        if (!((old ^ value) & 0x80))
+            break;
+        if (lcd_on(gb)) {
+            gb_ppu_reset(gb);
+        } else {
+            // off: LY holds at 0 in HBlank, nothing is scheduled and the
+            // screen goes blank
+            gb->io[GB_LY] = 0;
+            ppu->mode = GB_MODE_HBLANK;
+            ppu->next_event = NEVER;
+            update_stat(gb);
+            for (unsigned i = 0; i < GB_SCREEN_WIDTH * GB_SCREEN_HEIGHT; i++)
+                ppu->framebuffer[i] = ppu->shades[0];
+        }
+        break;
+    default:
+        gb->io[reg] = value;
+        break;
+    }
+}
+
+void gb_ppu_set_shades(struct gb *gb, const uint32_t shades[4]) {
+    memcpy(gb->ppu.shades, shades, sizeof(gb->ppu.shades));
+}
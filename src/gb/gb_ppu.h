@@ -0,0 +1,68 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// DMG LCD. The PPU is a small state machine stepped at mode changes (OAM
+// scan, transfer, HBlank, VBlank) rather than per cycle; LY, STAT and the
+// VBlank and STAT interrupts follow from it.
+//
+// Each line is drawn whole as it leaves mode 3, with SIMD tile decoding.
+// Stores to SCX, BGP or LCDC during mode 3 are logged with their dot, and
+// only a line with such stores is drawn by the slower pixel FIFO, which
+// replays them where they landed.
+
+#define GB_SCREEN_WIDTH     160
+#define GB_SCREEN_HEIGHT    144
+
+#define GB_LINE_CYCLES      456
+#define GB_LINE_COUNT       154
+#define GB_MODE2_CYCLES     80
+#define GB_MODE3_CYCLES     172
+
+#define GB_PPU_MAX_WRITES   16      // logged mode 3 stores per line
+
+enum {
+	GB_MODE_HBLANK,
+	GB_MODE_VBLANK,
+	GB_MODE_OAM,
+	GB_MODE_TRANSFER,
+};
+
+struct gb_ppu_write {
+	uint8_t dot;            // into mode 3
+	uint8_t reg;
+	uint8_t value;
+};
+
+struct gb_ppu {
+	uint64_t next_event;    // cycle of the next mode change
+	uint8_t mode;
+	bool stat_line;         // STAT interrupt line, requests on its rising edge
+	uint32_t frame;
+
+	// the current line's mode 3: registers at its start, stores during it
+	uint64_t mode3_start;
+	uint8_t scx, bgp, lcdc;
+	struct gb_ppu_write writes[GB_PPU_MAX_WRITES];
+	uint8_t write_count;
+
+	uint8_t window_line;    // window rows drawn so far this frame
+	uint32_t fifo_lines;    // drawn by the pixel FIFO, for profiling
+
+	uint32_t shades[4];     // host pixels for the four gray levels
+	uint32_t framebuffer[GB_SCREEN_WIDTH * GB_SCREEN_HEIGHT];
+};
+
+struct gb;
+
+void gb_ppu_init(struct gb *gb);
+void gb_ppu_reset(struct gb *gb);
+
+// Steps through every mode change due by gb->cycles.
+void gb_ppu_event(struct gb *gb);
+
+// Stores to LCDC, STAT, SCX, LYC and BGP go through here.
+void gb_ppu_io_write(struct gb *gb, uint8_t reg, uint8_t value);
+
+// Host pixel values for gray levels 0 (lightest) to 3.
+void gb_ppu_set_shades(struct gb *gb, const uint32_t shades[4]);
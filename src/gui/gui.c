@@ -0,0 +1,207 @@
+#include "gui.h"
+#include <string.h>
+#include <SDL3/SDL_init.h>
+#include <SDL3/SDL_events.h>
+#include <SDL3/SDL_video.h>
+#include <SDL3/SDL_log.h>
+#include <SDL3/SDL_timer.h>
+
+static bool headless_driver(const char *driver) {
+    return driver && (!strcmp(driver, "dummy") || !strcmp(driver, "offscreen"));
+}
+
+// First texture format the renderer lists that the PPU can write directly.
+// SDL would convert anything else on upload, so it is only a fallback.
+static pixel_format_t native_format(SDL_Renderer *renderer, SDL_PixelFormat *texture_format) {
+    const SDL_PixelFormat *formats = SDL_GetPointerProperty(SDL_GetRendererProperties(renderer),
+                                                            SDL_PROP_RENDERER_TEXTURE_FORMATS_POINTER, NULL);
+
+    for (; formats && *formats != SDL_PIXELFORMAT_UNKNOWN; formats++) {
+        switch (*formats) {
+            case SDL_PIXELFORMAT_XRGB8888:
+            case SDL_PIXELFORMAT_ARGB8888:
+                *texture_format = *formats;
+                return PIXEL_FORMAT_ARGB8888;
+
+            case SDL_PIXELFORMAT_XBGR8888:
+            case SDL_PIXELFORMAT_ABGR8888:
+                *texture_format = *formats;
+                return PIXEL_FORMAT_ABGR8888;
+
+            default:
+                break;
+        }
+    }
+
+    *texture_format = SDL_PIXELFORMAT_ARGB8888;
+    return PIXEL_FORMAT_ARGB8888;
+}
+
+static float display_refresh(struct gui *gui) {
+    if (gui->headless)
+        return 0;
+
+    const SDL_DisplayMode *mode = SDL_GetCurrentDisplayMode(SDL_GetDisplayForWindow(gui->window));
+    if (!mode)
+        return 0;
+    if (mode->refresh_rate_numerator && mode->refresh_rate_denominator)
+        return (float)mode->refresh_rate_numerator / mode->refresh_rate_denominator;
+    return mode->refresh_rate;
+}
+
+bool gui_init(struct gui *gui, const char *title, int scale, int width, int height, struct ppu *ppu) {
+    memset(gui, 0, sizeof(*gui));
+    gui->width = width;
+    gui->height = height;
+
+    if (!SDL_InitSubSystem(SDL_INIT_VIDEO)) {
+        SDL_Log("SDL video init failed: %s", SDL_GetError());
+        return false;
+    }
+    gui->headless = headless_driver(SDL_GetCurrentVideoDriver());
+
+    SDL_WindowFlags flags = gui->headless ? SDL_WINDOW_HIDDEN : SDL_WINDOW_RESIZABLE;
+    if (!SDL_CreateWindowAndRenderer(title, width * scale, height * scale, flags, &gui->window, &gui->renderer)) {
+        SDL_Log("window creation failed: %s", SDL_GetError());
+        SDL_QuitSubSystem(SDL_INIT_VIDEO);
+        return false;
+    }
+
+    // without vsync nothing paces presentation, gui_pace() has to
+    if (!gui->headless && SDL_SetRenderVSync(gui->renderer, 1))
+        gui->refresh_rate = display_refresh(gui);
+    SDL_SetRenderLogicalPresentation(gui->renderer, width, height, SDL_LOGICAL_PRESENTATION_INTEGER_SCALE);
+
+    pixel_format_t format = native_format(gui->renderer, &gui->texture_format);
+    gui->texture = SDL_CreateTexture(gui->renderer, gui->texture_format, SDL_TEXTUREACCESS_STREAMING, width, height);
+    if (!gui->texture) {
+        SDL_Log("texture creation failed: %s", SDL_GetError());
+        gui_shutdown(gui);
+        return false;
+    }
+    SDL_SetTextureScaleMode(gui->texture, SDL_SCALEMODE_NEAREST);
+
+    if (ppu)
+        ppu_set_color_format(ppu, format, ppu->lcd_correction);
+    return true;
+}
+
+void gui_shutdown(struct gui *gui) {
+    if (gui->texture)
+        SDL_DestroyTexture(gui->texture);
+    if (gui->renderer)
+        SDL_DestroyRenderer(gui->renderer);
+    if (gui->window)
+        SDL_DestroyWindow(gui->window);
+    SDL_QuitSubSystem(SDL_INIT_VIDEO);
+    memset(gui, 0, sizeof(*gui));
+}
+
+bool gui_poll(struct gui *gui) {
+    SDL_Event event;
+
+    while (SDL_PollEvent(&event)) {
+        switch (event.type) {
+            case SDL_EVENT_QUIT:
+                return false;
+
+            case SDL_EVENT_KEY_DOWN:
+                if (event.key.key == SDLK_ESCAPE)
+                    return false;
+                break;
+
+            case SDL_EVENT_WINDOW_DISPLAY_CHANGED:
+            case SDL_EVENT_DISPLAY_CURRENT_MODE_CHANGED:
+                if (gui->refresh_rate > 0)
+                    gui->refresh_rate = display_refresh(gui);
+                break;
+
+            default:
+                break;
+        }
+    }
+    return true;
+}
+
+uint16_t gui_keys(const struct gui *gui) {
+    static const struct { SDL_Scancode key; uint16_t mask; } keymap[] = {
+        { SDL_SCANCODE_X, GUI_KEY_A },
+        { SDL_SCANCODE_Z, GUI_KEY_B },
+        { SDL_SCANCODE_BACKSPACE, GUI_KEY_SELECT },
+        { SDL_SCANCODE_RETURN, GUI_KEY_START },
+        { SDL_SCANCODE_RIGHT, GUI_KEY_RIGHT },
+        { SDL_SCANCODE_LEFT, GUI_KEY_LEFT },
+        { SDL_SCANCODE_UP, GUI_KEY_UP },
+        { SDL_SCANCODE_DOWN, GUI_KEY_DOWN },
+        { SDL_SCANCODE_S, GUI_KEY_R },
+        { SDL_SCANCODE_A, GUI_KEY_L },
+    };
+    if (gui->headless)
+        return 0;
+
+    const bool *state = SDL_GetKeyboardState(NULL);
+    uint16_t keys = 0;
+    for (size_t i = 0; i < sizeof(keymap) / sizeof(keymap[0]); i++)
+        if (state[keymap[i].key])
+            keys |= keymap[i].mask;
+    return keys;
+}
+
+static void present(struct gui *gui) {
+    SDL_RenderClear(gui->renderer);
+    SDL_RenderTexture(gui->renderer, gui->texture, NULL, NULL);
+    SDL_RenderPresent(gui->renderer);
+    gui->presented = true;
+}
+
+bool gui_begin_frame(struct gui *gui, struct ppu *ppu) {
+    void *pixels;
+    int pitch;
+
+    // a skipped frame writes nothing, a locked texture must be fully written
+    if (!ppu_frame_drawn(ppu, ppu->frame + 1))
+        return true;
+
+    if (!SDL_LockTexture(gui->texture, NULL, &pixels, &pitch))
+        return false;
+    ppu_set_target(ppu, pixels, pitch);
+    gui->locked = true;
+    return true;
+}
+
+void gui_end_frame(struct gui *gui, struct ppu *ppu) {
+    if (!gui->locked)
+        return;
+
+    SDL_UnlockTexture(gui->texture);
+    ppu_set_target(ppu, NULL, 0);
+    gui->locked = false;
+    present(gui);
+}
+
+void gui_present(struct gui *gui, const uint32_t *pixels) {
+    SDL_UpdateTexture(gui->texture, NULL, pixels, gui->width * sizeof(uint32_t));
+    present(gui);
+}
+
+float gui_pace(struct gui *gui, double frame_rate, bool locked) {
+    bool vsynced = locked && gui->presented;
+    gui->presented = false;
+    if (gui->headless)
+        return 0;
+
+    uint64_t period = (uint64_t)(SDL_NS_PER_SECOND / frame_rate);
+    uint64_t now = SDL_GetTicksNS();
+    if (vsynced) {
+        gui->next_frame = now + period;
+        return gui->refresh_rate;
+    }
+
+    // after a stall, start over rather than run frames back to back
+    if (!gui->next_frame || now > gui->next_frame + 4 * period)
+        gui->next_frame = now;
+    else if (now < gui->next_frame)
+        SDL_DelayNS(gui->next_frame - now);
+    gui->next_frame += period;
+    return 0;
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <SDL3/SDL_render.h>
+#include "../ppu.h"
+
+// SDL3 frontend. Frames are presented from a streaming texture: while a frame
+// is being drawn the PPU writes straight into the texture's locked pixels, in
+// whatever 32-bit layout the renderer prefers, so nothing is copied between
+// the scanline output and the GPU upload.
+//
+// With SDL_VIDEO_DRIVER=dummy or offscreen the same path runs without a
+// display: the window stays hidden and presentation doesn't wait for vsync.
+
+#define GUI_DEFAULT_SCALE   3
+
+// Held keys, in KEYINPUT bit order (pressed is 1 here). The low byte matches
+// the DMG joypad's GB_BUTTON_* order.
+enum {
+	GUI_KEY_A       = 0x001,
+	GUI_KEY_B       = 0x002,
+	GUI_KEY_SELECT  = 0x004,
+	GUI_KEY_START   = 0x008,
+	GUI_KEY_RIGHT   = 0x010,
+	GUI_KEY_LEFT    = 0x020,
+	GUI_KEY_UP      = 0x040,
+	GUI_KEY_DOWN    = 0x080,
+	GUI_KEY_R       = 0x100,
+	GUI_KEY_L       = 0x200,
+};
+
+struct gui {
+	SDL_Window *window;
+	SDL_Renderer *renderer;
+	SDL_Texture *texture;
+	SDL_PixelFormat texture_format;
+	int width, height;      // of the emulated screen
+	float refresh_rate;     // of the window's display, 0 when not vsynced
+	bool headless;
+	bool locked;
+	bool presented;         // since the last gui_pace()
+	uint64_t next_frame;    // SDL_GetTicksNS() deadline, 0 before the first frame
+};
+
+// `ppu` is the GBA PPU to set up for direct output; the DMG core passes NULL
+// and presents its own framebuffer.
+bool gui_init(struct gui *gui, const char *title, int scale, int width, int height, struct ppu *ppu);
+void gui_shutdown(struct gui *gui);
+
+// Handles pending events, false once the user asked to quit.
+bool gui_poll(struct gui *gui);
+uint16_t gui_keys(const struct gui *gui);
+
+// Bracket one emulated frame. If the frame is going to be drawn, begin locks
+// the texture and points the PPU at it; end hands it back and presents.
+bool gui_begin_frame(struct gui *gui, struct ppu *ppu);
+void gui_end_frame(struct gui *gui, struct ppu *ppu);
+
+// Presents a finished frame from elsewhere, e.g. the threaded PPU. This one
+// does copy.
+void gui_present(struct gui *gui, const uint32_t *pixels);
+
+// Ends a frame at `frame_rate`. Vsync only paces the emulator when the display
+// is `locked` to that rate and the frame was presented; otherwise this sleeps
+// until the frame's deadline. Deadlines run on from each other, so a late
+// frame is made up by the next ones. Headless drivers aren't paced.
+// Returns the refresh rate the frame was paced at, 0 for the timer, as
+// audio_sync_rate() takes it.
+float gui_pace(struct gui *gui, double frame_rate, bool locked);
@@ -0,0 +1,174 @@
+#include "loader.h"
+#include "memory.h"
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define GB_HEADER_END   0x150
+#define GB_MIN_SIZE     0x8000
+#define GBA_HEADER_END  0xC0
+
+// header RAM size codes, 0x149
+static const uint32_t gb_ram_sizes[] = { 0, 0x800, 0x2000, 0x8000, 0x20000, 0x10000 };
+
+// Sum of `size` bytes. Whole images go through here for the DMG global
+// checksum, so 16 bytes at a time: SAD against zero adds each half of the
+// vector into a 64-bit lane.
+static uint64_t sum_bytes(const uint8_t *p, size_t size) {
+    uint64_t sum = 0;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for (; i + 16 <= size; i += 16)
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(p + i)), zero));
+    sum = (uint64_t)_mm_cvtsi128_si64(acc) + (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc));
+#endif
+    for (; i < size; i++)
+        sum += p[i];
+    return sum;
+}
+
+// Header strings are padded with zeros or spaces; keeps the printable part.
+static void copy_text(char *dst, const uint8_t *src, size_t size) {
+    size_t n = 0;
+    for (; n < size && src[n] >= ' ' && src[n] <= '~'; n++)
+        dst[n] = src[n];
+    while (n && dst[n - 1] == ' ')
+        n--;
+    dst[n] = '\0';
+}
+
+static bool gba_identify(const uint8_t *rom, size_t size, struct rom_info *info) {
+    // fixed value at 0xB2; the BIOS only checks the complement, but that alone
+    // matches one byte in 256 of anything
+    if (size < GBA_HEADER_END || rom[0xB2] != 0x96)
+        return false;
+
+    info->system = SYSTEM_GBA;
+    info->header_valid = (uint8_t)(-(sum_bytes(rom + 0xA0, 0xBD - 0xA0) + 0x19)) == rom[0xBD];
+    copy_text(info->gba.title, rom + 0xA0, 12);
+    copy_text(info->gba.game_code, rom + 0xAC, 4);
+    copy_text(info->gba.maker, rom + 0xB0, 2);
+
+    // the save library's version string is linked into every game that uses
+    // one, word aligned
+    static const struct { const char *id; uint8_t save; } libraries[] = {
+        { "EEPROM_V", SAVE_EEPROM },
+        { "SRAM_V", SAVE_SRAM },
+        { "SRAM_F_V", SAVE_SRAM },
+        { "FLASH_V", SAVE_FLASH64 },
+        { "FLASH512_V", SAVE_FLASH64 },
+        { "FLASH1M_V", SAVE_FLASH128 },
+    };
+    info->save = SAVE_NONE;
+    for (size_t off = GBA_HEADER_END; off + 12 <= size && info->save == SAVE_NONE; off += 4) {
+        if (rom[off] != 'E' && rom[off] != 'S' && rom[off] != 'F')
+            continue;
+        for (size_t i = 0; i < sizeof(libraries) / sizeof(libraries[0]); i++) {
+            if (!memcmp(rom + off, libraries[i].id, strlen(libraries[i].id))) {
+                info->save = libraries[i].save;
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+static void gb_decode_type(struct gb_header *gb, uint8_t ram_code) {
+    struct gb_cart_type *cart = &gb->cart;
+    bool ram = false;
+
+    gb->supported = true;
+    switch (gb->type) {
+    case 0x00:
+        cart->mapper = GB_MAPPER_NONE;
+        break;
+    case 0x08: case 0x09:
+        cart->mapper = GB_MAPPER_NONE;
+        ram = true;
+        cart->battery = gb->type == 0x09;
+        break;
+    case 0x01: case 0x02: case 0x03:
+        cart->mapper = GB_MAPPER_MBC1;
+        ram = gb->type != 0x01;
+        cart->battery = gb->type == 0x03;
+        break;
+    case 0x0F: case 0x10: case 0x11: case 0x12: case 0x13:
+        cart->mapper = GB_MAPPER_MBC3;
+        ram = gb->type == 0x10 || gb->type >= 0x12;
+        cart->rtc = gb->type <= 0x10;
+        cart->battery = gb->type != 0x11 && gb->type != 0x12;
+        break;
+    default:
+        // MBC2, MBC5, cameras and the rest
+        gb->supported = false;
+        break;
+    }
+    if (ram && ram_code < sizeof(gb_ram_sizes) / sizeof(gb_ram_sizes[0]))
+        cart->ram_size = gb_ram_sizes[ram_code];
+}
+
+static bool gb_identify(const uint8_t *rom, size_t size, struct rom_info *info) {
+    // scrolled in by the boot ROM at 0x104, which locks up on a mismatch
+    static const uint8_t logo[48] = {
+        0xCE, 0xED, 0x66, 0x66, 0xCC, 0x0D, 0x00, 0x0B, 0x03, 0x73, 0x00, 0x83,
+        0x00, 0x0C, 0x00, 0x0D, 0x00, 0x08, 0x11, 0x1F, 0x88, 0x89, 0x00, 0x0E,
+        0xDC, 0xCC, 0x6E, 0xE6, 0xDD, 0xDD, 0xD9, 0x99, 0xBB, 0xBB, 0x67, 0x63,
+        0x6E, 0x0E, 0xEC, 0xCC, 0xDD, 0xDC, 0x99, 0x9F, 0xBB, 0xB9, 0x33, 0x3E,
+    };
+    if (size < GB_HEADER_END || memcmp(rom + 0x104, logo, sizeof(logo)))
+        return false;
+
+    // and likewise on a bad header checksum: x = x - byte - 1 over 0x134-0x14C
+    if ((uint8_t)(-(sum_bytes(rom + 0x134, 0x14D - 0x134) + 0x19)) != rom[0x14D])
+        return false;
+
+    struct gb_header *gb = &info->gb;
+    info->system = SYSTEM_GB;
+    info->header_valid = true;
+    gb->cgb = rom[0x143];
+    // CGB titles are shorter, the manufacturer code and CGB flag follow
+    copy_text(gb->title, rom + 0x134, gb->cgb & 0x80 ? 15 : 16);
+    gb->type = rom[0x147];
+    gb->rom_size = rom[0x148] <= 8 ? GB_MIN_SIZE << rom[0x148] : 0;
+    gb_decode_type(gb, rom[0x149]);
+
+    // nothing checks this one; a mismatch usually means a patched image
+    uint16_t global = rom[0x14E] << 8 | rom[0x14F];
+    gb->global_valid = (uint16_t)(sum_bytes(rom, size) - rom[0x14E] - rom[0x14F]) == global;
+
+    // the core maps ROM in whole 16KB banks
+    if (size < GB_MIN_SIZE)
+        gb->supported = false;
+    // MBC3 with only a clock (0x0F) still has the clock to keep
+    info->save = gb_cart_save_size(&gb->cart) ? SAVE_BATTERY_RAM : SAVE_NONE;
+    return true;
+}
+
+bool loader_identify(const uint8_t *rom, size_t size, struct rom_info *info) {
+    memset(info, 0, sizeof(*info));
+    // the DMG test is the strict one, the GBA one would take most DMG images
+    if (gb_identify(rom, size, info) || gba_identify(rom, size, info))
+        return true;
+    info->system = SYSTEM_UNKNOWN;
+    return false;
+}
+
+size_t loader_save_size(const struct rom_info *info) {
+    switch (info->save) {
+    case SAVE_BATTERY_RAM:
+        return gb_cart_save_size(&info->gb.cart);
+    case SAVE_SRAM:
+        return SRAM_SIZE;
+    default:
+        return 0;
+    }
+}
+
+const char *loader_save_name(uint8_t save) {
+    static const char *names[] = { "none", "battery RAM", "SRAM", "EEPROM", "Flash 64KB", "Flash 128KB" };
+    return save < sizeof(names) / sizeof(names[0]) ? names[save] : "?";
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "gb/gb_cart.h"
+
+// ROM identification. The cartridge header decides everything up front:
+// which core runs the image, the DMG mapper, and the save hardware. Nothing
+// is probed once the game is running.
+
+enum {
+	SYSTEM_UNKNOWN,
+	SYSTEM_GB,
+	SYSTEM_GBA,
+};
+
+enum {
+	SAVE_NONE,
+	SAVE_BATTERY_RAM,       // DMG cartridge RAM or clock with a battery
+	SAVE_SRAM,              // GBA 32KB SRAM
+	SAVE_EEPROM,
+	SAVE_FLASH64,
+	SAVE_FLASH128,
+};
+
+struct gb_header {
+	char title[17];
+	uint8_t cgb;            // 0x143: 0x80 also runs on DMG, 0xC0 CGB only
+	uint8_t type;           // 0x147, cartridge hardware
+	uint32_t rom_size;      // from 0x148
+	bool supported;         // the mapper is one the DMG core has
+	bool global_valid;      // 0x14E, sum of every other byte of the image
+	struct gb_cart_type cart;
+};
+
+struct gba_header {
+	char title[13];
+	char game_code[5];
+	char maker[3];
+};
+
+struct rom_info {
+	uint8_t system;
+	uint8_t save;
+	bool header_valid;      // DMG header checksum or GBA complement
+	struct gb_header gb;
+	struct gba_header gba;
+};
+
+// Fills `info` from the image; false if it's neither a DMG nor a GBA ROM.
+bool loader_identify(const uint8_t *rom, size_t size, struct rom_info *info);
+
+// Bytes of battery backed memory the save type needs, 0 if none is emulated.
+size_t loader_save_size(const struct rom_info *info);
+const char *loader_save_name(uint8_t save);
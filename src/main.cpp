@@ -1,9 +1,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+extern "C" {
 #include "cpu.h"
-
+#include "exec.h"
+#include "memory.h"
+#include "predecode.h"
+#include "ppu.h"
+#include "ppu_thread.h"
+#include "apu.h"
+#include "audio.h"
+#include "capture.h"
+#include "loader.h"
+#include "mapped_file.h"
+#include "gb/gb.h"
 #include "gui/gui.h"
+}
 
 void hex_dump(const void* data, size_t size) {
 	char ascii[17];
@@ -34,19 +47,320 @@ void hex_dump(const void* data, size_t size) {
 	}
 }
 
-int main () {
+// The CPU doesn't count cycles yet: every instruction is charged a flat
+// CYCLES_PER_INSN.
+#define CYCLES_PER_INSN     4
+
+// Runs the machine up to the next VBlank. The CPU runs in slices that end at
+// the next PPU or APU deadline, so IRQ flags and FIFO requests land close to
+// where they're due. False once the CPU has stopped on something it can't
+// run.
+static bool run_frame(void) {
+    uint32_t frame = ppu.frame;
+    while (ppu.frame == frame) {
+        if (cpu.stop_reason)
+            return false;
+
+        uint32_t slice = ppu_cycles_to_event(&ppu);
+        uint32_t audio_slice = apu_cycles_to_event(&apu);
+        if (audio_slice < slice)
+            slice = audio_slice;
+
+        uint64_t insns = exec_run((slice + CYCLES_PER_INSN - 1) / CYCLES_PER_INSN);
+        uint32_t cycles = insns * CYCLES_PER_INSN;
+        ppu_tick(&ppu, cycles);
+        apu_tick(&apu, cycles);
+    }
+    return true;
+}
+
+// Battery backed memory lives next to the ROM: game.gb keeps game.sav.
+static void save_path(char *path, size_t size, const char *rom_path) {
+    snprintf(path, size, "%s", rom_path);
+    char *dot = strrchr(path, '.');
+    char *slash = strrchr(path, '/');
+    if (dot && (!slash || dot > slash))
+        *dot = '\0';
+    strncat(path, ".sav", size - strlen(path) - 1);
+}
+
+// A save of the wrong size belongs to something else and is left alone.
+static void load_save(const char *path, uint8_t *data, size_t size) {
+    size_t file_size;
+    void *file = map_file_private(path, &file_size);
+    if (!file)
+        return;
+    if (file_size == size)
+        memcpy(data, file, size);
+    else
+        fprintf(stderr, "%s: expected %zu bytes, ignored\n", path, size);
+    unmap_file(file, file_size);
+}
+
+static void print_info(const struct rom_info *info, size_t rom_size) {
+    if (info->system == SYSTEM_GBA)
+        printf("GBA: %s [%s]", info->gba.title, info->gba.game_code);
+    else
+        printf("DMG: %s, cartridge type %02X", info->gb.title, info->gb.type);
+    printf(", save: %s\n", loader_save_name(info->save));
+
+    if (!info->header_valid)
+        fprintf(stderr, "warning: header complement mismatch\n");
+    if (info->system == SYSTEM_GB && !info->gb.global_valid)
+        fprintf(stderr, "warning: global checksum mismatch\n");
+    // banks past the end of a short image wrap around, like unconnected
+    // address lines would
+    if (info->system == SYSTEM_GB && info->gb.rom_size != rom_size)
+        fprintf(stderr, "warning: header says %u KB of ROM, the image has %zu KB\n",
+            info->gb.rom_size / 1024, rom_size / 1024);
+}
+
+static void run_gba(struct gui *gui, long frame_limit) {
+    const uint32_t *shown = NULL;
+
+    for (long n = 0; n != frame_limit && gui_poll(gui); n++) {
+        bool running;
+        if (ppu_thread_active()) {
+            // the renderer trails by up to a frame: show the newest one it
+            // finished, or the last one again
+            running = run_frame();
+            const uint32_t *pixels = ppu_thread_acquire_frame(NULL);
+            if (pixels)
+                shown = pixels;
+            if (shown)
+                gui_present(gui, shown);
+        } else {
+            if (!gui_begin_frame(gui, &ppu))
+                break;
+            running = run_frame();
+            gui_end_frame(gui, &ppu);
+        }
+        if (!running)
+            break;
+
+        // video runs at the display's pace when it's locked to the frame
+        // rate, at a timer's otherwise; audio follows within 0.5%. Captures
+        // stay at the nominal rate so runs compare sample for sample.
+        bool locked = audio_refresh_locked(APU_FRAME_RATE, gui->refresh_rate);
+        float paced = gui_pace(gui, APU_FRAME_RATE, locked);
+        if (!capture.active)
+            apu_set_output_rate(&apu, audio_sync_rate(&audio, APU_FRAME_RATE, paced));
+    }
+}
+
+static void run_gb(struct gui *gui, struct gb *gb, long frame_limit) {
+    // the default shades are grays, the same in either texture layout
+    for (long n = 0; n != frame_limit && gui_poll(gui); n++) {
+        gb_set_buttons(gb, gui_keys(gui) & 0xFF);
+        gb_run_frame(gb);
+        gui_present(gui, gb->ppu.framebuffer);
+
+        bool locked = audio_refresh_locked(GB_FRAME_RATE, gui->refresh_rate);
+        float paced = gui_pace(gui, GB_FRAME_RATE, locked);
+        if (!capture.active)
+            gb_set_output_rate(gb, audio_sync_rate(&audio, GB_FRAME_RATE, paced));
+    }
+}
+
+// No window at all, SDL video is never initialized. Nothing looks at the
+// pixels, so unless a frameskip asks for some the GBA PPU only keeps timing.
+static void run_headless(struct gb *gb, bool gba, long frame_limit) {
+    for (long n = 0; n != frame_limit; n++) {
+        if (gba) {
+            if (!run_frame())
+                break;
+        } else {
+            gb_run_frame(gb);
+        }
+    }
+}
+
+int main (int argc, char **argv) {
 	
-    FILE *f = fopen("./ROMS/pokemon_red.gb", "r");
-    fseek(f, 0, SEEK_END);
-    long fsize = ftell(f);
-    rewind(f);  /* same as rewind(f); */
+    // gbmu [--capture file.wav|file.raw] [--stems] [--stats] [--ppu-thread]
+    // [--frameskip N] [--no-video] [--cache-dir DIR] [--predecode-worker]
+    // [rom] [frames], a frame count ends the run, for headless use.
+    // --frameskip draws one frame in N + 1.
+    const char *capture_path = NULL;
+    const char *cache_dir = NULL;
+    bool stems = false;
+    bool stats = false;
+    bool ppu_thread = false;
+    bool no_video = false;
+    bool predecode_worker = false;
+    long frameskip = -1;
+    int arg = 1;
+    for (; arg < argc && !strncmp(argv[arg], "--", 2); arg++) {
+        if (!strcmp(argv[arg], "--capture") && arg + 1 < argc)
+            capture_path = argv[++arg];
+        else if (!strcmp(argv[arg], "--stems"))
+            stems = true;
+        else if (!strcmp(argv[arg], "--stats"))
+            stats = true;
+        else if (!strcmp(argv[arg], "--ppu-thread"))
+            ppu_thread = true;
+        else if (!strcmp(argv[arg], "--frameskip") && arg + 1 < argc)
+            frameskip = strtol(argv[++arg], NULL, 10);
+        else if (!strcmp(argv[arg], "--no-video"))
+            no_video = true;
+        else if (!strcmp(argv[arg], "--cache-dir") && arg + 1 < argc)
+            cache_dir = argv[++arg];
+        else if (!strcmp(argv[arg], "--predecode-worker"))
+            predecode_worker = true;
+    }
+    const char *rom_path = arg < argc ? argv[arg] : "./ROMS/pokemon_red.gb";
+    long frame_limit = arg + 1 < argc ? strtol(argv[arg + 1], NULL, 10) : -1;
+
+    size_t rom_size;
+    uint8_t *rom = (uint8_t *)map_file_private(rom_path, &rom_size);
+    if (!rom) {
+        fprintf(stderr, "%s: can't open\n", rom_path);
+        return 1;
+    }
+
+    //hex_dump(rom, rom_size);
+
+    // the header picks the core, mapper and save hardware once, here
+    struct rom_info info;
+    if (!loader_identify(rom, rom_size, &info)) {
+        fprintf(stderr, "%s: not a GB or GBA ROM\n", rom_path);
+        unmap_file(rom, rom_size);
+        return 1;
+    }
+    print_info(&info, rom_size);
+
+    bool gba = info.system == SYSTEM_GBA;
+    if (!gba && (info.gb.cgb == 0xC0 || !info.gb.supported)) {
+        fprintf(stderr, "%s: %s cartridges aren't supported\n", rom_path,
+            info.gb.cgb == 0xC0 ? "CGB only" : "this kind of");
+        unmap_file(rom, rom_size);
+        return 1;
+    }
+    if (gba && rom_size > ROM_MAX_SIZE) {
+        fprintf(stderr, "%s: too large for a GBA ROM\n", rom_path);
+        unmap_file(rom, rom_size);
+        return 1;
+    }
 
-	char* rom_buffer = static_cast<char*>(malloc(fsize));
-    fread(rom_buffer, fsize, 1, f);
-    fclose(f);
+    char sav_path[4096];
+    save_path(sav_path, sizeof(sav_path), rom_path);
+    size_t save_size = loader_save_size(&info);
+    if (info.save != SAVE_NONE && !save_size)
+        fprintf(stderr, "warning: %s saves aren't emulated, progress won't be kept\n", loader_save_name(info.save));
 
+    static struct gb gb;
+    uint8_t *save = NULL;
+    if (gba) {
+        mem_init();
+        mem_map_rom(rom, rom_size);
+        if (save_size) {
+            // erased SRAM reads back 0xFF
+            save = static_cast<uint8_t*>(malloc(save_size));
+            memset(save, 0xFF, save_size);
+            mem_map_sram(save);
+        }
+        ppu_init(&ppu, mem.vram, mem.oam, mem.palram, mem.io);
+        apu_init(&apu, mem.io);
+        exec_init();
+        cpu_reset(ROM_BASE);
 
-    //hex_dump(rom_buffer, fsize);
+        // ROM is immutable: fetches from it go through a predecoded mirror,
+        // which --predecode-worker fills in ahead of time for the regions we
+        // execute from. With a cache directory the mirror is kept on disk
+        // between runs so short batch jobs start warm.
+        if (cache_dir && !predecode_set_cache_dir(cache_dir))
+            fprintf(stderr, "%s: can't keep the predecode cache there\n", cache_dir);
+        cpu.rom_predecode = predecode_acquire(rom, rom_size);
+        if (predecode_worker && !predecode_start_worker(cpu.rom_predecode))
+            fprintf(stderr, "can't start the predecode worker, decoding on demand\n");
+        if (save_size)
+            load_save(sav_path, save, save_size);
+    } else {
+        // the cartridge resumes its RAM and clock as it powers on; saves
+        // without the clock footer still carry the RAM
+        size_t file_size = 0;
+        void *file = save_size ? map_file_private(sav_path, &file_size) : NULL;
+        bool fits = file_size == save_size ||
+                    (info.gb.cart.rtc && (file_size == info.gb.cart.ram_size || file_size == save_size - 4));
+        if (file && !fits) {
+            fprintf(stderr, "%s: expected %zu bytes, ignored\n", sav_path, save_size);
+            unmap_file(file, file_size);
+            file = NULL;
+        }
+        gb_init(&gb, rom, rom_size, &info.gb.cart, static_cast<const uint8_t*>(file), file_size);
+        if (file)
+            unmap_file(file, file_size);
+        if (save_size)
+            save = static_cast<uint8_t*>(malloc(save_size));
+    }
 
-    free(rom_buffer);
-}
\ No newline at end of file
+    struct gui gui;
+    bool shown = false;
+    if (!no_video) {
+        shown = gba ? gui_init(&gui, "gbmu", GUI_DEFAULT_SCALE, SCREEN_WIDTH, SCREEN_HEIGHT, &ppu)
+                    : gui_init(&gui, "gbmu", GUI_DEFAULT_SCALE, GB_SCREEN_WIDTH, GB_SCREEN_HEIGHT, NULL);
+        if (!shown && frame_limit >= 0)
+            fprintf(stderr, "no video, running headless\n");
+    }
+
+    if (gba && frameskip >= 0)
+        ppu_set_frameskip(&ppu, frameskip + 1);
+    else if (gba && !shown)
+        ppu_set_frameskip(&ppu, 0);
+
+    // without a window only a frame count ends the run
+    if (shown || frame_limit >= 0) {
+        if (capture_path && capture_open(&capture, capture_path, stems && gba, AUDIO_RATE)) {
+            if (stems && gba)
+                psg_enable_stems(&apu.psg);
+        }
+
+        // batch runs on a dummy video driver have nobody listening either
+        bool listening = shown && !gui.headless && audio_open(&audio);
+        if (!listening && !capture.active) {
+            if (gba)
+                apu_set_silent(&apu, true);
+            else
+                gb_set_silent(&gb, true);
+        }
+
+        // the render thread takes the color format gui_init picked
+        if (gba && shown && ppu_thread && !ppu_thread_start())
+            fprintf(stderr, "can't start the PPU thread, rendering inline\n");
+
+        if (!shown)
+            run_headless(&gb, gba, frame_limit);
+        else if (gba)
+            run_gba(&gui, frame_limit);
+        else
+            run_gb(&gui, &gb, frame_limit);
+
+        ppu_thread_stop();
+        capture_close(&capture);
+        audio_close(&audio);
+        if (shown)
+            gui_shutdown(&gui);
+    }
+
+    if (!gba && save_size)
+        gb_cart_save(&gb, save);
+    if (save_size && !write_file_atomic(sav_path, save, save_size))
+        fprintf(stderr, "%s: can't write save\n", sav_path);
+
+    if (gba) {
+        if (cpu.stop_reason)
+            fprintf(stderr, "%s: stopped at %08X: %s\n", rom_path, cpu.stop_pc, cpu.stop_reason);
+        if (stats)
+            exec_dump_stats(stderr, 16);
+        exec_shutdown();
+        apu_free(&apu);
+        predecode_release(cpu.rom_predecode);
+        cpu.rom_predecode = NULL;
+        mem_map_sram(NULL);
+    } else {
+        gb_free(&gb);
+    }
+    free(save);
+    unmap_file(rom, rom_size);
+    return gba && cpu.stop_reason ? 1 : 0;
+}
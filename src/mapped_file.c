@@ -0,0 +1,101 @@
+#include "mapped_file.h"
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef _WIN32
+
+void *map_file_private(const char *path, size_t *size) {
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    LARGE_INTEGER file_size;
+    void *addr = NULL;
+
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart) {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+        if (mapping) {
+            addr = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+    }
+
+    CloseHandle(file);
+    if (addr)
+        *size = (size_t)file_size.QuadPart;
+    return addr;
+}
+
+void unmap_file(void *addr, size_t size) {
+    (void)size;
+    UnmapViewOfFile(addr);
+}
+
+#else
+
+void *map_file_private(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    void *addr = NULL;
+
+    if (fstat(fd, &st) == 0 && st.st_size) {
+        addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED)
+            addr = NULL;
+    }
+
+    close(fd);
+    if (addr)
+        *size = st.st_size;
+    return addr;
+}
+
+void unmap_file(void *addr, size_t size) {
+    munmap(addr, size);
+}
+
+#endif
+
+bool write_file_atomic(const char *path, const void *data, size_t size) {
+    // one temporary per process: parallel runs of the same ROM each write
+    // their own and the last rename wins
+    char tmp_path[4200];
+#ifdef _WIN32
+    unsigned long pid = GetCurrentProcessId();
+#else
+    unsigned long pid = getpid();
+#endif
+    int len = snprintf(tmp_path, sizeof(tmp_path), "%s.%lu.tmp", path, pid);
+    if (len < 0 || (size_t)len >= sizeof(tmp_path))
+        return false;
+
+    FILE *f = fopen(tmp_path, "wb");
+    if (!f)
+        return false;
+
+    bool ok = fwrite(data, 1, size, f) == size;
+    ok = fclose(f) == 0 && ok;
+
+#ifdef _WIN32
+    // rename() won't replace an existing file on Windows
+    ok = ok && MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING);
+#else
+    ok = ok && rename(tmp_path, path) == 0;
+#endif
+
+    if (!ok)
+        remove(tmp_path);
+    return ok;
+}
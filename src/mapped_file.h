@@ -0,0 +1,13 @@
+#pragma once
+#include <stddef.h>
+#include <stdbool.h>
+
+// Copy-on-write file mappings. Pages stay shared with the page cache (and
+// every other process mapping the same file) until they are written to.
+void *map_file_private(const char *path, size_t *size);
+void unmap_file(void *addr, size_t size);
+
+// Writes `size` bytes to `path` through a temporary file so readers never
+// observe a partially written file. Fails on paths too long to add the
+// temporary's suffix to.
+bool write_file_atomic(const char *path, const void *data, size_t size);
@@ -0,0 +1,271 @@
+#include "memory.h"
+#include "exec.h"
+#include "ppu_thread.h"
+#include "apu.h"
+#include <string.h>
+#include <assert.h>
+
+_Static_assert(MEM_PAGE_SIZE >> CODE_CHUNK_SHIFT == 64, "one code word per page");
+
+struct memory mem = {0};
+
+static uint32_t vram_offset(uint32_t addr) {
+    // 96KB of VRAM mirrored in 128KB steps, upper 32KB mirrors the OBJ area
+    addr &= 0x1FFFF;
+    if (addr >= VRAM_SIZE)
+        addr -= 0x8000;
+    return addr;
+}
+
+static void map_mirrored(uint32_t base, uint32_t span, uint8_t *backing, uint32_t size, uint64_t *code) {
+    assert(size % MEM_PAGE_SIZE == 0);
+
+    // only RAM that can hold code is writable through the fast path
+    for (uint32_t off = 0; off < span; off += MEM_PAGE_SIZE) {
+        uint32_t page = ((base + off) >> MEM_PAGE_SHIFT) & (MEM_PAGE_COUNT - 1);
+        mem.read_pages[page] = backing + (off % size);
+        mem.write_pages[page] = code ? backing + (off % size) : NULL;
+        mem.code_pages[page] = code ? &code[(off % size) >> MEM_PAGE_SHIFT] : NULL;
+    }
+}
+
+void mem_init(void) {
+    memset(mem.read_pages, 0, sizeof(mem.read_pages));
+    memset(mem.write_pages, 0, sizeof(mem.write_pages));
+    memset(mem.code_pages, 0, sizeof(mem.code_pages));
+    memset(mem.code_bitmap, 0, sizeof(mem.code_bitmap));
+
+    map_mirrored(0x00000000, BIOS_SIZE, mem.bios, BIOS_SIZE, NULL);
+    map_mirrored(0x02000000, 0x01000000, mem.ewram, EWRAM_SIZE, mem.code_bitmap);
+    map_mirrored(0x03000000, 0x01000000, mem.iwram, IWRAM_SIZE, mem.code_bitmap + (EWRAM_SIZE >> MEM_PAGE_SHIFT));
+
+    // VRAM, palette and OAM stores stay on the slow path for the 8-bit
+    // write quirks; only VRAM loads get the fast path.
+    for (uint32_t off = 0; off < 0x01000000; off += MEM_PAGE_SIZE) {
+        uint32_t page = (0x06000000 + off) >> MEM_PAGE_SHIFT;
+        mem.read_pages[page] = &mem.vram[vram_offset(off)];
+    }
+
+    if (mem.rom)
+        mem_map_rom(mem.rom, mem.rom_size);
+}
+
+void mem_map_rom(const uint8_t *rom, size_t size) {
+    assert(size <= ROM_MAX_SIZE);
+
+    mem.rom = rom;
+    mem.rom_size = size;
+
+    // three wait state mirrors; a partial last page is left to the slow path
+    for (uint32_t ws = 0; ws < 3; ws++) {
+        for (uint32_t off = 0; off < ROM_MAX_SIZE; off += MEM_PAGE_SIZE) {
+            uint32_t page = (ROM_BASE + ws * ROM_MAX_SIZE + off) >> MEM_PAGE_SHIFT;
+            mem.read_pages[page] = off + MEM_PAGE_SIZE <= size ? (uint8_t *)rom + off : NULL;
+        }
+    }
+}
+
+void mem_map_sram(uint8_t *sram) {
+    mem.sram = sram;
+}
+
+int mem_code_chunk(uint32_t addr) {
+    switch ((addr >> 24) & 0xF) {
+        case REGION_EWRAM:
+            return (addr & (EWRAM_SIZE - 1)) >> CODE_CHUNK_SHIFT;
+
+        case REGION_IWRAM:
+            return (EWRAM_SIZE + (addr & (IWRAM_SIZE - 1))) >> CODE_CHUNK_SHIFT;
+
+        default:
+            return -1;
+    }
+}
+
+void mem_mark_code(uint32_t addr) {
+    int chunk = mem_code_chunk(addr);
+    if (chunk >= 0)
+        mem.code_bitmap[chunk / 64] |= 1ULL << (chunk % 64);
+}
+
+void mem_clear_code(uint32_t addr) {
+    int chunk = mem_code_chunk(addr);
+    if (chunk >= 0)
+        mem.code_bitmap[chunk / 64] &= ~(1ULL << (chunk % 64));
+}
+
+void mem_code_written(uint32_t addr) {
+    exec_invalidate_code(addr);
+}
+
+// offset into the backing array for stores the PPU has to hear about
+static uint32_t video_offset(uint8_t region, uint32_t addr) {
+    switch (region) {
+        case REGION_PALRAM: return addr & (PALRAM_SIZE - 1);
+        case REGION_VRAM:   return vram_offset(addr);
+        default:            return addr & (OAM_SIZE - 1);
+    }
+}
+
+static bool is_video(uint8_t region) {
+    return region >= REGION_PALRAM && region <= REGION_OAM;
+}
+
+static uint8_t *region_ptr(uint32_t addr) {
+    switch ((addr >> 24) & 0xF) {
+        case REGION_BIOS:
+            return addr < BIOS_SIZE ? &mem.bios[addr] : NULL;
+
+        case REGION_EWRAM:
+            return &mem.ewram[addr & (EWRAM_SIZE - 1)];
+
+        case REGION_IWRAM:
+            return &mem.iwram[addr & (IWRAM_SIZE - 1)];
+
+        case REGION_IO:
+            addr &= 0xFFFFFF;
+            return addr < IO_SIZE ? &mem.io[addr] : NULL;
+
+        case REGION_PALRAM:
+            return &mem.palram[addr & (PALRAM_SIZE - 1)];
+
+        case REGION_VRAM:
+            return &mem.vram[vram_offset(addr)];
+
+        case REGION_OAM:
+            return &mem.oam[addr & (OAM_SIZE - 1)];
+
+        case REGION_ROM_WS0 ... REGION_ROM_WS2: {
+            uint32_t offset = addr & (ROM_MAX_SIZE - 1);
+            return offset < mem.rom_size ? (uint8_t *)&mem.rom[offset] : NULL;
+        }
+
+        case REGION_SRAM:
+        case REGION_SRAM + 1:
+            return mem.sram ? &mem.sram[addr & (SRAM_SIZE - 1)] : NULL;
+
+        default:
+            return NULL;
+    }
+}
+
+static bool is_read_only(uint32_t addr) {
+    uint8_t region = (addr >> 24) & 0xF;
+    return region == REGION_BIOS || (region >= REGION_ROM_WS0 && region <= REGION_ROM_WS2);
+}
+
+static uint32_t open_bus(uint32_t addr) {
+    // out of range cartridge reads return the address bus
+    uint8_t region = (addr >> 24) & 0xF;
+    if (region >= REGION_ROM_WS0 && region <= REGION_ROM_WS2)
+        return (((addr + 2) >> 1) & 0xFFFF) << 16 | ((addr >> 1) & 0xFFFF);
+    return 0;
+}
+
+static bool is_sram(uint32_t addr) {
+    return ((addr >> 24) & 0xE) == REGION_SRAM;
+}
+
+uint32_t mem_read32_slow(uint32_t addr) {
+    if (is_sram(addr))
+        return mem_read8_slow(addr) * 0x01010101u;
+    addr &= ~3;
+    uint8_t *p = region_ptr(addr);
+    return p ? *(uint32_t *)p : open_bus(addr);
+}
+
+uint16_t mem_read16_slow(uint32_t addr) {
+    if (is_sram(addr))
+        return mem_read8_slow(addr) * 0x0101;
+    addr &= ~1;
+    uint8_t *p = region_ptr(addr);
+    return p ? *(uint16_t *)p : (uint16_t)open_bus(addr);
+}
+
+uint8_t mem_read8_slow(uint32_t addr) {
+    uint8_t *p = region_ptr(addr);
+    return p ? *p : (uint8_t)(open_bus(addr) >> ((addr & 1) * 8));
+}
+
+void mem_write32_slow(uint32_t addr, uint32_t value) {
+    if (is_sram(addr)) {
+        mem_write8_slow(addr, value >> (addr & 3) * 8);
+        return;
+    }
+    addr &= ~3;
+    if (is_read_only(addr))
+        return;
+
+    uint8_t *p = region_ptr(addr);
+    if (!p)
+        return;
+
+    *(uint32_t *)p = value;
+    uint8_t region = (addr >> 24) & 0xF;
+    if (is_video(region))
+        ppu_bus_written(region, video_offset(region, addr), 4);
+    else if (region == REGION_IO) {
+        ppu_io_written(&ppu, addr & 0xFFFFFF);
+        apu_io_written(&apu, addr & 0xFFFFFF, 4);
+    }
+}
+
+void mem_write16_slow(uint32_t addr, uint16_t value) {
+    if (is_sram(addr)) {
+        mem_write8_slow(addr, value >> (addr & 1) * 8);
+        return;
+    }
+    addr &= ~1;
+    if (is_read_only(addr))
+        return;
+
+    uint8_t *p = region_ptr(addr);
+    if (!p)
+        return;
+
+    *(uint16_t *)p = value;
+    uint8_t region = (addr >> 24) & 0xF;
+    if (is_video(region))
+        ppu_bus_written(region, video_offset(region, addr), 2);
+    else if (region == REGION_IO) {
+        ppu_io_written(&ppu, addr & 0xFFFFFF);
+        apu_io_written(&apu, addr & 0xFFFFFF, 2);
+    }
+}
+
+void mem_write8_slow(uint32_t addr, uint8_t value) {
+    if (is_read_only(addr))
+        return;
+
+    uint8_t region = (addr >> 24) & 0xF;
+    uint8_t *p = region_ptr(addr & ~1);
+    if (!p)
+        return;
+
+    switch (region) {
+        case REGION_OAM:
+            // byte stores to OAM are ignored
+            return;
+
+        case REGION_VRAM:
+            // byte stores to OBJ tiles are ignored, BG stores fill the halfword
+            if (vram_offset(addr) >= 0x10000)
+                return;
+            *(uint16_t *)p = value * 0x0101;
+            ppu_bus_written(region, video_offset(region, addr & ~1), 2);
+            return;
+
+        case REGION_PALRAM:
+            *(uint16_t *)p = value * 0x0101;
+            ppu_bus_written(region, video_offset(region, addr & ~1), 2);
+            return;
+
+        default:
+            p[addr & 1] = value;
+            if (region == REGION_IO) {
+                ppu_io_written(&ppu, addr & 0xFFFFFF);
+                apu_io_written(&apu, addr & 0xFFFFFF, 1);
+            }
+            return;
+    }
+}
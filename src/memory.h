@@ -0,0 +1,148 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// GBA memory map. The bus is split into 16KB pages; pages backed by plain
+// memory get a host pointer in the page tables so loads and stores skip the
+// region decode. Everything else (IO, palette, OAM, ROM tails) takes the
+// slow path.
+enum {
+	BIOS_SIZE       = 0x4000,
+	EWRAM_SIZE      = 0x40000,
+	IWRAM_SIZE      = 0x8000,
+	IO_SIZE         = 0x400,
+	PALRAM_SIZE     = 0x400,
+	VRAM_SIZE       = 0x18000,
+	OAM_SIZE        = 0x400,
+	ROM_MAX_SIZE    = 0x2000000,
+	SRAM_SIZE       = 0x8000,
+};
+
+enum {
+	REGION_BIOS     = 0x0,
+	REGION_EWRAM    = 0x2,
+	REGION_IWRAM    = 0x3,
+	REGION_IO       = 0x4,
+	REGION_PALRAM   = 0x5,
+	REGION_VRAM     = 0x6,
+	REGION_OAM      = 0x7,
+	REGION_ROM_WS0  = 0x8,
+	REGION_ROM_WS2  = 0xD,
+	REGION_SRAM     = 0xE,
+};
+
+#define MEM_PAGE_SHIFT  14
+#define MEM_PAGE_SIZE   (1u << MEM_PAGE_SHIFT)
+#define MEM_PAGE_COUNT  (1u << (28 - MEM_PAGE_SHIFT))
+
+#define ROM_BASE        0x08000000u
+
+// Self-modifying code detection: one bit per 256-byte chunk of EWRAM/IWRAM
+// that holds translated code, grouped into one 64-bit word per page so the
+// store fast path only needs a single extra load to find it.
+#define CODE_CHUNK_SHIFT    8
+#define CODE_CHUNK_COUNT    ((EWRAM_SIZE + IWRAM_SIZE) >> CODE_CHUNK_SHIFT)
+
+struct memory {
+	uint8_t bios[BIOS_SIZE];
+	uint8_t ewram[EWRAM_SIZE];
+	uint8_t iwram[IWRAM_SIZE];
+	uint8_t io[IO_SIZE];
+	uint8_t palram[PALRAM_SIZE];
+	uint8_t vram[VRAM_SIZE];
+	uint8_t oam[OAM_SIZE];
+
+	const uint8_t *rom;
+	size_t rom_size;
+	uint8_t *sram;          // SRAM_SIZE bytes, NULL for carts without it
+
+	uint8_t *read_pages[MEM_PAGE_COUNT];
+	uint8_t *write_pages[MEM_PAGE_COUNT];
+
+	uint64_t code_bitmap[CODE_CHUNK_COUNT / 64];
+	uint64_t *code_pages[MEM_PAGE_COUNT];
+};
+
+extern struct memory mem;
+
+void mem_init(void);
+void mem_map_rom(const uint8_t *rom, size_t size);
+
+// Cartridge SRAM sits on an 8-bit bus: it's only reached through the slow
+// path, wider loads see the byte repeated and wider stores keep one lane.
+void mem_map_sram(uint8_t *sram);
+
+uint32_t mem_read32_slow(uint32_t addr);
+uint16_t mem_read16_slow(uint32_t addr);
+uint8_t mem_read8_slow(uint32_t addr);
+void mem_write32_slow(uint32_t addr, uint32_t value);
+void mem_write16_slow(uint32_t addr, uint16_t value);
+void mem_write8_slow(uint32_t addr, uint8_t value);
+
+// Index of the code chunk holding `addr`, -1 outside EWRAM/IWRAM.
+int mem_code_chunk(uint32_t addr);
+void mem_mark_code(uint32_t addr);
+void mem_clear_code(uint32_t addr);
+void mem_code_written(uint32_t addr);
+
+static inline uint8_t *mem_page(uint8_t **pages, uint32_t addr) {
+	return pages[(addr >> MEM_PAGE_SHIFT) & (MEM_PAGE_COUNT - 1)];
+}
+
+static inline void mem_check_code(uint32_t addr) {
+	uint64_t *code = mem.code_pages[(addr >> MEM_PAGE_SHIFT) & (MEM_PAGE_COUNT - 1)];
+	if (code && (*code >> ((addr >> CODE_CHUNK_SHIFT) & 63) & 1))
+		mem_code_written(addr);
+}
+
+static inline uint32_t mem_read32(uint32_t addr) {
+	uint8_t *page = mem_page(mem.read_pages, addr);
+	if (page)
+		return *(uint32_t *)(page + (addr & (MEM_PAGE_SIZE - 4)));
+	return mem_read32_slow(addr);
+}
+
+static inline uint16_t mem_read16(uint32_t addr) {
+	uint8_t *page = mem_page(mem.read_pages, addr);
+	if (page)
+		return *(uint16_t *)(page + (addr & (MEM_PAGE_SIZE - 2)));
+	return mem_read16_slow(addr);
+}
+
+static inline uint8_t mem_read8(uint32_t addr) {
+	uint8_t *page = mem_page(mem.read_pages, addr);
+	if (page)
+		return page[addr & (MEM_PAGE_SIZE - 1)];
+	return mem_read8_slow(addr);
+}
+
+static inline void mem_write32(uint32_t addr, uint32_t value) {
+	uint8_t *page = mem_page(mem.write_pages, addr);
+	if (page) {
+		*(uint32_t *)(page + (addr & (MEM_PAGE_SIZE - 4))) = value;
+		mem_check_code(addr);
+		return;
+	}
+	mem_write32_slow(addr, value);
+}
+
+static inline void mem_write16(uint32_t addr, uint16_t value) {
+	uint8_t *page = mem_page(mem.write_pages, addr);
+	if (page) {
+		*(uint16_t *)(page + (addr & (MEM_PAGE_SIZE - 2))) = value;
+		mem_check_code(addr);
+		return;
+	}
+	mem_write16_slow(addr, value);
+}
+
+static inline void mem_write8(uint32_t addr, uint8_t value) {
+	uint8_t *page = mem_page(mem.write_pages, addr);
+	if (page) {
+		page[addr & (MEM_PAGE_SIZE - 1)] = value;
+		mem_check_code(addr);
+		return;
+	}
+	mem_write8_slow(addr, value);
+}
@@ -0,0 +1,719 @@
+#include "ppu.h"
+#include "memory.h"
+#include "ppu_thread.h"
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+struct ppu ppu = {0};
+
+// [shape][size] in pixels
+static const uint8_t obj_width[3][4]  = { { 8, 16, 32, 64 }, { 16, 32, 32, 64 }, { 8, 8, 16, 32 } };
+static const uint8_t obj_height[3][4] = { { 8, 16, 32, 64 }, { 8, 8, 16, 32 }, { 16, 32, 32, 64 } };
+
+void ppu_init(struct ppu *ppu, const uint8_t *vram, const uint8_t *oam, const uint8_t *palram, const uint8_t *io) {
+    memset(ppu, 0, sizeof(*ppu));
+    ppu->vram = vram;
+    ppu->oam = oam;
+    ppu->palram = palram;
+    ppu->io = io;
+    memset(ppu->tiles.dirty4, 0xFF, sizeof(ppu->tiles.dirty4));
+    memset(ppu->tiles.dirty8, 0xFF, sizeof(ppu->tiles.dirty8));
+    ppu->sprites.dirty = true;
+    ppu_set_target(ppu, NULL, 0);
+    ppu_set_color_format(ppu, PIXEL_FORMAT_ARGB8888, false);
+    ppu_select_composite(ppu);
+    ppu_select_affine(ppu);
+    ppu->render_every = 1;
+}
+
+void ppu_set_frameskip(struct ppu *ppu, uint32_t render_every) {
+    ppu->render_every = render_every;
+
+    // no line of the current frame has started yet, it can still be decided
+    if (ppu->vcount == 0 && ppu->cycle == 0)
+        ppu->skip_frame = !ppu_frame_drawn(ppu, ppu->frame + 1);
+}
+
+static uint32_t convert_color(uint16_t color, pixel_format_t format, bool lcd_correction) {
+    uint32_t r5 = color & 0x1F, g5 = (color >> 5) & 0x1F, b5 = (color >> 10) & 0x1F;
+    uint32_t r, g, b;
+
+    if (lcd_correction) {
+        // the LCD is darker and mixes channels, this is the usual gamma 4.0
+        // panel to 2.2 display approximation
+        double lr = pow(r5 / 31.0, 4.0), lg = pow(g5 / 31.0, 4.0), lb = pow(b5 / 31.0, 4.0);
+        r = pow((  0 * lb +  50 * lg + 255 * lr) / 255, 1 / 2.2) * (255.0 * 255 / 280);
+        g = pow(( 30 * lb + 230 * lg +  10 * lr) / 255, 1 / 2.2) * (255.0 * 255 / 280);
+        b = pow((220 * lb +  10 * lg +  50 * lr) / 255, 1 / 2.2) * (255.0 * 255 / 280);
+    } else {
+        r = r5 << 3 | r5 >> 2;
+        g = g5 << 3 | g5 >> 2;
+        b = b5 << 3 | b5 >> 2;
+    }
+
+    switch (format) {
+        case PIXEL_FORMAT_ABGR8888:
+            return 0xFF000000 | b << 16 | g << 8 | r;
+        case PIXEL_FORMAT_ARGB8888:
+        default:
+            return 0xFF000000 | r << 16 | g << 8 | b;
+    }
+}
+
+void ppu_set_color_format(struct ppu *ppu, pixel_format_t format, bool lcd_correction) {
+    ppu->format = format;
+    ppu->lcd_correction = lcd_correction;
+
+    for (uint32_t color = 0; color < 0x8000; color++)
+        ppu->color_lut[color] = convert_color(color, format, lcd_correction);
+    for (uint32_t offset = 0; offset < 0x400; offset += 2)
+        ppu_palram_written(ppu, offset);
+}
+
+void ppu_set_target(struct ppu *ppu, void *pixels, int pitch) {
+    if (!pixels) {
+        pixels = ppu->framebuffer;
+        pitch = SCREEN_WIDTH * sizeof(uint32_t);
+    }
+    ppu->pixels = pixels;
+    ppu->pitch = pitch;
+}
+
+static inline uint16_t palette(const struct ppu *ppu, unsigned index) {
+    return *(const uint16_t *)(ppu->palram + index * 2) & 0x7FFF;
+}
+
+static const uint8_t empty_row[8] = {0};
+
+static void expand_tile4(struct ppu *ppu, uint32_t granule) {
+    const uint8_t *src = ppu->vram + granule * 32;
+    uint8_t (*dst)[64] = ppu->tiles.tile4[granule];
+
+    for (unsigned i = 0; i < 64; i++) {
+        uint8_t index = (src[i / 2] >> ((i & 1) * 4)) & 0xF;
+        dst[0][i] = index;
+        dst[1][(i & ~7) | (7 - (i & 7))] = index;
+    }
+    ppu->tiles.dirty4[granule / 64] &= ~(1ULL << (granule % 64));
+}
+
+static void expand_tile8(struct ppu *ppu, uint32_t granule) {
+    const uint8_t *src = ppu->vram + granule * 32;
+    uint8_t (*dst)[64] = ppu->tiles.tile8[granule];
+
+    memcpy(dst[0], src, 64);
+    for (unsigned i = 0; i < 64; i++)
+        dst[1][(i & ~7) | (7 - (i & 7))] = src[i];
+    ppu->tiles.dirty8[granule / 64] &= ~(1ULL << (granule % 64));
+}
+
+// Row `row` of the tile at VRAM `addr` as 8 palette indices.
+static inline const uint8_t *tile4_row(struct ppu *ppu, uint32_t addr, unsigned row, bool hflip) {
+    uint32_t granule = addr / 32;
+
+    if (ppu->tiles.dirty4[granule / 64] >> (granule % 64) & 1)
+        expand_tile4(ppu, granule);
+    return &ppu->tiles.tile4[granule][hflip][row * 8];
+}
+
+static inline const uint8_t *tile8_row(struct ppu *ppu, uint32_t addr, unsigned row, bool hflip) {
+    uint32_t granule = addr / 32;
+
+    if (granule + 1 >= TILE_COUNT)
+        return empty_row;
+    if (ppu->tiles.dirty8[granule / 64] >> (granule % 64) & 1)
+        expand_tile8(ppu, granule);
+    return &ppu->tiles.tile8[granule][hflip][row * 8];
+}
+
+static void render_text_bg(struct ppu *ppu, unsigned bg, unsigned y, uint16_t *out) {
+    uint16_t cnt = ppu_io16(ppu, REG_BG0CNT + bg * 2);
+    uint16_t hofs = ppu_io16(ppu, REG_BG0HOFS + bg * 4) & 0x1FF;
+    uint16_t vofs = ppu_io16(ppu, REG_BG0VOFS + bg * 4) & 0x1FF;
+
+    unsigned width = (cnt & 0x4000) ? 512 : 256;
+    unsigned height = (cnt & 0x8000) ? 512 : 256;
+    uint32_t char_base = ((cnt >> 2) & 3) * 0x4000;
+    uint32_t screen_base = ((cnt >> 8) & 0x1F) * 0x800;
+    bool color256 = cnt & 0x80;
+
+    unsigned sy = (y + vofs) & (height - 1);
+    unsigned x = 0;
+
+    while (x < SCREEN_WIDTH) {
+        unsigned sx = (x + hofs) & (width - 1);
+        unsigned block = sx / 256 + (sy / 256) * (width / 256);
+        uint32_t entry_addr = screen_base + block * 0x800 + ((sy & 255) / 8) * 64 + ((sx & 255) / 8) * 2;
+        uint16_t entry = *(const uint16_t *)(ppu->vram + entry_addr);
+
+        unsigned tile = entry & 0x3FF;
+        bool hflip = entry & 0x400;
+        unsigned row = (entry & 0x800) ? 7 - (sy & 7) : sy & 7;
+        unsigned pal = color256 ? 0 : (entry >> 12) * 16;
+        uint32_t addr = char_base + tile * (color256 ? 64 : 32);
+        const uint8_t *indices;
+
+        // BG tiles can't reach into OBJ VRAM
+        if (addr >= 0x10000)
+            indices = empty_row;
+        else if (color256)
+            indices = tile8_row(ppu, addr, row, hflip);
+        else
+            indices = tile4_row(ppu, addr, row, hflip);
+
+        // one run per tile, starting mid-tile for the first one
+        for (unsigned px = sx & 7; px < 8 && x < SCREEN_WIDTH; px++, x++)
+            out[x] = indices[px] ? palette(ppu, pal + indices[px]) : PIXEL_TRANSPARENT;
+    }
+}
+
+static void render_affine_bg(struct ppu *ppu, unsigned bg, uint16_t *out) {
+    uint16_t cnt = ppu_io16(ppu, REG_BG0CNT + bg * 2);
+    uint32_t regs = (bg - 2) * 0x10;
+
+    struct affine_bg_row row = {
+        .vram = ppu->vram,
+        .palram = ppu->palram,
+        .map_base = ((cnt >> 8) & 0x1F) * 0x800,
+        .char_base = ((cnt >> 2) & 3) * 0x4000,
+        .size = 128 << (cnt >> 14),
+        .wrap = cnt & 0x2000,
+        .x = ppu->affine[bg - 2].x,
+        .y = ppu->affine[bg - 2].y,
+        .dx = (int16_t)ppu_io16(ppu, REG_BG2PA + regs),
+        .dy = (int16_t)ppu_io16(ppu, REG_BG2PC + regs),
+    };
+    ppu->affine_bg(&row, out);
+}
+
+// Draws one row of sprite palette indices at `sprite_x`, 0 is transparent.
+static void plot_sprite(const struct ppu *ppu, const uint8_t *indices, unsigned count, int sprite_x,
+                        unsigned pal, uint16_t attr, uint16_t *out, uint16_t *attr_out) {
+    unsigned prio = attr & 3;
+
+    for (unsigned px = 0; px < count; px++) {
+        int x = sprite_x + px;
+        if (x < 0 || x >= SCREEN_WIDTH || !indices[px])
+            continue;
+
+        // lower OAM index wins unless a later sprite has a better priority
+        if (!(out[x] & PIXEL_TRANSPARENT) && (attr_out[x] & 3) <= prio)
+            continue;
+
+        out[x] = palette(ppu, pal + indices[px]);
+        attr_out[x] = attr;
+    }
+}
+
+// OBJ window sprites only mark where their opaque pixels are.
+static void plot_obj_window(const uint8_t *indices, unsigned count, int sprite_x, uint64_t *window) {
+    for (unsigned px = 0; px < count; px++) {
+        int x = sprite_x + px;
+        if (x >= 0 && x < SCREEN_WIDTH && indices[px])
+            window[x / 64] |= 1ULL << (x % 64);
+    }
+}
+
+// Parses OAM into the sprites that can draw and, per line, the ones that
+// cover it. Only runs after OAM or DISPCNT changed.
+static void build_sprite_lists(struct ppu *ppu, uint16_t dispcnt) {
+    struct sprite_cache *cache = &ppu->sprites;
+    bool mapping_1d = dispcnt & 0x40;
+    bool obj_window = dispcnt & 0x8000;
+    // bitmap modes take the lower half of OBJ VRAM
+    unsigned min_tile = (dispcnt & 7) >= 3 ? 512 : 0;
+
+    memset(cache->count, 0, sizeof(cache->count));
+
+    for (unsigned i = 0; i < 128; i++) {
+        const uint16_t *oam = (const uint16_t *)(ppu->oam + i * 8);
+        uint16_t attr0 = oam[0], attr1 = oam[1], attr2 = oam[2];
+        struct sprite *s = &cache->sprites[i];
+
+        s->affine = attr0 & 0x100;
+        // without the affine bit, bit 9 hides the sprite
+        if (!s->affine && (attr0 & 0x200))
+            continue;
+
+        s->mode = (attr0 >> 10) & 3;
+        unsigned shape = attr0 >> 14;
+        if (s->mode == 3 || shape == 3)
+            continue;
+        if (s->mode == 2 && !obj_window)
+            continue;
+
+        s->tile = attr2 & 0x3FF;
+        if (s->tile < min_tile)
+            continue;
+
+        unsigned size = attr1 >> 14;
+        s->w = obj_width[shape][size];
+        s->h = obj_height[shape][size];
+        // double size affine sprites get twice the bounding box
+        s->box_w = s->w;
+        s->box_h = s->h;
+        if (s->affine && (attr0 & 0x200)) {
+            s->box_w *= 2;
+            s->box_h *= 2;
+        }
+
+        s->x = attr1 & 0x1FF;
+        if (s->x >= 256)
+            s->x -= 512;
+        if (s->x + s->box_w <= 0 || s->x >= SCREEN_WIDTH)
+            continue;
+        s->y = attr0 & 0xFF;
+
+        s->color256 = attr0 & 0x2000;
+        s->hflip = attr1 & 0x1000;
+        s->vflip = attr1 & 0x2000;
+        s->matrix = (attr1 >> 9) & 0x1F;
+        unsigned prio = (attr2 >> 10) & 3;
+        s->pal = s->color256 ? 256 : 256 + (attr2 >> 12) * 16;
+        s->attr = prio | (s->mode == 1 ? OBJ_SEMI : 0);
+        // tile numbers count 32-byte units, 256 color tiles take two
+        s->row_stride = mapping_1d ? (s->w / 8) * (s->color256 ? 2 : 1) : 32;
+
+        for (unsigned row = 0; row < s->box_h; row++) {
+            unsigned y = (s->y + row) & 0xFF;
+            if (y < SCREEN_HEIGHT)
+                cache->list[y][cache->count[y]++] = i;
+        }
+    }
+
+    cache->dispcnt = dispcnt;
+    cache->dirty = false;
+}
+
+static void render_sprites(struct ppu *ppu, unsigned y, struct ppu_line *line_out) {
+    uint16_t dispcnt = ppu_io16(ppu, REG_DISPCNT);
+    struct sprite_cache *cache = &ppu->sprites;
+    uint16_t *out = line_out->obj, *attr_out = line_out->obj_attr;
+
+    if (cache->dirty || cache->dispcnt != dispcnt)
+        build_sprite_lists(ppu, dispcnt);
+
+    for (unsigned x = 0; x < SCREEN_WIDTH; x++) {
+        out[x] = PIXEL_TRANSPARENT;
+        attr_out[x] = 3;
+    }
+    memset(line_out->obj_window, 0, sizeof(line_out->obj_window));
+
+    for (unsigned n = 0; n < cache->count[y]; n++) {
+        const struct sprite *s = &cache->sprites[cache->list[y][n]];
+        unsigned line = (y - s->y) & 0xFF;
+        uint8_t indices[128];
+
+        if (s->affine) {
+            // the matrix is spread over the fourth halfword of four entries
+            const int16_t *matrix = (const int16_t *)(ppu->oam + s->matrix * 32);
+            int32_t pa = matrix[3], pb = matrix[7], pc = matrix[11], pd = matrix[15];
+            // texels are sampled around the sprite's center
+            int32_t ix = -(int32_t)s->box_w / 2, iy = line - s->box_h / 2;
+
+            struct affine_obj_row row = {
+                .vram = ppu->vram,
+                .x = pa * ix + pb * iy + (s->w / 2 << 8),
+                .y = pc * ix + pd * iy + (s->h / 2 << 8),
+                .dx = pa,
+                .dy = pc,
+                .width = s->w,
+                .height = s->h,
+                .tile = s->tile,
+                .row_stride = s->row_stride,
+                .color256 = s->color256,
+                .count = s->box_w,
+            };
+            ppu->affine_obj(&row, indices);
+        } else {
+            if (s->vflip)
+                line = s->h - 1 - line;
+
+            // whole tile rows from the cache; a flipped sprite takes its
+            // tiles in reverse order, each one already mirrored
+            unsigned row_tile = s->tile + (line / 8) * s->row_stride;
+            for (unsigned col = 0; col < s->w / 8u; col++) {
+                unsigned src = s->hflip ? s->w / 8 - 1 - col : col;
+                const uint8_t *row;
+
+                if (s->color256)
+                    row = tile8_row(ppu, 0x10000 + ((row_tile + src * 2) & 0x3FF) * 32, line & 7, s->hflip);
+                else
+                    row = tile4_row(ppu, 0x10000 + ((row_tile + src) & 0x3FF) * 32, line & 7, s->hflip);
+                memcpy(&indices[col * 8], row, 8);
+            }
+        }
+
+        if (s->mode == 2)
+            plot_obj_window(indices, s->box_w, s->x, line_out->obj_window);
+        else
+            plot_sprite(ppu, indices, s->box_w, s->x, s->pal, s->attr, out, attr_out);
+    }
+}
+
+static void build_params(const struct ppu *ppu, uint16_t bg_enabled, bool obj_enabled, struct composite_params *p) {
+    uint16_t bldcnt = ppu_io16(ppu, REG_BLDCNT);
+    uint16_t bldalpha = ppu_io16(ppu, REG_BLDALPHA);
+    uint16_t bldy = ppu_io16(ppu, REG_BLDY);
+
+    p->pass_count = 0;
+    for (int prio = 3; prio >= 0; prio--) {
+        // BG0 wins ties, so it goes last
+        for (int bg = 3; bg >= 0; bg--) {
+            if ((bg_enabled & (1 << bg)) && (ppu_io16(ppu, REG_BG0CNT + bg * 2) & 3) == prio)
+                p->passes[p->pass_count++] = bg;
+        }
+        // sprites sit in front of BGs with the same priority
+        if (obj_enabled)
+            p->passes[p->pass_count++] = 4 + prio;
+    }
+
+    p->backdrop = palette(ppu, 0);
+    p->target1 = bldcnt & 0x3F;
+    p->target2 = (bldcnt >> 8) & 0x3F;
+    p->effect = (bldcnt >> 6) & 3;
+    p->eva = bldalpha & 0x1F;
+    p->evb = (bldalpha >> 8) & 0x1F;
+    p->evy = bldy & 0x1F;
+
+    if (p->eva > 16) p->eva = 16;
+    if (p->evb > 16) p->evb = 16;
+    if (p->evy > 16) p->evy = 16;
+}
+
+// Bits [start, end) of a 240-bit line mask.
+static void span_mask(uint64_t *mask, unsigned start, unsigned end) {
+    for (unsigned w = 0; w < WINDOW_WORDS; w++) {
+        unsigned lo = w * 64;
+        unsigned a = start > lo ? start : lo;
+        unsigned b = end < lo + 64 ? end : lo + 64;
+        mask[w] = a < b ? (~0ULL >> (64 - (b - a))) << (a - lo) : 0;
+    }
+}
+
+// Horizontal span of window `n` if line `y` is inside it vertically.
+static bool window_span(const struct ppu *ppu, unsigned n, unsigned y, uint64_t *mask) {
+    uint16_t h = ppu_io16(ppu, REG_WIN0H + n * 2), v = ppu_io16(ppu, REG_WIN0V + n * 2);
+    unsigned x1 = h >> 8, x2 = h & 0xFF, y1 = v >> 8, y2 = v & 0xFF;
+
+    // reversed ends wrap around the screen: x in [x1, 240) plus [0, x2), and
+    // likewise for lines; ends past the screen stop at its edge
+    bool x_wrap = x1 > x2, y_wrap = y1 > y2;
+    if (x2 > SCREEN_WIDTH)
+        x2 = SCREEN_WIDTH;
+    if (y2 > SCREEN_HEIGHT)
+        y2 = SCREEN_HEIGHT;
+
+    if (y_wrap ? y < y1 && y >= y2 : y < y1 || y >= y2)
+        return false;
+
+    if (x_wrap) {
+        uint64_t left[WINDOW_WORDS];
+        span_mask(mask, x1, SCREEN_WIDTH);
+        span_mask(left, 0, x2);
+        for (unsigned w = 0; w < WINDOW_WORDS; w++)
+            mask[w] |= left[w];
+    } else {
+        span_mask(mask, x1, x2);
+    }
+    return true;
+}
+
+// Resolves windows 0/1, the OBJ window and the outside region into one mask
+// per layer plus one for color effects, so the compositor never looks at
+// window coordinates.
+static void build_windows(const struct ppu *ppu, unsigned y, bool obj_enabled, const struct ppu_line *line, struct composite_params *p) {
+    uint16_t dispcnt = ppu_io16(ppu, REG_DISPCNT);
+
+    if (!(dispcnt & 0xE000)) {
+        memset(p->window, 0xFF, sizeof(p->window));
+        return;
+    }
+
+    uint16_t winin = ppu_io16(ppu, REG_WININ), winout = ppu_io16(ppu, REG_WINOUT);
+    uint64_t regions[4][WINDOW_WORDS] = {0};
+    uint8_t enables[4] = { winin & 0x3F, (winin >> 8) & 0x3F, (winout >> 8) & 0x3F, winout & 0x3F };
+    uint64_t taken[WINDOW_WORDS] = {0};
+
+    if (dispcnt & 0x2000)
+        window_span(ppu, 0, y, regions[0]);
+    if (dispcnt & 0x4000)
+        window_span(ppu, 1, y, regions[1]);
+    if ((dispcnt & 0x8000) && obj_enabled)
+        memcpy(regions[2], line->obj_window, sizeof(regions[2]));
+
+    // window 0 beats window 1 beats the OBJ window, outside is the rest
+    for (unsigned r = 0; r < 3; r++) {
+        for (unsigned w = 0; w < WINDOW_WORDS; w++) {
+            regions[r][w] &= ~taken[w];
+            taken[w] |= regions[r][w];
+        }
+    }
+    for (unsigned w = 0; w < WINDOW_WORDS; w++)
+        regions[3][w] = ~taken[w];
+
+    for (unsigned layer = 0; layer < WINDOW_LAYERS; layer++) {
+        for (unsigned w = 0; w < WINDOW_WORDS; w++) {
+            uint64_t mask = 0;
+            for (unsigned r = 0; r < 4; r++) {
+                if (enables[r] & (1 << layer))
+                    mask |= regions[r][w];
+            }
+            p->window[layer][w] = mask;
+        }
+    }
+}
+
+static inline uint32_t *output_row(struct ppu *ppu, unsigned y) {
+    return (uint32_t *)((uint8_t *)ppu->pixels + y * ppu->pitch);
+}
+
+static void output_line(struct ppu *ppu, unsigned y, const uint16_t *color) {
+    ppu->convert(ppu->color_lut, color, output_row(ppu, y), SCREEN_WIDTH);
+}
+
+// Bitmap modes keep BG2 in VRAM as a 16-bit (modes 3, 5) or paletted (mode
+// 4) image; modes 4 and 5 have two pages.
+struct bitmap {
+    uint32_t base;
+    unsigned width, height;
+    bool paletted;
+};
+
+static struct bitmap bitmap_layout(uint16_t dispcnt) {
+    unsigned mode = dispcnt & 7;
+    uint32_t page = (dispcnt & 0x10) ? 0xA000 : 0;
+
+    switch (mode) {
+        case 3:  return (struct bitmap) { 0, 240, 160, false };
+        case 4:  return (struct bitmap) { page, 240, 160, true };
+        default: return (struct bitmap) { page, 160, 128, false };
+    }
+}
+
+static void render_bitmap_bg(struct ppu *ppu, uint16_t dispcnt, uint16_t *out) {
+    struct bitmap bm = bitmap_layout(dispcnt);
+    int32_t x = ppu->affine[0].x, y = ppu->affine[0].y;
+    int32_t dx = (int16_t)ppu_io16(ppu, REG_BG2PA), dy = (int16_t)ppu_io16(ppu, REG_BG2PC);
+    const uint8_t *pixels = ppu->vram + bm.base;
+
+    for (unsigned i = 0; i < SCREEN_WIDTH; i++, x += dx, y += dy) {
+        uint32_t tx = x >> 8, ty = y >> 8;
+
+        if (tx >= bm.width || ty >= bm.height)
+            out[i] = PIXEL_TRANSPARENT;
+        else if (bm.paletted) {
+            uint8_t index = pixels[ty * bm.width + tx];
+            out[i] = index ? palette(ppu, index) : PIXEL_TRANSPARENT;
+        } else
+            out[i] = ((const uint16_t *)pixels)[ty * bm.width + tx] & 0x7FFF;
+    }
+}
+
+// Untransformed BG2 alone with nothing to blend: the bitmap row goes
+// straight to the output, skipping line buffers and the compositor.
+static bool render_bitmap_direct(struct ppu *ppu, uint16_t dispcnt, unsigned y) {
+    uint16_t bldcnt = ppu_io16(ppu, REG_BLDCNT);
+
+    if ((dispcnt & 0xF400) != 0x0400)
+        return false;
+    if (((bldcnt >> 6) & 3) != EFFECT_NONE && (bldcnt & (LAYER_BG(2) | LAYER_BD)))
+        return false;
+    if (ppu_io16(ppu, REG_BG2PA) != 0x100 || ppu_io16(ppu, REG_BG2PC) != 0)
+        return false;
+    if (ppu->affine[0].x != 0 || (ppu->affine[0].y & 0xFF))
+        return false;
+
+    struct bitmap bm = bitmap_layout(dispcnt);
+    uint32_t *row = output_row(ppu, y);
+    uint32_t backdrop = ppu->palette_host[0];
+    uint32_t src_y = ppu->affine[0].y >> 8;
+
+    if (src_y >= bm.height) {
+        for (unsigned x = 0; x < SCREEN_WIDTH; x++)
+            row[x] = backdrop;
+        return true;
+    }
+
+    const uint8_t *pixels = ppu->vram + bm.base + src_y * bm.width * (bm.paletted ? 1 : 2);
+    if (bm.paletted) {
+        // index 0 shows the backdrop, which is palette entry 0 anyway
+        for (unsigned x = 0; x < SCREEN_WIDTH; x++)
+            row[x] = ppu->palette_host[pixels[x]];
+    } else {
+        ppu->convert(ppu->color_lut, (const uint16_t *)pixels, row, bm.width);
+        for (unsigned x = bm.width; x < SCREEN_WIDTH; x++)
+            row[x] = backdrop;
+    }
+    return true;
+}
+
+void ppu_render_scanline(struct ppu *ppu, unsigned y) {
+    uint16_t dispcnt = ppu_io16(ppu, REG_DISPCNT);
+    struct ppu_line *line = &ppu->line;
+    struct composite_params params;
+
+    if (dispcnt & 0x80) {
+        // forced blank
+        uint32_t *row = output_row(ppu, y);
+        for (unsigned x = 0; x < SCREEN_WIDTH; x++)
+            row[x] = 0xFFFFFFFF;
+        return;
+    }
+
+    uint16_t bg_enabled = 0;
+    switch (dispcnt & 7) {
+        case 0:
+            bg_enabled = (dispcnt >> 8) & 0xF;
+            break;
+        case 1:
+            // BG2 is affine
+            bg_enabled = (dispcnt >> 8) & 0x7;
+            break;
+        case 2:
+            // BG2 and BG3, both affine
+            bg_enabled = (dispcnt >> 8) & 0xC;
+            break;
+        case 3 ... 5:
+            // BG2 is a bitmap
+            if (render_bitmap_direct(ppu, dispcnt, y))
+                return;
+            bg_enabled = (dispcnt >> 8) & 0x4;
+            break;
+        default:
+            break;
+    }
+
+    for (unsigned bg = 0; bg < 4; bg++) {
+        if (!(bg_enabled & (1 << bg)))
+            continue;
+        if ((dispcnt & 7) == 0 || bg < 2)
+            render_text_bg(ppu, bg, y, line->bg[bg]);
+        else if ((dispcnt & 7) >= 3)
+            render_bitmap_bg(ppu, dispcnt, line->bg[bg]);
+        else
+            render_affine_bg(ppu, bg, line->bg[bg]);
+    }
+
+    bool obj_enabled = dispcnt & 0x1000;
+
+    // nothing but the backdrop, straight from the converted palette
+    if (!bg_enabled && !obj_enabled) {
+        uint32_t *row = output_row(ppu, y);
+        uint16_t bldcnt = ppu_io16(ppu, REG_BLDCNT);
+        uint8_t effect = (bldcnt >> 6) & 3;
+
+        if (!(bldcnt & LAYER_BD) || effect == EFFECT_NONE || effect == EFFECT_ALPHA) {
+            for (unsigned x = 0; x < SCREEN_WIDTH; x++)
+                row[x] = ppu->palette_host[0];
+            return;
+        }
+    }
+
+    if (obj_enabled)
+        render_sprites(ppu, y, line);
+
+    build_params(ppu, bg_enabled, obj_enabled, &params);
+    build_windows(ppu, y, obj_enabled, line, &params);
+    ppu->composite(&params, line, line->color);
+    output_line(ppu, y, line->color);
+}
+
+// timing always works on the bus registers, the renderer may be reading a copy
+static inline uint16_t io16(uint32_t reg) {
+    return *(uint16_t *)(mem.io + reg);
+}
+
+static inline void set_io16(uint32_t reg, uint16_t value) {
+    *(uint16_t *)(mem.io + reg) = value;
+}
+
+static inline void raise_irq(uint16_t irq) {
+    set_io16(REG_IF, io16(REG_IF) | irq);
+}
+
+// BGxX/BGxY hold 28-bit signed values
+static int32_t affine_reg(uint32_t reg) {
+    return (int32_t)(*(uint32_t *)(mem.io + reg) << 4) >> 4;
+}
+
+static void reload_affine(struct ppu *ppu) {
+    for (unsigned i = 0; i < 2; i++) {
+        ppu->affine[i].x = affine_reg(REG_BG2X + i * 0x10);
+        ppu->affine[i].y = affine_reg(REG_BG2Y + i * 0x10);
+    }
+}
+
+void ppu_io_written(struct ppu *ppu, uint32_t offset) {
+    // BG2X/Y at 0x28-0x2F, BG3X/Y at 0x38-0x3F
+    if (offset < REG_BG2X || offset >= REG_BG2X + 0x18 || (offset & 0xF) < 8)
+        return;
+
+    unsigned i = (offset - REG_BG2X) / 0x10;
+    if (offset & 4)
+        ppu->affine[i].y = affine_reg(REG_BG2Y + i * 0x10);
+    else
+        ppu->affine[i].x = affine_reg(REG_BG2X + i * 0x10);
+}
+
+void ppu_tick(struct ppu *ppu, uint32_t cycles) {
+    ppu->cycle += cycles;
+
+    while (true) {
+        uint16_t dispstat = io16(REG_DISPSTAT);
+
+        if (!ppu->hblank && ppu->cycle >= HDRAW_CYCLES) {
+            ppu->hblank = true;
+            set_io16(REG_DISPSTAT, dispstat | 0x2);
+
+            if (ppu->vcount < SCREEN_HEIGHT && !ppu->skip_frame) {
+                if (ppu_thread_active())
+                    ppu_thread_push_line(ppu, ppu->vcount);
+                else
+                    ppu_render_scanline(ppu, ppu->vcount);
+            }
+            if (ppu->vcount < SCREEN_HEIGHT) {
+                for (unsigned i = 0; i < 2; i++) {
+                    ppu->affine[i].x += (int16_t)io16(REG_BG2PB + i * 0x10);
+                    ppu->affine[i].y += (int16_t)io16(REG_BG2PD + i * 0x10);
+                }
+            }
+            if (dispstat & 0x10)
+                raise_irq(IRQ_HBLANK);
+            continue;
+        }
+
+        if (ppu->cycle < LINE_CYCLES)
+            break;
+
+        ppu->cycle -= LINE_CYCLES;
+        ppu->hblank = false;
+        ppu->vcount = (ppu->vcount + 1) % LINE_COUNT;
+        set_io16(REG_VCOUNT, ppu->vcount);
+
+        // frame `frame + 1` starts, pick whether it gets drawn
+        if (ppu->vcount == 0)
+            ppu->skip_frame = !ppu_frame_drawn(ppu, ppu->frame + 1);
+
+        dispstat &= ~0x7;
+        // the VBlank flag is already clear on the last line
+        if (ppu->vcount >= SCREEN_HEIGHT && ppu->vcount < LINE_COUNT - 1)
+            dispstat |= 0x1;
+        if (ppu->vcount == (dispstat >> 8)) {
+            dispstat |= 0x4;
+            if (dispstat & 0x20)
+                raise_irq(IRQ_VCOUNT);
+        }
+        if (ppu->vcount == SCREEN_HEIGHT) {
+            ppu->frame++;
+            reload_affine(ppu);
+            if (ppu_thread_active() && !ppu->skip_frame)
+                ppu_thread_push_frame(ppu->frame);
+            if (dispstat & 0x8)
+                raise_irq(IRQ_VBLANK);
+        }
+
+        set_io16(REG_DISPSTAT, dispstat);
+    }
+}
@@ -0,0 +1,272 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define SCREEN_WIDTH    240
+#define SCREEN_HEIGHT   160
+
+// Scanline timing in CPU cycles
+#define HDRAW_CYCLES    960
+#define LINE_CYCLES     1232
+#define LINE_COUNT      228
+
+enum {
+	REG_DISPCNT     = 0x00,
+	REG_DISPSTAT    = 0x04,
+	REG_VCOUNT      = 0x06,
+	REG_BG0CNT      = 0x08,
+	REG_BG0HOFS     = 0x10,
+	REG_BG0VOFS     = 0x12,
+	REG_BG2PA       = 0x20,
+	REG_BG2PB       = 0x22,
+	REG_BG2PC       = 0x24,
+	REG_BG2PD       = 0x26,
+	REG_BG2X        = 0x28,
+	REG_BG2Y        = 0x2C,
+	REG_WIN0H       = 0x40,
+	REG_WIN1H       = 0x42,
+	REG_WIN0V       = 0x44,
+	REG_WIN1V       = 0x46,
+	REG_WININ       = 0x48,
+	REG_WINOUT      = 0x4A,
+	REG_MOSAIC      = 0x4C,
+	REG_BLDCNT      = 0x50,
+	REG_BLDALPHA    = 0x52,
+	REG_BLDY        = 0x54,
+	REG_IE          = 0x200,
+	REG_IF          = 0x202,
+};
+
+enum {
+	IRQ_VBLANK      = 1 << 0,
+	IRQ_HBLANK      = 1 << 1,
+	IRQ_VCOUNT      = 1 << 2,
+};
+
+enum {
+	EFFECT_NONE = 0,
+	EFFECT_ALPHA,
+	EFFECT_BRIGHTEN,
+	EFFECT_DARKEN,
+};
+
+// Line buffers hold BGR555 colors, bit 15 marks a pixel no layer drew.
+#define PIXEL_TRANSPARENT   0x8000
+
+// Layers are one-hot so BLDCNT target checks are a single AND per pixel.
+#define LAYER_BG(n)     (1 << (n))
+#define LAYER_OBJ       0x10
+#define LAYER_BD        0x20
+#define OBJ_SEMI        0x100   // in obj_attr and in composited layer bits
+
+// Window masks hold one bit per pixel of the line.
+#define WINDOW_WORDS    4
+#define WINDOW_LAYERS   6   // BG0-3, OBJ, color effects, as in WININ/WINOUT
+#define WINDOW_EFFECTS  5
+
+struct ppu_line {
+	uint16_t bg[4][SCREEN_WIDTH];
+	uint16_t obj[SCREEN_WIDTH];
+	uint16_t obj_attr[SCREEN_WIDTH];    // priority | OBJ_SEMI
+	uint16_t color[SCREEN_WIDTH];       // composited output
+	uint64_t obj_window[WINDOW_WORDS];  // opaque pixels of OBJ window sprites
+} __attribute__((aligned(32)));
+
+// Everything the compositor needs to know about the line besides pixels.
+// `passes` lists the layers back to front: 0-3 is a BG, 4 + n are the
+// sprites with priority n.
+struct composite_params {
+	uint8_t pass_count;
+	uint8_t passes[8];
+	uint16_t backdrop;
+	uint16_t target1, target2;
+	uint8_t effect;
+	uint16_t eva, evb, evy;
+	// pixels where each layer is visible, and where effects apply
+	uint64_t window[WINDOW_LAYERS][WINDOW_WORDS];
+};
+
+// Pre-expanded tiles: every 32-byte VRAM granule as an 8x8 tile of palette
+// indices, 4bpp and 8bpp, plain and horizontally flipped. An 8bpp tile spans
+// two granules. Entries are rebuilt lazily when the bus marks them dirty.
+#define TILE_COUNT      (0x18000 / 32)
+
+struct tile_cache {
+	uint64_t dirty4[TILE_COUNT / 64];
+	uint64_t dirty8[TILE_COUNT / 64];
+	uint8_t tile4[TILE_COUNT][2][64];
+	uint8_t tile8[TILE_COUNT][2][64];
+};
+
+// OAM parsed once per change: every sprite that can draw, and per line the
+// ones whose bounding box covers it, in OAM order.
+struct sprite {
+	int16_t x;
+	uint8_t y;
+	uint8_t w, h, box_w, box_h;
+	uint8_t mode;
+	uint8_t matrix;
+	uint8_t row_stride;
+	bool affine, color256, hflip, vflip;
+	uint16_t tile, pal, attr;
+};
+
+struct sprite_cache {
+	bool dirty;
+	uint16_t dispcnt;   // mapping, mode and OBJ window change the lists too
+	struct sprite sprites[128];
+	uint8_t count[SCREEN_HEIGHT];
+	uint8_t list[SCREEN_HEIGHT][128];
+};
+
+// Host pixel layouts the output stage can produce, all 32 bits per pixel.
+typedef enum {
+	PIXEL_FORMAT_ARGB8888,
+	PIXEL_FORMAT_ABGR8888,
+} pixel_format_t;
+
+typedef void (*composite_fn)(const struct composite_params *p, const struct ppu_line *line, uint16_t *out);
+typedef void (*convert_fn)(const uint32_t *lut, const uint16_t *src, uint32_t *dst, unsigned count);
+
+// One scanline of an affine BG: texel (x + i * dx, y + i * dy) for pixel i,
+// in 8.8 fixed point. Maps are `size` texels square, one byte per tile.
+struct affine_bg_row {
+	const uint8_t *vram;
+	const uint8_t *palram;
+	uint32_t map_base, char_base;
+	unsigned size;
+	bool wrap;
+	int32_t x, y, dx, dy;
+};
+
+// One row across an affine sprite's bounding box, texels relative to the
+// sprite's top left corner. `count` is a multiple of 8. Produces palette
+// indices, 0 where the texel is transparent or outside the sprite.
+struct affine_obj_row {
+	const uint8_t *vram;
+	int32_t x, y, dx, dy;
+	unsigned width, height;
+	unsigned tile, row_stride;
+	bool color256;
+	unsigned count;
+};
+
+typedef void (*affine_bg_fn)(const struct affine_bg_row *r, uint16_t *out);
+typedef void (*affine_obj_fn)(const struct affine_obj_row *r, uint8_t *indices);
+
+// BG2/BG3 internal reference point, 20.8 fixed point
+struct affine_ref {
+	int32_t x, y;
+};
+
+struct ppu {
+	// memory the renderer reads, normally the bus arrays
+	const uint8_t *vram;
+	const uint8_t *oam;
+	const uint8_t *palram;
+	const uint8_t *io;
+
+	// output, 32-bit pixels; `pitch` is in bytes
+	void *pixels;
+	int pitch;
+
+	// bus side timing
+	uint32_t cycle;
+	uint16_t vcount;
+	bool hblank;
+	uint32_t frame;     // completed frames, counted at VBlank
+
+	// Reloaded from BGxX/BGxY at VBlank and whenever they are written,
+	// stepped by PB/PD after every line.
+	struct affine_ref affine[2];
+
+	// Frameskip: only every `render_every`th frame is drawn, 0 draws none.
+	// Skipped frames still run timing and IRQs but produce no pixels.
+	uint32_t render_every;
+	bool skip_frame;
+
+	composite_fn composite;
+	const char *composite_name;
+	convert_fn convert;
+	affine_bg_fn affine_bg;
+	affine_obj_fn affine_obj;
+
+	// BGR555 to host pixels, for any color, and the 512 palette entries
+	// already converted, kept up to date by palette RAM writes
+	pixel_format_t format;
+	bool lcd_correction;
+	uint32_t color_lut[0x8000];
+	uint32_t palette_host[512];
+
+	struct ppu_line line;
+	struct tile_cache tiles;
+	struct sprite_cache sprites;
+	uint32_t framebuffer[SCREEN_WIDTH * SCREEN_HEIGHT];
+};
+
+extern struct ppu ppu;
+
+void ppu_init(struct ppu *ppu, const uint8_t *vram, const uint8_t *oam, const uint8_t *palram, const uint8_t *io);
+void ppu_set_target(struct ppu *ppu, void *pixels, int pitch);
+void ppu_render_scanline(struct ppu *ppu, unsigned y);
+
+// Advances the bus side of the PPU: VCOUNT, DISPSTAT, IRQs, and renders each
+// visible line as it enters HBlank unless the frame is skipped.
+void ppu_tick(struct ppu *ppu, uint32_t cycles);
+
+// Cycles until ppu_tick() has something to do: the next HBlank or line start.
+static inline uint32_t ppu_cycles_to_event(const struct ppu *ppu) {
+	uint32_t deadline = ppu->hblank ? LINE_CYCLES : HDRAW_CYCLES;
+	return ppu->cycle < deadline ? deadline - ppu->cycle : 1;
+}
+
+// Takes effect from the next frame, or from this one if it hasn't started
+// (right after ppu_init). The frame that just finished was drawn when
+// ppu->skip_frame is false at VBlank.
+void ppu_set_frameskip(struct ppu *ppu, uint32_t render_every);
+
+// Whether frame number `frame` (counting from 1) gets pixels.
+static inline bool ppu_frame_drawn(const struct ppu *ppu, uint32_t frame) {
+	return ppu->render_every && frame % ppu->render_every == 0;
+}
+
+// Rebuilds the conversion table, optionally approximating the GBA LCD's
+// gamma and color response.
+void ppu_set_color_format(struct ppu *ppu, pixel_format_t format, bool lcd_correction);
+
+// Picks the fastest compositor and color conversion the host supports.
+void ppu_select_composite(struct ppu *ppu);
+
+// Same for the affine BG and sprite rasterizers.
+void ppu_select_affine(struct ppu *ppu);
+
+// Called by the bus after a store to the IO register at `offset`.
+void ppu_io_written(struct ppu *ppu, uint32_t offset);
+
+// Called by whoever writes the VRAM the renderer reads from; on the bus that
+// is ppu_bus_written().
+static inline void ppu_vram_written(struct ppu *ppu, uint32_t offset) {
+	uint32_t granule = offset / 32;
+
+	ppu->tiles.dirty4[granule / 64] |= 1ULL << (granule % 64);
+	ppu->tiles.dirty8[granule / 64] |= 1ULL << (granule % 64);
+	// the 8bpp tile starting one granule earlier covers this one too
+	if (granule) {
+		granule--;
+		ppu->tiles.dirty8[granule / 64] |= 1ULL << (granule % 64);
+	}
+}
+
+static inline void ppu_palram_written(struct ppu *ppu, uint32_t offset) {
+	offset &= 0x3FE;
+	ppu->palette_host[offset / 2] = ppu->color_lut[*(const uint16_t *)(ppu->palram + offset) & 0x7FFF];
+}
+
+static inline void ppu_oam_written(struct ppu *ppu) {
+	ppu->sprites.dirty = true;
+}
+
+static inline uint16_t ppu_io16(const struct ppu *ppu, uint32_t reg) {
+	return *(const uint16_t *)(ppu->io + reg);
+}
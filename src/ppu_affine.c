@@ -0,0 +1,209 @@
+#include "ppu.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#define PPU_X86 1
+#include <immintrin.h>
+#endif
+
+// Rotation/scaling rasterizers for BG2/BG3 in modes 1 and 2 and for affine
+// sprites. The walk is the same everywhere: step the texture coordinate,
+// clip or wrap it, fetch the tile byte, then the texel. The AVX2 variants
+// do 8 pixels at a time with gathers, the scalar ones are the reference.
+
+#define VRAM_BYTES      (TILE_COUNT * 32)
+#define OBJ_VRAM        0x10000
+
+static void affine_bg_scalar(const struct affine_bg_row *r, uint16_t *out) {
+    int32_t x = r->x, y = r->y;
+    int32_t mask = r->size - 1;
+
+    for (unsigned i = 0; i < SCREEN_WIDTH; i++, x += r->dx, y += r->dy) {
+        int32_t tx = x >> 8, ty = y >> 8;
+
+        if (((tx | ty) & ~mask) && !r->wrap) {
+            out[i] = PIXEL_TRANSPARENT;
+            continue;
+        }
+        tx &= mask;
+        ty &= mask;
+
+        uint8_t tile = r->vram[r->map_base + (ty >> 3) * (r->size >> 3) + (tx >> 3)];
+        uint8_t index = r->vram[r->char_base + tile * 64 + (ty & 7) * 8 + (tx & 7)];
+        out[i] = index ? *(const uint16_t *)(r->palram + index * 2) & 0x7FFF : PIXEL_TRANSPARENT;
+    }
+}
+
+static void affine_obj_scalar(const struct affine_obj_row *r, uint8_t *indices) {
+    int32_t x = r->x, y = r->y;
+
+    for (unsigned i = 0; i < r->count; i++, x += r->dx, y += r->dy) {
+        uint32_t tx = x >> 8, ty = y >> 8;
+
+        indices[i] = 0;
+        if (tx >= r->width || ty >= r->height)
+            continue;
+
+        if (r->color256) {
+            uint32_t tile = (r->tile + (ty >> 3) * r->row_stride + (tx >> 3) * 2) & 0x3FF;
+            uint32_t addr = OBJ_VRAM + tile * 32 + (ty & 7) * 8 + (tx & 7);
+            if (addr < VRAM_BYTES)
+                indices[i] = r->vram[addr];
+        } else {
+            uint32_t tile = (r->tile + (ty >> 3) * r->row_stride + (tx >> 3)) & 0x3FF;
+            uint8_t pair = r->vram[OBJ_VRAM + tile * 32 + (ty & 7) * 4 + (tx & 7) / 2];
+            indices[i] = (pair >> ((tx & 1) * 4)) & 0xF;
+        }
+    }
+}
+
+#ifdef PPU_X86
+
+// Byte and halfword loads at 8 arbitrary offsets. The gathers only touch
+// aligned words so they never read past the end of the array.
+__attribute__((target("avx2")))
+static inline __m256i gather_u8(const uint8_t *base, __m256i offset) {
+    __m256i word = _mm256_i32gather_epi32((const int *)base, _mm256_andnot_si256(_mm256_set1_epi32(3), offset), 1);
+    __m256i shift = _mm256_slli_epi32(_mm256_and_si256(offset, _mm256_set1_epi32(3)), 3);
+    return _mm256_and_si256(_mm256_srlv_epi32(word, shift), _mm256_set1_epi32(0xFF));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i gather_u16(const uint8_t *base, __m256i offset) {
+    __m256i word = _mm256_i32gather_epi32((const int *)base, _mm256_andnot_si256(_mm256_set1_epi32(3), offset), 1);
+    __m256i shift = _mm256_slli_epi32(_mm256_and_si256(offset, _mm256_set1_epi32(2)), 3);
+    return _mm256_and_si256(_mm256_srlv_epi32(word, shift), _mm256_set1_epi32(0xFFFF));
+}
+
+__attribute__((target("avx2")))
+static void affine_bg_avx2(const struct affine_bg_row *r, uint16_t *out) {
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi32(-1);
+    const __m256i seven = _mm256_set1_epi32(7);
+    const __m256i mask = _mm256_set1_epi32(r->size - 1);
+    const __m256i transparent = _mm256_set1_epi32(PIXEL_TRANSPARENT);
+    const __m256i map_base = _mm256_set1_epi32(r->map_base);
+    const __m256i char_base = _mm256_set1_epi32(r->char_base);
+    // map rows are size / 8 tiles long
+    const __m128i row_shift = _mm_cvtsi32_si128(__builtin_ctz(r->size) - 3);
+
+    __m256i x = _mm256_add_epi32(_mm256_set1_epi32(r->x), _mm256_mullo_epi32(lane, _mm256_set1_epi32(r->dx)));
+    __m256i y = _mm256_add_epi32(_mm256_set1_epi32(r->y), _mm256_mullo_epi32(lane, _mm256_set1_epi32(r->dy)));
+    __m256i step_x = _mm256_set1_epi32(r->dx * 8);
+    __m256i step_y = _mm256_set1_epi32(r->dy * 8);
+
+    for (unsigned i = 0; i < SCREEN_WIDTH; i += 8) {
+        __m256i tx = _mm256_srai_epi32(x, 8);
+        __m256i ty = _mm256_srai_epi32(y, 8);
+        x = _mm256_add_epi32(x, step_x);
+        y = _mm256_add_epi32(y, step_y);
+
+        __m256i outside = zero;
+        if (!r->wrap) {
+            outside = _mm256_andnot_si256(mask, _mm256_or_si256(tx, ty));
+            outside = _mm256_xor_si256(_mm256_cmpeq_epi32(outside, zero), ones);
+            if (_mm256_testc_si256(outside, ones)) {
+                _mm_storeu_si128((__m128i *)&out[i], _mm_set1_epi16(PIXEL_TRANSPARENT));
+                continue;
+            }
+        }
+        tx = _mm256_and_si256(tx, mask);
+        ty = _mm256_and_si256(ty, mask);
+
+        __m256i map = _mm256_add_epi32(map_base, _mm256_add_epi32(
+            _mm256_sll_epi32(_mm256_srli_epi32(ty, 3), row_shift), _mm256_srli_epi32(tx, 3)));
+        __m256i tile = gather_u8(r->vram, map);
+
+        __m256i texel = _mm256_add_epi32(char_base, _mm256_add_epi32(_mm256_slli_epi32(tile, 6),
+            _mm256_add_epi32(_mm256_slli_epi32(_mm256_and_si256(ty, seven), 3), _mm256_and_si256(tx, seven))));
+        __m256i index = gather_u8(r->vram, texel);
+
+        __m256i color = _mm256_and_si256(gather_u16(r->palram, _mm256_slli_epi32(index, 1)), _mm256_set1_epi32(0x7FFF));
+        __m256i clear = _mm256_or_si256(outside, _mm256_cmpeq_epi32(index, zero));
+        color = _mm256_blendv_epi8(color, transparent, clear);
+
+        // 8 dwords to 8 words: pack within lanes, then pull the halves together
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(color, color), 0x08);
+        _mm_storeu_si128((__m128i *)&out[i], _mm256_castsi256_si128(packed));
+    }
+}
+
+__attribute__((target("avx2")))
+static void affine_obj_avx2(const struct affine_obj_row *r, uint8_t *indices) {
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i seven = _mm256_set1_epi32(7);
+    const __m256i width = _mm256_set1_epi32(r->width);
+    const __m256i height = _mm256_set1_epi32(r->height);
+    const __m256i tile = _mm256_set1_epi32(r->tile);
+    const __m256i row_stride = _mm256_set1_epi32(r->row_stride);
+    const __m256i tile_mask = _mm256_set1_epi32(0x3FF);
+    const __m256i obj_vram = _mm256_set1_epi32(OBJ_VRAM);
+    const __m256i vram_end = _mm256_set1_epi32(VRAM_BYTES);
+    // bytes 0, 4, 8, 12 of each 128-bit lane
+    const __m256i narrow = _mm256_setr_epi8(
+        0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+
+    __m256i x = _mm256_add_epi32(_mm256_set1_epi32(r->x), _mm256_mullo_epi32(lane, _mm256_set1_epi32(r->dx)));
+    __m256i y = _mm256_add_epi32(_mm256_set1_epi32(r->y), _mm256_mullo_epi32(lane, _mm256_set1_epi32(r->dy)));
+    __m256i step_x = _mm256_set1_epi32(r->dx * 8);
+    __m256i step_y = _mm256_set1_epi32(r->dy * 8);
+
+    for (unsigned i = 0; i < r->count; i += 8) {
+        __m256i tx = _mm256_srai_epi32(x, 8);
+        __m256i ty = _mm256_srai_epi32(y, 8);
+        x = _mm256_add_epi32(x, step_x);
+        y = _mm256_add_epi32(y, step_y);
+
+        // 0 <= t < size as signed compares
+        __m256i inside = _mm256_and_si256(
+            _mm256_andnot_si256(_mm256_cmpgt_epi32(zero, tx), _mm256_cmpgt_epi32(width, tx)),
+            _mm256_andnot_si256(_mm256_cmpgt_epi32(zero, ty), _mm256_cmpgt_epi32(height, ty)));
+        if (_mm256_testz_si256(inside, inside)) {
+            *(uint64_t *)&indices[i] = 0;
+            continue;
+        }
+        tx = _mm256_and_si256(tx, inside);
+        ty = _mm256_and_si256(ty, inside);
+
+        __m256i row_tile = _mm256_add_epi32(tile, _mm256_mullo_epi32(_mm256_srli_epi32(ty, 3), row_stride));
+        __m256i index;
+
+        if (r->color256) {
+            __m256i n = _mm256_and_si256(_mm256_add_epi32(row_tile, _mm256_slli_epi32(_mm256_srli_epi32(tx, 3), 1)), tile_mask);
+            __m256i addr = _mm256_add_epi32(obj_vram, _mm256_add_epi32(_mm256_slli_epi32(n, 5),
+                _mm256_add_epi32(_mm256_slli_epi32(_mm256_and_si256(ty, seven), 3), _mm256_and_si256(tx, seven))));
+            // the last 8bpp tile runs off the end of VRAM
+            inside = _mm256_and_si256(inside, _mm256_cmpgt_epi32(vram_end, addr));
+            index = gather_u8(r->vram, _mm256_and_si256(addr, inside));
+        } else {
+            __m256i n = _mm256_and_si256(_mm256_add_epi32(row_tile, _mm256_srli_epi32(tx, 3)), tile_mask);
+            __m256i addr = _mm256_add_epi32(obj_vram, _mm256_add_epi32(_mm256_slli_epi32(n, 5),
+                _mm256_add_epi32(_mm256_slli_epi32(_mm256_and_si256(ty, seven), 2), _mm256_srli_epi32(_mm256_and_si256(tx, seven), 1))));
+            __m256i pair = gather_u8(r->vram, addr);
+            __m256i nibble = _mm256_slli_epi32(_mm256_and_si256(tx, _mm256_set1_epi32(1)), 2);
+            index = _mm256_and_si256(_mm256_srlv_epi32(pair, nibble), _mm256_set1_epi32(0xF));
+        }
+        index = _mm256_and_si256(index, inside);
+
+        __m256i bytes = _mm256_shuffle_epi8(index, narrow);
+        __m128i joined = _mm_unpacklo_epi32(_mm256_castsi256_si128(bytes), _mm256_extracti128_si256(bytes, 1));
+        _mm_storel_epi64((__m128i *)&indices[i], joined);
+    }
+}
+
+#endif
+
+void ppu_select_affine(struct ppu *ppu) {
+    ppu->affine_bg = affine_bg_scalar;
+    ppu->affine_obj = affine_obj_scalar;
+
+#ifdef PPU_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        ppu->affine_bg = affine_bg_avx2;
+        ppu->affine_obj = affine_obj_avx2;
+    }
+#endif
+}
@@ -0,0 +1,305 @@
+#include "ppu.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#define PPU_X86 1
+#include <immintrin.h>
+#endif
+
+// Layer compositing and color special effects for one scanline. Every
+// variant walks the passes back to front keeping the two topmost opaque
+// pixels, then applies BLDCNT to the pair. Windows only show up as the
+// per-layer masks in the params; the SIMD variants widen the mask bits of a
+// block into lane masks.
+
+static inline bool window_bit(const uint64_t *mask, unsigned x) {
+    return mask[x / 64] >> (x % 64) & 1;
+}
+
+static inline uint16_t blend_alpha(uint16_t a, uint16_t b, uint16_t eva, uint16_t evb) {
+    uint16_t out = 0;
+    for (unsigned shift = 0; shift < 15; shift += 5) {
+        uint16_t c = (((a >> shift) & 0x1F) * eva + ((b >> shift) & 0x1F) * evb) >> 4;
+        out |= (c > 31 ? 31 : c) << shift;
+    }
+    return out;
+}
+
+static inline uint16_t brighten(uint16_t a, uint16_t evy) {
+    uint16_t out = 0;
+    for (unsigned shift = 0; shift < 15; shift += 5) {
+        uint16_t c = (a >> shift) & 0x1F;
+        out |= (c + (((31 - c) * evy) >> 4)) << shift;
+    }
+    return out;
+}
+
+static inline uint16_t darken(uint16_t a, uint16_t evy) {
+    uint16_t out = 0;
+    for (unsigned shift = 0; shift < 15; shift += 5) {
+        uint16_t c = (a >> shift) & 0x1F;
+        out |= (c - ((c * evy) >> 4)) << shift;
+    }
+    return out;
+}
+
+static void composite_scalar(const struct composite_params *p, const struct ppu_line *line, uint16_t *out) {
+    for (unsigned x = 0; x < SCREEN_WIDTH; x++) {
+        uint16_t top_c = p->backdrop, top_l = LAYER_BD;
+        uint16_t bot_c = p->backdrop, bot_l = LAYER_BD;
+
+        for (unsigned i = 0; i < p->pass_count; i++) {
+            uint8_t pass = p->passes[i];
+            uint16_t c, l;
+
+            if (pass < 4) {
+                c = line->bg[pass][x];
+                l = LAYER_BG(pass);
+            } else {
+                c = line->obj[x];
+                if ((line->obj_attr[x] & 3) != pass - 4)
+                    continue;
+                l = LAYER_OBJ | (line->obj_attr[x] & OBJ_SEMI);
+            }
+
+            if ((c & PIXEL_TRANSPARENT) || !window_bit(p->window[pass < 4 ? pass : 4], x))
+                continue;
+
+            bot_c = top_c;
+            bot_l = top_l;
+            top_c = c;
+            top_l = l;
+        }
+
+        bool second = bot_l & p->target2;
+        uint16_t color = top_c;
+
+        if (!window_bit(p->window[WINDOW_EFFECTS], x)) {
+            out[x] = color;
+            continue;
+        }
+
+        // semi-transparent sprites blend whatever BLDCNT says
+        if ((top_l & OBJ_SEMI) && second)
+            color = blend_alpha(top_c, bot_c, p->eva, p->evb);
+        else if (top_l & p->target1) {
+            switch (p->effect) {
+                case EFFECT_ALPHA:
+                    if (second)
+                        color = blend_alpha(top_c, bot_c, p->eva, p->evb);
+                    break;
+                case EFFECT_BRIGHTEN:
+                    color = brighten(top_c, p->evy);
+                    break;
+                case EFFECT_DARKEN:
+                    color = darken(top_c, p->evy);
+                    break;
+            }
+        }
+
+        out[x] = color;
+    }
+}
+
+// BGR555 to host pixels through the conversion table, bit 15 is ignored.
+static void convert_scalar(const uint32_t *lut, const uint16_t *src, uint32_t *dst, unsigned count) {
+    for (unsigned x = 0; x < count; x++)
+        dst[x] = lut[src[x] & 0x7FFF];
+}
+
+#ifdef PPU_X86
+
+#define SSE41 __attribute__((target("sse4.1")))
+#define AVX2 __attribute__((target("avx2")))
+
+SSE41 static inline __m128i channel_sse41(__m128i c, int shift) {
+    return _mm_and_si128(_mm_srli_epi16(c, shift), _mm_set1_epi16(0x1F));
+}
+
+// 8 mask bits starting at x (a multiple of 8) as 16-bit lane masks
+SSE41 static inline __m128i window_sse41(const uint64_t *mask, unsigned x) {
+    const __m128i select = _mm_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128);
+    __m128i bits = _mm_set1_epi16((mask[x / 64] >> (x % 64)) & 0xFF);
+    return _mm_cmpeq_epi16(_mm_and_si128(bits, select), select);
+}
+
+SSE41 static inline __m128i effects_sse41(const struct composite_params *p, __m128i top_c, __m128i top_l, __m128i bot_c, __m128i bot_l, __m128i fx) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi16(31);
+    const __m128i eva = _mm_set1_epi16(p->eva), evb = _mm_set1_epi16(p->evb), evy = _mm_set1_epi16(p->evy);
+
+    __m128i first = _mm_andnot_si128(_mm_cmpeq_epi16(_mm_and_si128(top_l, _mm_set1_epi16(p->target1)), zero), _mm_set1_epi16(-1));
+    __m128i second = _mm_andnot_si128(_mm_cmpeq_epi16(_mm_and_si128(bot_l, _mm_set1_epi16(p->target2)), zero), _mm_set1_epi16(-1));
+    __m128i semi = _mm_andnot_si128(_mm_cmpeq_epi16(_mm_and_si128(top_l, _mm_set1_epi16(OBJ_SEMI)), zero), _mm_set1_epi16(-1));
+
+    __m128i alpha_m = _mm_and_si128(_mm_and_si128(semi, second), fx);
+    __m128i other_m = _mm_and_si128(_mm_andnot_si128(alpha_m, first), fx);
+    if (p->effect == EFFECT_ALPHA)
+        alpha_m = _mm_or_si128(alpha_m, _mm_and_si128(other_m, second));
+
+    __m128i alpha = zero, other = zero;
+    for (int shift = 0; shift < 15; shift += 5) {
+        __m128i a = channel_sse41(top_c, shift), b = channel_sse41(bot_c, shift);
+        __m128i c = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(a, eva), _mm_mullo_epi16(b, evb)), 4);
+        alpha = _mm_or_si128(alpha, _mm_slli_epi16(_mm_min_epu16(c, max), shift));
+
+        if (p->effect == EFFECT_BRIGHTEN)
+            c = _mm_add_epi16(a, _mm_srli_epi16(_mm_mullo_epi16(_mm_sub_epi16(max, a), evy), 4));
+        else
+            c = _mm_sub_epi16(a, _mm_srli_epi16(_mm_mullo_epi16(a, evy), 4));
+        other = _mm_or_si128(other, _mm_slli_epi16(c, shift));
+    }
+
+    __m128i color = _mm_blendv_epi8(top_c, alpha, alpha_m);
+    if (p->effect == EFFECT_BRIGHTEN || p->effect == EFFECT_DARKEN)
+        color = _mm_blendv_epi8(color, other, _mm_andnot_si128(alpha_m, other_m));
+    return color;
+}
+
+SSE41 static void composite_sse41(const struct composite_params *p, const struct ppu_line *line, uint16_t *out) {
+    const __m128i transparent = _mm_set1_epi16(PIXEL_TRANSPARENT);
+    const __m128i zero = _mm_setzero_si128();
+
+    for (unsigned x = 0; x < SCREEN_WIDTH; x += 8) {
+        __m128i top_c = _mm_set1_epi16(p->backdrop), top_l = _mm_set1_epi16(LAYER_BD);
+        __m128i bot_c = top_c, bot_l = top_l;
+
+        for (unsigned i = 0; i < p->pass_count; i++) {
+            uint8_t pass = p->passes[i];
+            __m128i c, l, m;
+
+            if (pass < 4) {
+                c = _mm_loadu_si128((const __m128i *)&line->bg[pass][x]);
+                l = _mm_set1_epi16(LAYER_BG(pass));
+                m = _mm_cmpeq_epi16(_mm_and_si128(c, transparent), zero);
+                m = _mm_and_si128(m, window_sse41(p->window[pass], x));
+            } else {
+                __m128i attr = _mm_loadu_si128((const __m128i *)&line->obj_attr[x]);
+                c = _mm_loadu_si128((const __m128i *)&line->obj[x]);
+                l = _mm_or_si128(_mm_set1_epi16(LAYER_OBJ), _mm_and_si128(attr, _mm_set1_epi16(OBJ_SEMI)));
+                m = _mm_and_si128(_mm_cmpeq_epi16(_mm_and_si128(c, transparent), zero),
+                                  _mm_cmpeq_epi16(_mm_and_si128(attr, _mm_set1_epi16(3)), _mm_set1_epi16(pass - 4)));
+                m = _mm_and_si128(m, window_sse41(p->window[4], x));
+            }
+
+            bot_c = _mm_blendv_epi8(bot_c, top_c, m);
+            bot_l = _mm_blendv_epi8(bot_l, top_l, m);
+            top_c = _mm_blendv_epi8(top_c, c, m);
+            top_l = _mm_blendv_epi8(top_l, l, m);
+        }
+
+        _mm_storeu_si128((__m128i *)&out[x], effects_sse41(p, top_c, top_l, bot_c, bot_l, window_sse41(p->window[WINDOW_EFFECTS], x)));
+    }
+}
+
+AVX2 static inline __m256i channel_avx2(__m256i c, int shift) {
+    return _mm256_and_si256(_mm256_srli_epi16(c, shift), _mm256_set1_epi16(0x1F));
+}
+
+// 16 mask bits starting at x (a multiple of 16) as 16-bit lane masks
+AVX2 static inline __m256i window_avx2(const uint64_t *mask, unsigned x) {
+    const __m256i select = _mm256_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128,
+        0x100, 0x200, 0x400, 0x800, 0x1000, 0x2000, 0x4000, (short)0x8000);
+    __m256i bits = _mm256_set1_epi16((mask[x / 64] >> (x % 64)) & 0xFFFF);
+    return _mm256_cmpeq_epi16(_mm256_and_si256(bits, select), select);
+}
+
+AVX2 static inline __m256i effects_avx2(const struct composite_params *p, __m256i top_c, __m256i top_l, __m256i bot_c, __m256i bot_l, __m256i fx) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(-1);
+    const __m256i max = _mm256_set1_epi16(31);
+    const __m256i eva = _mm256_set1_epi16(p->eva), evb = _mm256_set1_epi16(p->evb), evy = _mm256_set1_epi16(p->evy);
+
+    __m256i first = _mm256_andnot_si256(_mm256_cmpeq_epi16(_mm256_and_si256(top_l, _mm256_set1_epi16(p->target1)), zero), ones);
+    __m256i second = _mm256_andnot_si256(_mm256_cmpeq_epi16(_mm256_and_si256(bot_l, _mm256_set1_epi16(p->target2)), zero), ones);
+    __m256i semi = _mm256_andnot_si256(_mm256_cmpeq_epi16(_mm256_and_si256(top_l, _mm256_set1_epi16(OBJ_SEMI)), zero), ones);
+
+    __m256i alpha_m = _mm256_and_si256(_mm256_and_si256(semi, second), fx);
+    __m256i other_m = _mm256_and_si256(_mm256_andnot_si256(alpha_m, first), fx);
+    if (p->effect == EFFECT_ALPHA)
+        alpha_m = _mm256_or_si256(alpha_m, _mm256_and_si256(other_m, second));
+
+    __m256i alpha = zero, other = zero;
+    for (int shift = 0; shift < 15; shift += 5) {
+        __m256i a = channel_avx2(top_c, shift), b = channel_avx2(bot_c, shift);
+        __m256i c = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(a, eva), _mm256_mullo_epi16(b, evb)), 4);
+        alpha = _mm256_or_si256(alpha, _mm256_slli_epi16(_mm256_min_epu16(c, max), shift));
+
+        if (p->effect == EFFECT_BRIGHTEN)
+            c = _mm256_add_epi16(a, _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(max, a), evy), 4));
+        else
+            c = _mm256_sub_epi16(a, _mm256_srli_epi16(_mm256_mullo_epi16(a, evy), 4));
+        other = _mm256_or_si256(other, _mm256_slli_epi16(c, shift));
+    }
+
+    __m256i color = _mm256_blendv_epi8(top_c, alpha, alpha_m);
+    if (p->effect == EFFECT_BRIGHTEN || p->effect == EFFECT_DARKEN)
+        color = _mm256_blendv_epi8(color, other, _mm256_andnot_si256(alpha_m, other_m));
+    return color;
+}
+
+AVX2 static void composite_avx2(const struct composite_params *p, const struct ppu_line *line, uint16_t *out) {
+    const __m256i transparent = _mm256_set1_epi16(PIXEL_TRANSPARENT);
+    const __m256i zero = _mm256_setzero_si256();
+
+    for (unsigned x = 0; x < SCREEN_WIDTH; x += 16) {
+        __m256i top_c = _mm256_set1_epi16(p->backdrop), top_l = _mm256_set1_epi16(LAYER_BD);
+        __m256i bot_c = top_c, bot_l = top_l;
+
+        for (unsigned i = 0; i < p->pass_count; i++) {
+            uint8_t pass = p->passes[i];
+            __m256i c, l, m;
+
+            if (pass < 4) {
+                c = _mm256_loadu_si256((const __m256i *)&line->bg[pass][x]);
+                l = _mm256_set1_epi16(LAYER_BG(pass));
+                m = _mm256_cmpeq_epi16(_mm256_and_si256(c, transparent), zero);
+                m = _mm256_and_si256(m, window_avx2(p->window[pass], x));
+            } else {
+                __m256i attr = _mm256_loadu_si256((const __m256i *)&line->obj_attr[x]);
+                c = _mm256_loadu_si256((const __m256i *)&line->obj[x]);
+                l = _mm256_or_si256(_mm256_set1_epi16(LAYER_OBJ), _mm256_and_si256(attr, _mm256_set1_epi16(OBJ_SEMI)));
+                m = _mm256_and_si256(_mm256_cmpeq_epi16(_mm256_and_si256(c, transparent), zero),
+                                     _mm256_cmpeq_epi16(_mm256_and_si256(attr, _mm256_set1_epi16(3)), _mm256_set1_epi16(pass - 4)));
+                m = _mm256_and_si256(m, window_avx2(p->window[4], x));
+            }
+
+            bot_c = _mm256_blendv_epi8(bot_c, top_c, m);
+            bot_l = _mm256_blendv_epi8(bot_l, top_l, m);
+            top_c = _mm256_blendv_epi8(top_c, c, m);
+            top_l = _mm256_blendv_epi8(top_l, l, m);
+        }
+
+        _mm256_storeu_si256((__m256i *)&out[x], effects_avx2(p, top_c, top_l, bot_c, bot_l, window_avx2(p->window[WINDOW_EFFECTS], x)));
+    }
+}
+
+AVX2 static void convert_avx2(const uint32_t *lut, const uint16_t *src, uint32_t *dst, unsigned count) {
+    const __m256i mask = _mm256_set1_epi32(0x7FFF);
+    unsigned x = 0;
+
+    for (; x + 8 <= count; x += 8) {
+        __m256i index = _mm256_and_si256(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)&src[x])), mask);
+        _mm256_storeu_si256((__m256i *)&dst[x], _mm256_i32gather_epi32((const int *)lut, index, 4));
+    }
+    convert_scalar(lut, src + x, dst + x, count - x);
+}
+
+#endif
+
+void ppu_select_composite(struct ppu *ppu) {
+    ppu->composite = composite_scalar;
+    ppu->composite_name = "scalar";
+    ppu->convert = convert_scalar;
+
+#ifdef PPU_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        ppu->composite = composite_avx2;
+        ppu->composite_name = "avx2";
+        ppu->convert = convert_avx2;
+    } else if (__builtin_cpu_supports("sse4.1")) {
+        ppu->composite = composite_sse41;
+        ppu->composite_name = "sse4.1";
+    }
+#endif
+}
@@ -0,0 +1,270 @@
+#include "ppu_thread.h"
+#include "memory.h"
+#include <string.h>
+#include <assert.h>
+#include <SDL3/SDL_mutex.h>
+#include <SDL3/SDL_thread.h>
+#include <SDL3/SDL_timer.h>
+
+_Static_assert(sizeof(struct ppu_cmd) == 16, "queue cells are 16 bytes");
+_Static_assert(PPU_SNAPSHOT_BYTES % sizeof(struct ppu_cmd) == 0, "snapshot fills whole cells");
+_Static_assert(sizeof(((struct ppu *)0)->affine) == sizeof(struct ppu_cmd), "affine state fills one cell");
+
+#define QUEUE_MASK      (PPU_QUEUE_CELLS - 1)
+#define SNAPSHOT_CELLS  (PPU_SNAPSHOT_BYTES / sizeof(struct ppu_cmd))
+#define LINE_CELLS      (2 + SNAPSHOT_CELLS)    // header, affine state, registers
+#define FRAME_FRESH     4
+
+// Single producer (emulation) / single consumer (renderer) ring. Each side
+// owns one index and only reads the other's, on separate cache lines.
+static struct {
+    struct ppu_cmd cells[PPU_QUEUE_CELLS];
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t tail __attribute__((aligned(64)));
+    bool sleeping __attribute__((aligned(64)));
+} queue;
+
+// The renderer's private copy of everything it reads.
+static struct {
+    uint8_t vram[VRAM_SIZE];
+    uint8_t oam[OAM_SIZE];
+    uint8_t palram[PALRAM_SIZE];
+    uint8_t io[IO_SIZE];
+} shadow;
+
+static struct ppu render;
+
+// Triple buffer: the renderer draws into `back`, publishes it by swapping it
+// with `ready`, the reader swaps `ready` with `front`. `ready` carries
+// FRAME_FRESH while it holds a frame nobody has taken yet.
+static uint32_t frames[3][SCREEN_WIDTH * SCREEN_HEIGHT];
+static uint32_t frame_numbers[3];
+static int back, ready, front;
+
+static SDL_Thread *thread;
+static SDL_Semaphore *wakeup;
+static bool active;
+
+static uint8_t *shadow_region(uint8_t region) {
+    switch (region) {
+        case REGION_PALRAM: return shadow.palram;
+        case REGION_VRAM:   return shadow.vram;
+        default:            return shadow.oam;
+    }
+}
+
+static const uint8_t *bus_region(uint8_t region) {
+    switch (region) {
+        case REGION_PALRAM: return mem.palram;
+        case REGION_VRAM:   return mem.vram;
+        default:            return mem.oam;
+    }
+}
+
+// Keeps a renderer's caches in sync after its memory changed.
+static void apply_write(struct ppu *ppu, uint8_t region, uint32_t offset, uint32_t size) {
+    switch (region) {
+        case REGION_VRAM:
+            // stores are aligned, so they never straddle a tile granule
+            ppu_vram_written(ppu, offset);
+            break;
+
+        case REGION_PALRAM:
+            ppu_palram_written(ppu, offset);
+            if (size == 4)
+                ppu_palram_written(ppu, offset + 2);
+            break;
+
+        default:
+            ppu_oam_written(ppu);
+            break;
+    }
+}
+
+static void wake_renderer(void) {
+    if (__atomic_exchange_n(&queue.sleeping, false, __ATOMIC_SEQ_CST))
+        SDL_SignalSemaphore(wakeup);
+}
+
+static uint32_t reserve(uint32_t count) {
+    uint32_t head = queue.head;
+
+    while (head - __atomic_load_n(&queue.tail, __ATOMIC_ACQUIRE) > PPU_QUEUE_CELLS - count) {
+        // the renderer may be asleep on a queue full of deltas
+        wake_renderer();
+        SDL_Delay(0);
+    }
+    return head;
+}
+
+static void publish(uint32_t head) {
+    __atomic_store_n(&queue.head, head, __ATOMIC_SEQ_CST);
+}
+
+static void push_cmd(const struct ppu_cmd *cmd) {
+    uint32_t head = reserve(1);
+    queue.cells[head & QUEUE_MASK] = *cmd;
+    publish(head + 1);
+}
+
+void ppu_bus_written(uint8_t region, uint32_t offset, uint32_t size) {
+    if (!active) {
+        apply_write(&ppu, region, offset, size);
+        return;
+    }
+
+    struct ppu_cmd cmd = {
+        .type = PPU_CMD_WRITE,
+        .region = region,
+        .size = size,
+        .offset = offset,
+    };
+    memcpy(&cmd.value, bus_region(region) + offset, size);
+    push_cmd(&cmd);
+}
+
+void ppu_thread_push_line(const struct ppu *ppu, unsigned y) {
+    uint32_t head = reserve(LINE_CELLS);
+
+    queue.cells[head & QUEUE_MASK] = (struct ppu_cmd) { .type = PPU_CMD_LINE, .y = y };
+    memcpy(&queue.cells[(head + 1) & QUEUE_MASK], ppu->affine, sizeof(struct ppu_cmd));
+    for (uint32_t i = 0; i < SNAPSHOT_CELLS; i++)
+        memcpy(&queue.cells[(head + 2 + i) & QUEUE_MASK], mem.io + i * sizeof(struct ppu_cmd), sizeof(struct ppu_cmd));
+
+    publish(head + LINE_CELLS);
+    wake_renderer();
+}
+
+void ppu_thread_push_frame(uint32_t frame) {
+    push_cmd(&(struct ppu_cmd) { .type = PPU_CMD_FRAME, .y = frame });
+    wake_renderer();
+}
+
+static void publish_frame(uint32_t frame) {
+    frame_numbers[back] = frame;
+    back = __atomic_exchange_n(&ready, back | FRAME_FRESH, __ATOMIC_ACQ_REL) & 3;
+    ppu_set_target(&render, frames[back], SCREEN_WIDTH * sizeof(uint32_t));
+}
+
+const uint32_t *ppu_thread_acquire_frame(uint32_t *frame) {
+    if (!(__atomic_load_n(&ready, __ATOMIC_ACQUIRE) & FRAME_FRESH))
+        return NULL;
+
+    front = __atomic_exchange_n(&ready, front, __ATOMIC_ACQ_REL) & 3;
+    if (frame)
+        *frame = frame_numbers[front];
+    return frames[front];
+}
+
+static int render_thread(void *data) {
+    (void)data;
+    uint32_t tail = queue.tail;
+
+    while (true) {
+        uint32_t head = __atomic_load_n(&queue.head, __ATOMIC_ACQUIRE);
+
+        if (tail == head) {
+            __atomic_store_n(&queue.tail, tail, __ATOMIC_RELEASE);
+            __atomic_store_n(&queue.sleeping, true, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&queue.head, __ATOMIC_SEQ_CST) == tail)
+                SDL_WaitSemaphore(wakeup);
+            __atomic_store_n(&queue.sleeping, false, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        // commands only ever get published whole
+        while (tail != head) {
+            const struct ppu_cmd *cmd = &queue.cells[tail & QUEUE_MASK];
+
+            switch (cmd->type) {
+                case PPU_CMD_WRITE:
+                    memcpy(shadow_region(cmd->region) + cmd->offset, &cmd->value, cmd->size);
+                    apply_write(&render, cmd->region, cmd->offset, cmd->size);
+                    tail++;
+                    break;
+
+                case PPU_CMD_LINE: {
+                    unsigned y = cmd->y;
+                    memcpy(render.affine, &queue.cells[(tail + 1) & QUEUE_MASK], sizeof(struct ppu_cmd));
+                    for (uint32_t i = 0; i < SNAPSHOT_CELLS; i++)
+                        memcpy(shadow.io + i * sizeof(struct ppu_cmd), &queue.cells[(tail + 2 + i) & QUEUE_MASK], sizeof(struct ppu_cmd));
+                    tail += LINE_CELLS;
+                    ppu_render_scanline(&render, y);
+                    break;
+                }
+
+                case PPU_CMD_FRAME:
+                    publish_frame(cmd->y);
+                    tail++;
+                    break;
+
+                case PPU_CMD_QUIT:
+                    __atomic_store_n(&queue.tail, tail + 1, __ATOMIC_RELEASE);
+                    return 0;
+            }
+        }
+        // hand the cells back once per batch, not per command
+        __atomic_store_n(&queue.tail, tail, __ATOMIC_RELEASE);
+    }
+}
+
+bool ppu_thread_start(void) {
+    assert(!active);
+
+    memcpy(shadow.vram, mem.vram, VRAM_SIZE);
+    memcpy(shadow.oam, mem.oam, OAM_SIZE);
+    memcpy(shadow.palram, mem.palram, PALRAM_SIZE);
+    memcpy(shadow.io, mem.io, IO_SIZE);
+
+    ppu_init(&render, shadow.vram, shadow.oam, shadow.palram, shadow.io);
+    ppu_set_color_format(&render, ppu.format, ppu.lcd_correction);
+    render.composite = ppu.composite;
+    render.composite_name = ppu.composite_name;
+    render.convert = ppu.convert;
+    render.affine_bg = ppu.affine_bg;
+    render.affine_obj = ppu.affine_obj;
+
+    // lines of the current frame already drawn carry over
+    back = 0;
+    ready = 1;
+    front = 2;
+    for (unsigned y = 0; y < SCREEN_HEIGHT; y++)
+        memcpy(&frames[back][y * SCREEN_WIDTH], (uint8_t *)ppu.pixels + y * ppu.pitch, SCREEN_WIDTH * sizeof(uint32_t));
+    ppu_set_target(&render, frames[back], SCREEN_WIDTH * sizeof(uint32_t));
+
+    queue.head = queue.tail = 0;
+    queue.sleeping = false;
+
+    wakeup = SDL_CreateSemaphore(0);
+    if (!wakeup)
+        return false;
+    thread = SDL_CreateThread(render_thread, "ppu", NULL);
+    if (!thread) {
+        SDL_DestroySemaphore(wakeup);
+        return false;
+    }
+    active = true;
+    return true;
+}
+
+void ppu_thread_stop(void) {
+    if (!active)
+        return;
+
+    push_cmd(&(struct ppu_cmd) { .type = PPU_CMD_QUIT });
+    wake_renderer();
+    SDL_WaitThread(thread, NULL);
+    SDL_DestroySemaphore(wakeup);
+    active = false;
+
+    // the bus side renderer missed every store made meanwhile
+    memset(ppu.tiles.dirty4, 0xFF, sizeof(ppu.tiles.dirty4));
+    memset(ppu.tiles.dirty8, 0xFF, sizeof(ppu.tiles.dirty8));
+    ppu_oam_written(&ppu);
+    for (uint32_t offset = 0; offset < PALRAM_SIZE; offset += 2)
+        ppu_palram_written(&ppu, offset);
+}
+
+bool ppu_thread_active(void) {
+    return active;
+}
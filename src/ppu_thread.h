@@ -0,0 +1,48 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "ppu.h"
+
+// Threaded PPU. The emulation thread keeps running ppu_tick() for timing but
+// instead of rasterizing it pushes, into a lock-free single producer / single
+// consumer queue:
+//  - every VRAM, palette and OAM store as a delta,
+//  - a snapshot of the PPU registers and the affine reference points when a
+//    visible line enters HBlank,
+//  - a marker when the frame ends.
+// The render thread replays those into its own copy of video memory and runs
+// the same scanline renderer, so frames are identical to the single threaded
+// ones, only produced in parallel.
+
+#define PPU_QUEUE_CELLS     (1 << 18)
+#define PPU_SNAPSHOT_BYTES  0x60    // DISPCNT up to and including BLDY
+
+enum {
+	PPU_CMD_WRITE,
+	PPU_CMD_LINE,
+	PPU_CMD_FRAME,
+	PPU_CMD_QUIT,
+};
+
+struct ppu_cmd {
+	uint8_t type;
+	uint8_t region;
+	uint16_t size;
+	uint32_t offset;
+	uint32_t value;
+	uint32_t y;
+};
+
+bool ppu_thread_start(void);
+void ppu_thread_stop(void);
+bool ppu_thread_active(void);
+
+// Called by the bus after a store to VRAM, palette RAM or OAM.
+void ppu_bus_written(uint8_t region, uint32_t offset, uint32_t size);
+
+void ppu_thread_push_line(const struct ppu *ppu, unsigned y);
+void ppu_thread_push_frame(uint32_t frame);
+
+// Latest completed frame, or NULL if none finished since the last call. The
+// buffer stays valid until the next call.
+const uint32_t *ppu_thread_acquire_frame(uint32_t *frame);
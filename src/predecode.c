@@ -0,0 +1,259 @@
+#include "predecode.h"
+#include "cpu.h"
+#include "mapped_file.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <SDL3/SDL_filesystem.h>
+#include <SDL3/SDL_mutex.h>
+#include <SDL3/SDL_thread.h>
+
+static char cache_dir[512] = "";
+
+static const char cache_magic[8] = "GBMUPDC";
+
+uint64_t rom_hash(const uint8_t *rom, size_t size) {
+    // FNV-1a over 64-bit words, ROM images are always word aligned in practice
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i = 0;
+
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, rom + i, sizeof(word));
+        hash = (hash ^ word) * 0x100000001b3ULL;
+    }
+    for (; i < size; i++)
+        hash = (hash ^ rom[i]) * 0x100000001b3ULL;
+
+    return hash ^ size;
+}
+
+bool predecode_set_cache_dir(const char *dir) {
+    cache_dir[0] = '\0';
+    if (!dir)
+        return true;
+
+    if (strlen(dir) >= sizeof(cache_dir) || !SDL_CreateDirectory(dir))
+        return false;
+    strcpy(cache_dir, dir);
+    return true;
+}
+
+// Entries are indices into the decode tables: a table fix that keeps the
+// handler counts still changes what a stored index means.
+static uint64_t decoder_hash(void) {
+    uint64_t arm = rom_hash((const uint8_t *)opcode_types, sizeof(opcode_types));
+    uint64_t thumb = rom_hash((const uint8_t *)thumb_opcode_types, sizeof(thumb_opcode_types));
+    return arm ^ (thumb * 0x100000001b3ULL);
+}
+
+static void cache_path(char *path, size_t len, uint64_t hash) {
+    snprintf(path, len, "%s/%016llx.pdc", cache_dir, (unsigned long long)hash);
+}
+
+static size_t image_size(size_t rom_size, size_t region_count) {
+    return sizeof(struct predecode_cache_header) + (rom_size + 3) / 4 + (rom_size + 1) / 2 + region_count;
+}
+
+static bool header_matches(const struct predecode_cache_header *hdr, uint64_t hash, size_t rom_size) {
+    return !memcmp(hdr->magic, cache_magic, sizeof(cache_magic))
+        && hdr->version == PREDECODE_CACHE_VERSION
+        && hdr->arm_handlers == ARM_HANDLER_COUNT
+        && hdr->thumb_handlers == THUMB_HANDLER_COUNT
+        && hdr->decoder == decoder_hash()
+        && hdr->hash == hash
+        && hdr->rom_size == rom_size;
+}
+
+static void alloc_image(struct predecode *pd) {
+    size_t size = image_size(pd->rom_size, pd->region_count);
+    void *image = NULL;
+
+    if (cache_dir[0]) {
+        char path[600];
+        size_t mapped_size = 0;
+
+        cache_path(path, sizeof(path), pd->hash);
+        image = map_file_private(path, &mapped_size);
+
+        if (image && (mapped_size != size || !header_matches(image, pd->hash, pd->rom_size))) {
+            unmap_file(image, mapped_size);
+            image = NULL;
+        }
+    }
+
+    pd->mapped = image != NULL;
+    if (!image) {
+        struct predecode_cache_header hdr = {
+            .version = PREDECODE_CACHE_VERSION,
+            .arm_handlers = ARM_HANDLER_COUNT,
+            .thumb_handlers = THUMB_HANDLER_COUNT,
+            .decoder = decoder_hash(),
+            .hash = pd->hash,
+            .rom_size = pd->rom_size,
+        };
+        memcpy(hdr.magic, cache_magic, sizeof(cache_magic));
+
+        image = calloc(1, size);
+        memcpy(image, &hdr, sizeof(hdr));
+    }
+
+    pd->image = image;
+    pd->image_size = size;
+    pd->arm = (uint8_t *)image + sizeof(struct predecode_cache_header);
+    pd->thumb = pd->arm + (pd->rom_size + 3) / 4;
+    pd->region_state = pd->thumb + (pd->rom_size + 1) / 2;
+}
+
+static void free_image(struct predecode *pd) {
+    if (cache_dir[0] && pd->dirty) {
+        char path[600];
+
+        // half-finished regions get queued again by the next run
+        for (size_t r = 0; r < pd->region_count; r++) {
+            if (pd->region_state[r] == PREDECODE_QUEUED)
+                pd->region_state[r] = PREDECODE_UNTOUCHED;
+        }
+
+        cache_path(path, sizeof(path), pd->hash);
+        write_file_atomic(path, pd->image, pd->image_size);
+    }
+
+    if (pd->mapped)
+        unmap_file(pd->image, pd->image_size);
+    else
+        free(pd->image);
+}
+
+static void queue_region(struct predecode *pd, uint32_t offset) {
+    uint8_t *state = &pd->region_state[offset >> PREDECODE_REGION_SHIFT];
+    uint8_t expected = PREDECODE_UNTOUCHED;
+
+    if (!__atomic_load_n(&pd->wakeup, __ATOMIC_ACQUIRE))
+        return;
+
+    if (__atomic_compare_exchange_n(state, &expected, PREDECODE_QUEUED, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        SDL_SignalSemaphore(pd->wakeup);
+}
+
+uint8_t predecode_arm_miss(struct predecode *pd, uint32_t offset, uint32_t insn) {
+    uint8_t idx = arm_decode(insn);
+
+    // decoding is a pure function of the word, racing with the worker is harmless
+    __atomic_store_n(&pd->arm[offset >> 2], idx, __ATOMIC_RELAXED);
+    __atomic_store_n(&pd->dirty, true, __ATOMIC_RELAXED);
+    queue_region(pd, offset);
+    return idx;
+}
+
+uint8_t predecode_thumb_miss(struct predecode *pd, uint32_t offset, uint16_t insn) {
+    uint8_t idx = thumb_decode(insn);
+
+    __atomic_store_n(&pd->thumb[offset >> 1], idx, __ATOMIC_RELAXED);
+    __atomic_store_n(&pd->dirty, true, __ATOMIC_RELAXED);
+    queue_region(pd, offset);
+    return idx;
+}
+
+static void decode_region(struct predecode *pd, size_t region) {
+    size_t start = region << PREDECODE_REGION_SHIFT;
+    size_t end = start + (1u << PREDECODE_REGION_SHIFT);
+
+    if (end > pd->rom_size)
+        end = pd->rom_size;
+
+    for (size_t off = start; off + 4 <= end; off += 4) {
+        if (__atomic_load_n(&pd->arm[off >> 2], __ATOMIC_RELAXED))
+            continue;
+        uint32_t insn;
+        memcpy(&insn, pd->rom + off, sizeof(insn));
+        __atomic_store_n(&pd->arm[off >> 2], arm_decode(insn), __ATOMIC_RELAXED);
+    }
+
+    for (size_t off = start; off + 2 <= end; off += 2) {
+        if (__atomic_load_n(&pd->thumb[off >> 1], __ATOMIC_RELAXED))
+            continue;
+        uint16_t insn;
+        memcpy(&insn, pd->rom + off, sizeof(insn));
+        __atomic_store_n(&pd->thumb[off >> 1], thumb_decode(insn), __ATOMIC_RELAXED);
+    }
+}
+
+static int predecode_worker(void *data) {
+    struct predecode *pd = data;
+
+    // start_worker publishes the semaphore under the lock, after creating us
+    SDL_LockMutex(pd->lock);
+    SDL_Semaphore *wakeup = pd->wakeup;
+    SDL_UnlockMutex(pd->lock);
+
+    while (true) {
+        SDL_WaitSemaphore(wakeup);
+        if (__atomic_load_n(&pd->quit, __ATOMIC_ACQUIRE))
+            break;
+
+        for (size_t r = 0; r < pd->region_count; r++) {
+            if (__atomic_load_n(&pd->region_state[r], __ATOMIC_RELAXED) != PREDECODE_QUEUED)
+                continue;
+
+            decode_region(pd, r);
+            __atomic_store_n(&pd->region_state[r], PREDECODE_DONE, __ATOMIC_RELEASE);
+            __atomic_store_n(&pd->dirty, true, __ATOMIC_RELAXED);
+        }
+    }
+
+    return 0;
+}
+
+struct predecode *predecode_acquire(const uint8_t *rom, size_t size) {
+    struct predecode *pd = calloc(1, sizeof(*pd));
+
+    pd->hash = rom_hash(rom, size);
+    pd->rom = rom;
+    pd->rom_size = size;
+    pd->region_count = (size + (1u << PREDECODE_REGION_SHIFT) - 1) >> PREDECODE_REGION_SHIFT;
+    alloc_image(pd);
+    pd->lock = SDL_CreateMutex();
+    return pd;
+}
+
+bool predecode_start_worker(struct predecode *pd) {
+    bool ok = true;
+
+    SDL_LockMutex(pd->lock);
+    if (!pd->worker) {
+        SDL_Semaphore *wakeup = SDL_CreateSemaphore(0);
+        pd->worker = SDL_CreateThread(predecode_worker, "predecode", pd);
+        ok = pd->worker != NULL;
+
+        // publish the semaphore last so misses only queue once someone listens
+        if (ok)
+            __atomic_store_n(&pd->wakeup, wakeup, __ATOMIC_RELEASE);
+        else
+            SDL_DestroySemaphore(wakeup);
+    }
+    SDL_UnlockMutex(pd->lock);
+
+    return ok;
+}
+
+static void stop_worker(struct predecode *pd) {
+    if (!pd->worker)
+        return;
+
+    __atomic_store_n(&pd->quit, true, __ATOMIC_RELEASE);
+    SDL_SignalSemaphore(pd->wakeup);
+    SDL_WaitThread(pd->worker, NULL);
+    SDL_DestroySemaphore(pd->wakeup);
+    pd->worker = NULL;
+    pd->wakeup = NULL;
+}
+
+void predecode_release(struct predecode *pd) {
+    stop_worker(pd);
+    SDL_DestroyMutex(pd->lock);
+    free_image(pd);
+    free(pd);
+}
@@ -0,0 +1,93 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "memory.h"
+
+// Predecoded mirror of a GamePak ROM: one ARM handler index per word and one
+// Thumb handler index per halfword. Entries are filled in lazily the first
+// time an instruction is fetched; an optional worker thread then decodes the
+// rest of every 4KB region that has been executed from. ROM never changes,
+// so with the on-disk cache, processes running the same image share the
+// cache file's pages through their private mappings until they write to them.
+
+#define PREDECODE_REGION_SHIFT  12
+#define PREDECODE_CACHE_VERSION 2
+
+enum {
+	PREDECODE_UNTOUCHED = 0,
+	PREDECODE_QUEUED,
+	PREDECODE_DONE
+};
+
+// On-disk image of a mirror, the three tables follow the header back to back.
+struct predecode_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint16_t arm_handlers;
+	uint16_t thumb_handlers;
+	uint64_t decoder;       // hash of the decode tables the indices came from
+	uint64_t hash;
+	uint64_t rom_size;
+};
+
+struct predecode {
+	uint64_t hash;
+	const uint8_t *rom;
+	size_t rom_size;
+
+	// header and tables live in one block, either heap allocated or a private
+	// mapping of the cache file from an earlier run
+	void *image;
+	size_t image_size;
+	bool mapped;
+	bool dirty;
+
+	uint8_t *arm;           // handler index per ROM word, 0 = not decoded
+	uint8_t *thumb;         // handler index per ROM halfword, 0 = not decoded
+	uint8_t *region_state;  // PREDECODE_* per region
+	size_t region_count;
+
+	struct SDL_Mutex *lock;
+	struct SDL_Semaphore *wakeup;
+	struct SDL_Thread *worker;
+	bool quit;
+};
+
+uint64_t rom_hash(const uint8_t *rom, size_t size);
+
+// Mirrors are persisted to <dir>/<rom hash>.pdc when they are released and
+// mapped back in by the next run. Off until a directory is set; NULL turns
+// it off again. False, with the cache off, if `dir` can't be used.
+bool predecode_set_cache_dir(const char *dir);
+
+// `rom` has to outlive the mirror, the worker reads from it.
+struct predecode *predecode_acquire(const uint8_t *rom, size_t size);
+void predecode_release(struct predecode *pd);
+bool predecode_start_worker(struct predecode *pd);
+
+uint8_t predecode_arm_miss(struct predecode *pd, uint32_t offset, uint32_t insn);
+uint8_t predecode_thumb_miss(struct predecode *pd, uint32_t offset, uint16_t insn);
+
+static inline bool predecode_covers(const struct predecode *pd, uint32_t addr) {
+	uint8_t region = (addr >> 24) & 0xF;
+	return region >= REGION_ROM_WS0 && region <= REGION_ROM_WS2
+		&& (addr & (ROM_MAX_SIZE - 1)) < pd->rom_size;
+}
+
+// `insn` is the word already fetched for `addr`, a miss decodes it in place
+static inline uint8_t predecode_arm(struct predecode *pd, uint32_t addr, uint32_t insn) {
+	uint32_t offset = addr & (ROM_MAX_SIZE - 4);
+	uint8_t idx = __atomic_load_n(&pd->arm[offset >> 2], __ATOMIC_RELAXED);
+	if (!idx)
+		idx = predecode_arm_miss(pd, offset, insn);
+	return idx;
+}
+
+static inline uint8_t predecode_thumb(struct predecode *pd, uint32_t addr, uint16_t insn) {
+	uint32_t offset = addr & (ROM_MAX_SIZE - 2);
+	uint8_t idx = __atomic_load_n(&pd->thumb[offset >> 1], __ATOMIC_RELAXED);
+	if (!idx)
+		idx = predecode_thumb_miss(pd, offset, insn);
+	return idx;
+}
@@ -0,0 +1,459 @@
+#include "psg.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define SEQ_CLOCKS      8192    // 512Hz frame sequencer, in DMG clocks
+#define BLIP_SIZE       4096    // samples, a few frames at 48kHz
+
+// Bits that read back as 1, from NR10 up to NR52.
+static const uint8_t read_mask[] = {
+    0x80, 0x3F, 0x00, 0xFF, 0xBF,
+    0xFF, 0x3F, 0x00, 0xFF, 0xBF,
+    0x7F, 0xFF, 0x9F, 0xFF, 0xBF,
+    0xFF, 0xFF, 0x00, 0x00, 0xBF,
+    0x00, 0x00, 0x70,
+};
+
+static const uint8_t duty_table[4] = { 0x01, 0x81, 0x87, 0x7E };
+static const uint8_t noise_divisor[8] = { 8, 16, 32, 48, 64, 80, 96, 112 };
+
+// NRx0 of each channel; the channel's registers follow it.
+static const uint8_t channel_base[4] = { NR10, NR21 - 1, NR30, NR41 - 1 };
+
+void psg_init(struct psg *psg, unsigned clock_mul, double sample_rate, bool gba) {
+    memset(psg, 0, sizeof(*psg));
+    psg->clock_mul = clock_mul;
+    psg->next_seq = SEQ_CLOCKS * clock_mul;
+    psg->scale = 64;
+    psg->gba = gba;
+    psg->powered = true;
+    psg->lfsr = 0x7FFF;
+
+    for (int s = 0; s < 2; s++) {
+        bool ok = blip_init(&psg->out[s], BLIP_SIZE);
+        assert(ok);
+    }
+    psg_set_sample_rate(psg, sample_rate);
+}
+
+void psg_set_sample_rate(struct psg *psg, double sample_rate) {
+    double clock_rate = (double)PSG_DMG_CLOCK * psg->clock_mul;
+
+    assert(psg->now == 0);
+    blip_set_rates(&psg->out[0], clock_rate, sample_rate);
+    blip_set_rates(&psg->out[1], clock_rate, sample_rate);
+    for (int i = 0; psg->stems && i < 8; i++)
+        blip_set_rates(&psg->stems[i], clock_rate, sample_rate);
+}
+
+void psg_enable_stems(struct psg *psg) {
+    if (psg->stems)
+        return;
+
+    psg->stems = calloc(8, sizeof(struct blip));
+    for (int i = 0; i < 8; i++) {
+        bool ok = blip_init(&psg->stems[i], BLIP_SIZE);
+        assert(ok);
+        psg->stems[i].factor = psg->out[i & 1].factor;
+        psg->stems[i].offset = psg->out[i & 1].offset;
+        // start from the level the channel already has
+        blip_add_delta(&psg->stems[i], psg->now, psg->ch[i / 2].out[i & 1]);
+    }
+}
+
+void psg_free(struct psg *psg) {
+    blip_free(&psg->out[0]);
+    blip_free(&psg->out[1]);
+    if (psg->stems) {
+        for (int i = 0; i < 8; i++)
+            blip_free(&psg->stems[i]);
+        free(psg->stems);
+        psg->stems = NULL;
+    }
+}
+
+static uint8_t reg(const struct psg *psg, unsigned c, unsigned n) {
+    return psg->regs[channel_base[c] + n];
+}
+
+static uint16_t channel_freq(const struct psg *psg, unsigned c) {
+    return reg(psg, c, 3) | (reg(psg, c, 4) & 7) << 8;
+}
+
+static uint32_t channel_period(const struct psg *psg, unsigned c) {
+    switch (c) {
+        case 0:
+        case 1:
+            return (2048 - channel_freq(psg, c)) * 4 * psg->clock_mul;
+        case 2:
+            return (2048 - channel_freq(psg, c)) * 2 * psg->clock_mul;
+        default: {
+            uint8_t nr43 = psg->regs[NR43];
+            return (noise_divisor[nr43 & 7] << (nr43 >> 4)) * psg->clock_mul;
+        }
+    }
+}
+
+static uint8_t wave_sample(const struct psg *psg, unsigned pos) {
+    unsigned bank = psg->gba ? (psg->regs[NR30] >> 6) & 1 : 0;
+    unsigned n = (bank * 32 + pos) & 63;
+    uint8_t byte = psg->wave[n >> 1];
+    return n & 1 ? byte & 0xF : byte >> 4;
+}
+
+static uint8_t channel_level(const struct psg *psg, unsigned c) {
+    const struct psg_channel *ch = &psg->ch[c];
+
+    switch (c) {
+        case 0:
+        case 1:
+            return duty_table[reg(psg, c, 1) >> 6] >> (7 - ch->pos) & 1 ? ch->volume : 0;
+        case 2: {
+            uint8_t nr32 = psg->regs[NR32];
+            uint8_t sample = wave_sample(psg, ch->pos);
+            if (psg->gba && (nr32 & 0x80))
+                return sample * 3 / 4;
+            return (nr32 >> 5) & 3 ? sample >> (((nr32 >> 5) & 3) - 1) : 0;
+        }
+        default:
+            return psg->lfsr & 1 ? 0 : ch->volume;
+    }
+}
+
+// Hands the channel's change of output at `clock` to the blip buffers.
+static void update_output(struct psg *psg, unsigned c, uint32_t clock) {
+    struct psg_channel *ch = &psg->ch[c];
+    if (psg->silent)
+        return;
+
+    uint8_t nr50 = psg->regs[NR50], nr51 = psg->regs[NR51];
+    int32_t level = ch->enabled && ch->dac ? ch->level : 0;
+    int32_t amp[2] = {
+        nr51 & (0x10 << c) ? level * (((nr50 >> 4) & 7) + 1) * psg->scale : 0,
+        nr51 & (0x01 << c) ? level * ((nr50 & 7) + 1) * psg->scale : 0,
+    };
+
+    for (int s = 0; s < 2; s++) {
+        if (amp[s] != ch->out[s]) {
+            blip_add_delta(&psg->out[s], clock, amp[s] - ch->out[s]);
+            if (psg->stems)
+                blip_add_delta(&psg->stems[c * 2 + s], clock, amp[s] - ch->out[s]);
+            ch->out[s] = amp[s];
+        }
+    }
+}
+
+static void set_level(struct psg *psg, unsigned c, uint32_t clock) {
+    psg->ch[c].level = channel_level(psg, c);
+    update_output(psg, c, clock);
+}
+
+static void step_lfsr(struct psg *psg) {
+    uint16_t bit = (psg->lfsr ^ (psg->lfsr >> 1)) & 1;
+    psg->lfsr = (psg->lfsr >> 1) | bit << 14;
+    if (psg->regs[NR43] & 8)
+        psg->lfsr = (psg->lfsr & ~0x40) | bit << 6;
+}
+
+// Walks the channel's waveform from one step to the next up to `clock`.
+// Steps that can't change the output are skipped in one go.
+static void run_channel(struct psg *psg, unsigned c, uint32_t clock) {
+    struct psg_channel *ch = &psg->ch[c];
+    if (!ch->enabled || ch->next > clock)
+        return;
+
+    bool silent = !ch->dac || (c == 2 ? !(psg->regs[NR32] & 0xE0) : !ch->volume);
+    if (silent && c != 3) {
+        uint32_t steps = (clock - ch->next) / ch->period + 1;
+        unsigned wrap = c == 2 && !(psg->gba && (psg->regs[NR30] & 0x20)) ? 32 : c == 2 ? 64 : 8;
+        ch->pos = (ch->pos + steps) & (wrap - 1);
+        ch->next += steps * ch->period;
+        return;
+    }
+
+    for (; ch->next <= clock; ch->next += ch->period) {
+        switch (c) {
+            case 0:
+            case 1:
+                ch->pos = (ch->pos + 1) & 7;
+                break;
+            case 2:
+                ch->pos = (ch->pos + 1) & (psg->gba && (psg->regs[NR30] & 0x20) ? 63 : 31);
+                break;
+            default:
+                step_lfsr(psg);
+                break;
+        }
+        uint8_t level = channel_level(psg, c);
+        if (level != ch->level) {
+            ch->level = level;
+            update_output(psg, c, ch->next);
+        }
+    }
+}
+
+static void run_channels(struct psg *psg, uint32_t clock) {
+    for (unsigned c = 0; c < 4; c++)
+        run_channel(psg, c, clock);
+}
+
+static uint16_t sweep_calc(struct psg *psg) {
+    uint8_t nr10 = psg->regs[NR10];
+    uint16_t delta = psg->sweep_shadow >> (nr10 & 7);
+    uint16_t freq = nr10 & 8 ? psg->sweep_shadow - delta : psg->sweep_shadow + delta;
+
+    if (freq > 2047)
+        psg->ch[0].enabled = false;
+    return freq;
+}
+
+static void clock_sweep(struct psg *psg) {
+    uint8_t nr10 = psg->regs[NR10];
+    uint8_t period = (nr10 >> 4) & 7;
+
+    if (--psg->sweep_timer)
+        return;
+    psg->sweep_timer = period ? period : 8;
+    if (!psg->sweep_enabled || !period)
+        return;
+
+    uint16_t freq = sweep_calc(psg);
+    if (freq <= 2047 && (nr10 & 7)) {
+        psg->sweep_shadow = freq;
+        psg->regs[NR13] = freq;
+        psg->regs[NR14] = (psg->regs[NR14] & ~7) | freq >> 8;
+        psg->ch[0].period = channel_period(psg, 0);
+        sweep_calc(psg);
+    }
+}
+
+static void clock_envelope(struct psg *psg, unsigned c) {
+    struct psg_channel *ch = &psg->ch[c];
+    uint8_t nrx2 = reg(psg, c, 2);
+
+    if (!(nrx2 & 7) || --ch->env_timer)
+        return;
+    ch->env_timer = nrx2 & 7;
+    if ((nrx2 & 8) && ch->volume < 15)
+        ch->volume++;
+    else if (!(nrx2 & 8) && ch->volume > 0)
+        ch->volume--;
+}
+
+// 512Hz: lengths at 256Hz, the sweep at 128Hz, envelopes at 64Hz.
+static void sequencer_step(struct psg *psg, uint32_t clock) {
+    uint8_t step = psg->seq_step++ & 7;
+
+    if (!(step & 1)) {
+        for (unsigned c = 0; c < 4; c++) {
+            struct psg_channel *ch = &psg->ch[c];
+            if ((reg(psg, c, 4) & 0x40) && ch->length && !--ch->length)
+                ch->enabled = false;
+        }
+    }
+    if (step == 2 || step == 6)
+        clock_sweep(psg);
+    if (step == 7) {
+        clock_envelope(psg, 0);
+        clock_envelope(psg, 1);
+        clock_envelope(psg, 3);
+    }
+
+    for (unsigned c = 0; c < 4 && !psg->silent; c++)
+        set_level(psg, c, clock);
+}
+
+static void run(struct psg *psg, uint32_t clock) {
+    assert(clock >= psg->now);
+
+    while (psg->next_seq <= clock) {
+        if (!psg->silent)
+            run_channels(psg, psg->next_seq);
+        sequencer_step(psg, psg->next_seq);
+        psg->next_seq += SEQ_CLOCKS * psg->clock_mul;
+    }
+    if (!psg->silent)
+        run_channels(psg, clock);
+    psg->now = clock;
+}
+
+static void trigger(struct psg *psg, unsigned c, uint32_t clock) {
+    struct psg_channel *ch = &psg->ch[c];
+
+    ch->enabled = ch->dac;
+    if (!ch->length)
+        ch->length = c == 2 ? 256 : 64;
+    ch->volume = reg(psg, c, 2) >> 4;
+    ch->env_timer = reg(psg, c, 2) & 7;
+    ch->period = channel_period(psg, c);
+    ch->next = clock + ch->period;
+
+    if (c == 2)
+        ch->pos = 0;
+    if (c == 3)
+        psg->lfsr = 0x7FFF;
+    if (c == 0) {
+        uint8_t nr10 = psg->regs[NR10];
+        psg->sweep_shadow = channel_freq(psg, 0);
+        psg->sweep_timer = (nr10 >> 4) & 7 ? (nr10 >> 4) & 7 : 8;
+        psg->sweep_enabled = (nr10 & 0x70) || (nr10 & 7);
+        if (nr10 & 7)
+            sweep_calc(psg);
+    }
+}
+
+static void power_off(struct psg *psg, uint32_t clock) {
+    memset(psg->regs + NR10, 0, NR52 - NR10);
+    for (unsigned c = 0; c < 4; c++) {
+        psg->ch[c].enabled = false;
+        psg->ch[c].dac = false;
+        psg->ch[c].length = 0;
+        update_output(psg, c, clock);
+    }
+    psg->powered = false;
+}
+
+static uint8_t *wave_byte(struct psg *psg, uint8_t reg) {
+    // the GBA's CPU sees the bank that isn't playing
+    unsigned bank = psg->gba ? !((psg->regs[NR30] >> 6) & 1) : 0;
+    return &psg->wave[bank * 16 + (reg - WAVE_RAM)];
+}
+
+void psg_write(struct psg *psg, uint8_t reg, uint8_t value, uint32_t clock) {
+    assert(reg >= NR10 && reg < PSG_REGS);
+    run(psg, clock);
+
+    if (reg >= WAVE_RAM) {
+        *wave_byte(psg, reg) = value;
+        return;
+    }
+    if (reg == NR52) {
+        if (!(value & 0x80) && psg->powered)
+            power_off(psg, clock);
+        else if ((value & 0x80) && !psg->powered) {
+            psg->powered = true;
+            psg->seq_step = 0;
+        }
+        return;
+    }
+    if (!psg->powered || reg > NR52)
+        return;
+
+    psg->regs[reg] = value;
+
+    if (reg == NR50 || reg == NR51) {
+        for (unsigned c = 0; c < 4; c++)
+            update_output(psg, c, clock);
+        return;
+    }
+
+    unsigned c = reg < NR21 ? 0 : reg < NR30 ? 1 : reg < NR41 - 1 ? 2 : 3;
+    struct psg_channel *ch = &psg->ch[c];
+
+    switch (reg - channel_base[c]) {
+        case 0:
+            if (c == 2) {
+                ch->dac = value & 0x80;
+                if (!ch->dac)
+                    ch->enabled = false;
+            }
+            break;
+        case 1:
+            ch->length = c == 2 ? 256 - value : 64 - (value & 0x3F);
+            break;
+        case 2:
+            if (c != 2) {
+                ch->dac = value & 0xF8;
+                if (!ch->dac)
+                    ch->enabled = false;
+            }
+            break;
+        case 3:
+            ch->period = channel_period(psg, c);
+            break;
+        case 4:
+            ch->period = channel_period(psg, c);
+            if (value & 0x80)
+                trigger(psg, c, clock);
+            break;
+    }
+    set_level(psg, c, clock);
+}
+
+uint8_t psg_read(struct psg *psg, uint8_t reg, uint32_t clock) {
+    assert(reg >= NR10 && reg < PSG_REGS);
+    run(psg, clock);
+
+    if (reg >= WAVE_RAM)
+        return *wave_byte(psg, reg);
+    if (reg > NR52)
+        return 0xFF;
+    if (reg == NR52) {
+        uint8_t status = psg->powered ? 0xF0 : 0x70;
+        for (unsigned c = 0; c < 4; c++)
+            status |= psg->ch[c].enabled << c;
+        return status;
+    }
+    return psg->regs[reg] | read_mask[reg - NR10];
+}
+
+void psg_set_scale(struct psg *psg, int32_t scale, uint32_t clock) {
+    run(psg, clock);
+    psg->scale = scale;
+    for (unsigned c = 0; c < 4; c++)
+        update_output(psg, c, clock);
+}
+
+void psg_end_frame(struct psg *psg, uint32_t clock) {
+    run(psg, clock);
+
+    for (unsigned c = 0; c < 4; c++) {
+        struct psg_channel *ch = &psg->ch[c];
+        ch->next = ch->next > clock ? ch->next - clock : 0;
+    }
+    psg->next_seq -= clock;
+    psg->now = 0;
+
+    if (!psg->silent) {
+        blip_end_frame(&psg->out[0], clock);
+        blip_end_frame(&psg->out[1], clock);
+        for (int i = 0; psg->stems && i < 8; i++)
+            blip_end_frame(&psg->stems[i], clock);
+    }
+}
+
+void psg_set_silent(struct psg *psg, bool silent, uint32_t clock) {
+    run(psg, clock);
+    if (silent == psg->silent)
+        return;
+
+    psg->silent = silent;
+    if (silent)
+        return;
+
+    // the buffers hold whatever was left when output stopped, start over
+    // from silence at `clock`
+    blip_clear(&psg->out[0]);
+    blip_clear(&psg->out[1]);
+    for (int i = 0; psg->stems && i < 8; i++)
+        blip_clear(&psg->stems[i]);
+    for (unsigned c = 0; c < 4; c++) {
+        struct psg_channel *ch = &psg->ch[c];
+        ch->out[0] = ch->out[1] = 0;
+        if (ch->next < clock)
+            ch->next = clock;
+        set_level(psg, c, clock);
+    }
+}
+
+uint32_t psg_read_samples(struct psg *psg, int16_t *frames, uint32_t count) {
+    blip_read_samples(&psg->out[0], frames, count, 2);
+    return blip_read_samples(&psg->out[1], frames + 1, count, 2);
+}
+
+uint32_t psg_read_stem(struct psg *psg, unsigned channel, int16_t *frames, uint32_t count) {
+    assert(psg->stems);
+    blip_read_samples(&psg->stems[channel * 2], frames, count, 2);
+    return blip_read_samples(&psg->stems[channel * 2 + 1], frames + 1, count, 2);
+}
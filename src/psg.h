@@ -0,0 +1,91 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "blip.h"
+
+// The four Game Boy sound channels, shared by the DMG and the GBA. Channels
+// don't run per clock: a write or a read first catches the generator up to
+// its clock, walking each channel from one output transition to the next
+// and handing every change to the blip buffers. Clocks are the host CPU's,
+// counted from the start of the current frame.
+
+#define PSG_DMG_CLOCK       4194304
+
+// DMG register numbers, the low byte of their 0xFFxx address
+enum {
+	NR10 = 0x10, NR11, NR12, NR13, NR14,
+	NR21 = 0x16, NR22, NR23, NR24,
+	NR30 = 0x1A, NR31, NR32, NR33, NR34,
+	NR41 = 0x20, NR42, NR43, NR44,
+	NR50 = 0x24, NR51, NR52,
+	WAVE_RAM = 0x30,
+};
+
+#define PSG_REGS            0x40
+
+struct psg_channel {
+	bool enabled;
+	bool dac;
+	uint8_t volume;         // envelope output, 0-15
+	uint8_t env_timer;
+	uint16_t length;        // ticks left while the length counter is enabled
+	uint16_t freq;
+	uint32_t period;        // clocks per waveform step
+	uint32_t next;          // clock of the next waveform step
+	uint8_t pos;            // duty step, wave sample
+	uint8_t level;          // current digital output, 0-15
+	int32_t out[2];         // what the blip buffers last heard, left/right
+};
+
+struct psg {
+	struct psg_channel ch[4];
+	uint8_t regs[PSG_REGS];
+	uint8_t wave[32];       // two banks on the GBA, only the first on the DMG
+
+	// channel 1 sweep
+	uint16_t sweep_shadow;
+	uint8_t sweep_timer;
+	bool sweep_enabled;
+	uint16_t lfsr;
+
+	unsigned clock_mul;     // host clocks per DMG clock
+	uint32_t next_seq;      // clock of the next frame sequencer step
+	uint8_t seq_step;
+	uint32_t now;           // generators have run up to here
+
+	int32_t scale;          // output amplitude per channel level and volume step
+	bool gba;
+	bool powered;
+	bool silent;            // registers, lengths and sweep only, no samples
+
+	struct blip out[2];
+	struct blip *stems;     // [channel * 2 + side], NULL unless enabled
+};
+
+void psg_init(struct psg *psg, unsigned clock_mul, double sample_rate, bool gba);
+void psg_free(struct psg *psg);
+
+// Only between frames, clocks already added map to samples at the old rate.
+void psg_set_sample_rate(struct psg *psg, double sample_rate);
+
+void psg_write(struct psg *psg, uint8_t reg, uint8_t value, uint32_t clock);
+uint8_t psg_read(struct psg *psg, uint8_t reg, uint32_t clock);
+
+// Keeps a separate pair of blip buffers per channel from now on, read with
+// psg_read_stem(), for per-channel capture.
+void psg_enable_stems(struct psg *psg);
+
+// A silent PSG keeps everything the CPU can observe (status bits, length
+// counters, sweep overflow) but doesn't step waveforms or produce samples.
+void psg_set_silent(struct psg *psg, bool silent, uint32_t clock);
+
+// GBA mixing ratio for the whole PSG (SOUNDCNT_H bits 0-1).
+void psg_set_scale(struct psg *psg, int32_t scale, uint32_t clock);
+
+// Catches up to `clock`, then makes it clock 0 of the next frame. The
+// frame's samples are then available in both blip buffers.
+void psg_end_frame(struct psg *psg, uint32_t clock);
+
+// Reads up to `count` interleaved stereo frames.
+uint32_t psg_read_samples(struct psg *psg, int16_t *frames, uint32_t count);
+uint32_t psg_read_stem(struct psg *psg, unsigned channel, int16_t *frames, uint32_t count);
@@ -0,0 +1,48 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// Polyphase windowed-sinc resampler for the Direct Sound channels. Samples
+// collected during a frame are converted in one batch when the frame ends:
+// each output is a RESAMPLE_TAPS dot product between the input and the
+// kernel phase nearest its fractional position, which the SIMD variants do
+// a whole phase at a time.
+
+#define RESAMPLE_TAPS           16
+#define RESAMPLE_PHASE_BITS     6
+#define RESAMPLE_PHASES         (1 << RESAMPLE_PHASE_BITS)
+#define RESAMPLE_INPUT          8192    // buffered input samples
+#define RESAMPLE_MAX_RATIO      4       // input rates above this are clamped
+
+typedef float resample_kernel[RESAMPLE_PHASES][RESAMPLE_TAPS];
+
+// Produces `count` outputs starting at `pos` (32.32 fixed point, in input
+// samples) and advancing by `step`.
+typedef void (*resample_fn)(const float *input, const resample_kernel *kernel, uint64_t pos, uint64_t step, float *out, uint32_t count);
+
+struct resampler {
+	resample_kernel kernel __attribute__((aligned(32)));
+	float input[RESAMPLE_INPUT];
+	uint32_t count;         // input samples buffered
+	uint64_t pos;           // of the next output, from input[0]
+	uint64_t step;          // 0 while the input rate is unknown
+	double in_rate;
+	double out_rate;
+	double cutoff;          // of the current kernel, relative to input Nyquist
+	resample_fn run;
+	const char *name;
+};
+
+void resampler_init(struct resampler *r);
+
+// The kernel is rebuilt when its cutoff, which follows the lower of the two
+// Nyquist frequencies, changes.
+void resampler_set_rates(struct resampler *r, double in_rate, double out_rate);
+
+void resampler_push(struct resampler *r, const int8_t *samples, uint32_t count);
+
+// Writes exactly `count` outputs. Missing input repeats the last sample.
+void resampler_read(struct resampler *r, float *out, uint32_t count);
+
+// A variant by name ("scalar", "sse", "avx2"), NULL if this CPU lacks it.
+resample_fn resample_variant(const char *name);